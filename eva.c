@@ -1,3 +1,4 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS, MAP_NORESERVE and madvise
 #include "eva.h"
 #include <stdlib.h>
 #include <string.h>
@@ -8,32 +9,66 @@
 #include <sys/time.h>
 #include <ctype.h>
 #include <assert.h>
+#include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <setjmp.h>
 
 #ifdef __GNUC__
   #define LABELS_AS_VALUES
 #endif
 
-#define ES_TAG_BITS          3
-#define ES_TAG_MASK          ((1 << ES_TAG_BITS) - 1)
 #define ES_PAYLOAD_MASK      (~(uintptr_t)ES_TAG_MASK)
 #define ES_PAYLOAD_BITS      (sizeof(uintptr_t) * 8 - ES_TAG_BITS)
 #define ES_FIXNUM_MIN        (-1 << ES_PAYLOAD_BITS)
 #define ES_FIXNUM_MAX        (1 << ES_PAYLOAD_BITS)
-#define ES_DEFAULT_ALIGNMENT 16
+#define ES_DEFAULT_ALIGNMENT 8
 #define ES_DEFAULT_HEAP_SIZE (128 * 1000000)
-#define ES_SYMTAB_SIZE       32768
+#define ES_NURSERY_SIZE      (2 * 1000000)
+#define ES_HEAP_GROWTH       2.0
+#define ES_HEAP_GROW_PCT     50 /**< Grow when survivors fill more of the old space than this */
+#define ES_HEAP_SHRINK_PCT   15 /**< Shrink when survivors fill less of the old space than this... */
+#define ES_HEAP_SHRINK_DELAY 4  /**< ...for this many consecutive full collections */
+#define ES_GC_INC_START_PCT  50 /**< Start an incremental cycle past this old space occupancy */
+#define ES_GC_WORTHWHILE_PCT 25 /**< A full collection is worth it once the old space grew this much since the last one */
+#define ES_GC_HINT_HORIZON_US 100000 /**< Idle hints collect the nursery if it would fill within this time */
+#define ES_GC_RATE_MIN_PCT   25 /**< es_gc_maybe collects a nursery filling fast once it is this full */
+#define ES_GC_COPY_RATE      1000 /**< Bytes copied per microsecond assumed before any collection was timed */
+#define ES_REMSET_SIZE       1024
+#define ES_GC_LAB_SIZE       (32 * 1024) /**< To space claimed at a time by each parallel copying thread */
+#define ES_GC_PAR_MIN_USED   (1 << 20)   /**< Heaps using less than this are always copied serially */
+#define ES_GC_ROOT_CHUNK     64          /**< Roots claimed at a time by each parallel copying thread */
+#define ES_GC_STEAL_MAX      256         /**< Grey objects taken at most by one steal */
+#define ES_GC_PUBLISH_MIN    32          /**< Private grey objects a thread holds before sharing some */
+#define ES_LARGE_OBJECT_SIZE (64 * 1024) /**< Objects this big are allocated in the large object space */
+#define ES_SYMTAB_SLOTS      1024        /**< Initial hash slots of the symbol table, a power of two */
+#define ES_SYMTAB_ARENA      (16 * 1024) /**< Bytes of symbol names held by each arena chunk */
 #define ES_GLOBAL_ENV_SIZE   32
 #define ES_ROOT_STACK_SIZE   1024
 #define ES_CONST_POOL_SIZE   4096
-#define ES_STACK_SIZE        4096
-#define ES_MAX_FRAMES        4096
+#define ES_MAX_DEPTH         (1 << 20) /**< Default bound on call frames and on value stack slots */
+#define ES_MIN_DEPTH         256       /**< Smallest depth limit a context is given */
+#define ES_STACK_SLACK       4096      /**< Slots above the limit checked at calls, for pushes within a procedure */
+#define ES_STACK_RETAIN      (1 << 14) /**< Frames and slots kept committed between evaluations, deeper pages are given back */
+#define ES_TYPE_COUNT        (ES_ITERATOR_TYPE + 1)
+#define ES_WEAK_TABLE_SIZE   16
+#define ES_SMALL_STRING_MAX  6    /**< Longest string stored as an immediate */
+#define ES_CONT_RETURN       0    /**< Bytecode offset of the RETURN the marker frames of continuations come back through */
+#define ES_CONT_CALL         1    /**< Bytecode offset of the TAIL_CALL entering the receiver of call/cc */
+#define ES_VALUES_CALL       2    /**< Bytecode offset of the TAIL_CALL entering the producer of call-with-values */
+#define ES_VALUES_APPLY      3    /**< Bytecode offset of the APPLY_VALUES passing its values to the consumer */
+#define ES_ITER_END          4    /**< Bytecode offset of the ITER_END the body of a generator returns through */
 
 #define es_tagged_val(v, tag) ((es_val_t)(((v) << ES_TAG_BITS) | tag))
 #define es_obj_to_val(o)      ((es_val_t)(o))
+#define es_obj_retag(o, v)    (es_obj_to_val(o) | es_tag(v)) /**< Reference to o tagged like the reference v */
 #define es_tag(v)             ((v) & ES_TAG_MASK)
 #define es_payload(t, v)      (((t)(v)) >> ES_TAG_BITS)
-#define es_obj_to(t, v)       ((t)(v))
-#define es_val_to_obj(v)      ((es_obj_t*)(v))
+#define es_obj_to(t, v)       ((t)((v) & ES_PAYLOAD_MASK))
+#define es_val_to_obj(v)      ((es_obj_t*)((v) & ES_PAYLOAD_MASK))
 
 #define gc_root(ctx, v)           ctx->roots.stack[ctx->roots.top++] = (es_val_t*)(&(v))
 #define gc_root2(ctx, a, b)       gc_root(ctx, a); gc_root(ctx, b)
@@ -44,14 +79,8 @@
 #define align(v, n)  (((v) + n - 1) & ~((n) - 1))
 #define alignp(p, n) ((void*)align((uintptr_t)p, (uintptr_t)n))
 
-typedef enum es_tag {
-  ES_OBJ_TAG    = 0x0, /**< b000 - Heap allocated object */
-  ES_FIXNUM_TAG = 0x1, /**< b001 - Fixnums */
-  ES_SYMBOL_TAG = 0x2, /**< b010 - Symbols tag */
-  ES_VALUE_TAG  = 0x3, /**< b011 - Immediate values: Nil, EOF, Unspecified, Unbound */
-  ES_BOOL_TAG   = 0x4, /**< b100 - Symbol tag */
-  ES_CHAR_TAG   = 0x5, /**< b101 - Character tag */
-} es_tag_t;
+/* Tags of the references to heap objects, see es_tag_t */
+#define ES_OBJ_TAGS ((1 << ES_OBJ_TAG) | (1 << ES_PAIR_TAG) | (1 << ES_CLOSURE_TAG))
 
 /* VM opcodes */
 typedef enum es_opcode {
@@ -69,7 +98,11 @@ typedef enum es_opcode {
   CALL,          // 0x0B
   TAIL_CALL,     // 0x0C
   RETURN,        // 0x0D
-  CLOSURE        // 0x0E
+  CLOSURE,       // 0x0E
+  RECEIVE,       // 0x0F
+  TAIL_RECEIVE,  // 0x10
+  APPLY_VALUES,  // 0x11
+  ITER_END       // 0x12
 } es_opcode_t;
 
 typedef enum es_vm_mode {
@@ -97,21 +130,113 @@ typedef struct es_inst {
 } es_inst_t;
 #endif
 
+typedef struct es_objlist {
+  es_val_t* items;
+  int       count;
+  int       size;
+} es_objlist_t;
+
+typedef struct es_large {
+  struct es_large* next;   /**< Next object in the large object space */
+  void*            buffer; /**< Allocation holding this header and the object */
+  size_t           size;   /**< Size of the object in bytes */
+  size_t           pad;    /**< Keeps the object that follows aligned */
+} es_large_t;
+
+typedef struct es_region {
+  struct es_region* prev;  /**< Chunk filled before this one */
+  char*             start; /**< First object in the chunk */
+  char*             next;  /**< Next free byte in the chunk */
+  char*             end;   /**< End of the chunk */
+} es_region_t;
+
+typedef enum es_gc_mode {
+  ES_GC_IDLE,  /**< Mutator is running */
+  ES_GC_MINOR, /**< Evacuating the nursery into the old space */
+  ES_GC_FULL,  /**< Copying everything reachable into the to space */
+  ES_GC_SLICE, /**< Replicating old objects during an incremental cycle */
+  ES_GC_MARK,  /**< Marking live objects in place for compaction */
+  ES_GC_UPDATE,/**< Pointing references at the compacted addresses */
+  ES_GC_PARALLEL,/**< Copying into the to space from several threads */
+  ES_GC_RELOCATE,/**< Rebasing the references of a loaded heap image */
+  ES_GC_VISIT    /**< Reporting the references of each object to a heap dump */
+} es_gc_mode_t;
+
+struct es_gc_par;
+struct es_image_map;
+struct es_heap_dump;
+
 typedef struct es_heap {
-  char*  buffer;     /**< Heap pointer */
-  size_t size;       /**< Size of heap in bytes */
-  char*  next;       /**< Pointer to_space next free memory */
-  char*  from_space; /**< From space pointer */
-  char*  to_space;   /**< To space pointer */
-  char*  end;        /**< End of from space */
-  char*  to_end;
-  size_t requested;  /**< Requested heap size in bytes */
+  char*     buffer;       /**< From space allocation */
+  char*     mapped;       /**< Semispace mapped from a heap image, unmapped rather than freed */
+  size_t    mapped_size;  /**< Length of the mapping */
+  char*     to_buffer;    /**< To space allocation */
+  size_t    size;         /**< Size of the from space in bytes */
+  size_t    to_size;      /**< Size of the to space in bytes */
+  char*     next;         /**< Pointer to_space next free memory */
+  char*     from_space;   /**< From space pointer */
+  char*     to_space;     /**< To space pointer */
+  char*     end;          /**< End of from space */
+  char*     to_end;
+  size_t    requested;    /**< Requested heap size in bytes */
+  size_t    min_size;     /**< Semispaces never shrink below this size */
+  size_t    max_size;     /**< Semispaces never grow past this size, 0 if unbounded */
+  size_t    max_memory;   /**< Cap on all the memory held by the heap, 0 if unbounded */
+  double    growth;       /**< Growth factor applied when resizing */
+  size_t    next_size;    /**< Semispace size used by the next full collection */
+  int       low_count;    /**< Consecutive full collections with low occupancy */
+  char*     nursery_buffer;
+  char*     nursery;      /**< Young generation, new objects are bump allocated here */
+  char*     nursery_next; /**< Next free byte in the nursery */
+  char*     nursery_end;  /**< End of the nursery */
+  size_t    nursery_size; /**< Size of the nursery in bytes */
+  es_objlist_t remset;    /**< Old objects which may hold references into the nursery */
+  es_region_t* region;    /**< Chunks of the current region, newest first */
+  int       region_depth; /**< Nesting of es_region_begin, objects go to the region while > 0 */
+  es_gc_mode_t mode;      /**< Collection currently running */
+  int       no_gc;        /**< Collection is inhibited while > 0 */
+  unsigned  max_pause_us; /**< Budget of each incremental step in microseconds, 0 to stop the world */
+  int       inc_active;   /**< An incremental cycle is in progress */
+  int       inc_dirty;    /**< Object being scanned refers to something the cycle skipped */
+  char*     snapshot_end; /**< Old objects below this are replicated by the incremental cycle */
+  char*     inc_scan;     /**< Cheney scan pointer of the incremental cycle */
+  char*     inc_next;     /**< Cheney copy pointer of the incremental cycle */
+  es_objlist_t inc_log;   /**< Replicated objects mutated since they were copied */
+  es_objlist_t inc_rescan;/**< Replicas holding references the cycle has not copied yet */
+  int       compact;      /**< Old space is mark-compacted in place, there is no to space */
+  es_objlist_t mark_stack;/**< Marked objects whose fields have not been traced yet */
+  es_objlist_t finalizable;/**< Objects owning native resources, released when they die */
+  es_objlist_t weak;      /**< Weak boxes traced by the current collection */
+  es_objlist_t ephemerons;/**< Ephemerons traced by the current collection whose key is not known live */
+  size_t    marked;       /**< Bytes marked live by the current compaction */
+  es_large_t* large;      /**< Large objects, never moved and swept after each full collection */
+  size_t    large_bytes;  /**< Bytes held by the large object space */
+  size_t    large_limit;  /**< Large object space size which forces a full collection */
+  int       gc_threads;   /**< Threads sharing a full copying collection */
+  struct es_gc_par* par;  /**< Shared state of the parallel collection in progress */
+  unsigned  epoch;        /**< Bumped whenever old objects may have moved */
+  unsigned  minor_epoch;  /**< Bumped by every collection, as young objects always move */
+  es_gc_stats_t stats;    /**< Collector telemetry */
+  struct timeval last_gc; /**< End of the most recent collection */
+  uint64_t  last_alloc;   /**< Bytes allocated at the end of the most recent collection */
+  size_t    last_live;    /**< Old space in use after the most recent full collection */
 } es_heap_t;
 
+typedef struct es_symtab_slot {
+  uint32_t hash; /**< Hash of the symbol name */
+  int      id;   /**< Symbol id plus one, 0 for an empty slot */
+} es_symtab_slot_t;
+
 typedef struct es_symtab {
-  char* table[ES_SYMTAB_SIZE];
-  int   next_id;
-  int   next_gensym;
+  es_symtab_slot_t* slots;      /**< Open addressing table probed linearly from the name hash */
+  size_t            nslots;     /**< Power of two, kept at most half full */
+  char**            names;      /**< Symbol names by id, stored in the arena */
+  int               names_size; /**< Capacity of names */
+  char*             arena;      /**< Current chunk, whose first word links to the previous one */
+  size_t            arena_used; /**< Bytes used in the current chunk */
+  size_t            arena_size; /**< Size of the current chunk */
+  int               next_id;
+  int               next_gensym;
 } es_symtab_t;
 
 typedef struct es_frame {
@@ -119,6 +244,29 @@ typedef struct es_frame {
   es_inst_t* knt;
 } es_frame_t;
 
+typedef struct es_proc_range {
+  int      addr;                   /**< First instruction of a compiled lambda */
+  int      end;                    /**< One past its last instruction */
+  es_val_t name;                   /**< Symbol it was defined as, es_void if anonymous */
+  size_t   samples[ES_TYPE_COUNT]; /**< Allocation samples taken while running it, by type */
+} es_proc_range_t;
+
+typedef struct es_call_site {
+  int    addr;    /**< Call instruction */
+  size_t samples; /**< Argument frame samples taken for calls made here */
+} es_call_site_t;
+
+typedef struct es_profile {
+  size_t           interval;   /**< Sample every this many bytes allocated, 0 when disabled */
+  long             countdown;  /**< Bytes left until the next sample */
+  es_proc_range_t* procs;      /**< Compiled lambdas, slot 0 collects top level code */
+  int              nprocs;
+  int              procs_size;
+  es_call_site_t*  sites;
+  int              nsites;
+  int              sites_size;
+} es_profile_t;
+
 typedef struct es_roots {
   es_val_t* stack[ES_ROOT_STACK_SIZE];
   int       top;
@@ -128,23 +276,83 @@ struct es_ctx {
   es_heap_t   heap;
   es_roots_t  roots;
   es_symtab_t symtab;
+  es_symtab_t strings;     /**< Error strings carried over from images and clones, kept apart from the symbols */
   es_val_t    iport;
   es_val_t    oport;
   es_val_t    bytecode;
   es_inst_t*  ip;
   es_val_t*   sp;
   int         fp;
+  int         values;      /**< Results on top of the stack when returning to a RECEIVE, 1 otherwise */
   es_val_t    env;
   es_val_t    args;
-  es_val_t    stack[ES_STACK_SIZE];
-  es_frame_t  frames[ES_MAX_FRAMES];
+  es_val_t*   stack;       /**< max_depth + ES_STACK_SLACK reserved slots, never moved so argv pointers into it stay valid */
+  es_val_t*   stack_limit; /**< Calls past this take the slow path of vm_check */
+  es_frame_t* frames;      /**< max_depth reserved frames */
+  int         frame_limit; /**< Calls from this frame on take the slow path of vm_check */
+  int         max_depth;   /**< Frames and stack slots past which calls fail with a stack overflow */
+  es_profile_t profile;
+  jmp_buf*    abort;     /**< Outermost es_eval or es_apply in progress, unwound to by vm_abort */
+  char*       abort_msg; /**< Why the VM was aborted */
 };
 
+/**
+ * Heap object header, packed into a single word: the forwarding address
+ * in the low 48 bits, then the type and the ES_OBJ_* flags in a byte each.
+ */
 typedef struct es_obj {
-  es_type_t type;
-  void*     reloc;
+  uint64_t header;
 } es_obj_t;
 
+enum {
+  ES_OBJ_REMEMBERED = 0x1, /**< Object is in the remembered set */
+  ES_OBJ_LOGGED     = 0x2, /**< Replicated object is in the incremental mutation log */
+  ES_OBJ_MARKED     = 0x4, /**< Object was found live by a marking collector */
+  ES_OBJ_LARGE      = 0x8  /**< Object lives in the large object space */
+};
+
+#define ES_HDR_RELOC_MASK    ((((uint64_t)1) << 48) - 1)
+#define ES_HDR_TYPE_SHIFT    48
+#define ES_HDR_FLAGS_SHIFT   56
+#define obj_header(type, flags) (((uint64_t)(type) << ES_HDR_TYPE_SHIFT) | ((uint64_t)(flags) << ES_HDR_FLAGS_SHIFT))
+
+static es_type_t obj_hdr_type(es_obj_t* obj)
+{
+  return (es_type_t)((obj->header >> ES_HDR_TYPE_SHIFT) & 0xff);
+}
+
+static unsigned obj_hdr_flags(es_obj_t* obj)
+{
+  return (unsigned)(obj->header >> ES_HDR_FLAGS_SHIFT);
+}
+
+static void obj_hdr_set_flags(es_obj_t* obj, unsigned flags)
+{
+  obj->header |= (uint64_t)flags << ES_HDR_FLAGS_SHIFT;
+}
+
+static void obj_hdr_clear_flags(es_obj_t* obj, unsigned flags)
+{
+  obj->header &= ~((uint64_t)flags << ES_HDR_FLAGS_SHIFT);
+}
+
+static es_obj_t* obj_hdr_reloc(es_obj_t* obj)
+{
+  return (es_obj_t*)(uintptr_t)(obj->header & ES_HDR_RELOC_MASK);
+}
+
+static void obj_hdr_set_reloc(es_obj_t* obj, void* reloc)
+{
+  assert(((uintptr_t)reloc & ~ES_HDR_RELOC_MASK) == 0);
+  obj->header = (obj->header & ~ES_HDR_RELOC_MASK) | (uintptr_t)reloc;
+}
+
+/* Gives a copy a fresh header, keeping only its type */
+static void obj_hdr_reset(es_obj_t* obj)
+{
+  obj->header = obj_header(obj_hdr_type(obj), 0);
+}
+
 typedef struct es_string {
   es_obj_t base;
   size_t   length;
@@ -205,6 +413,7 @@ typedef struct es_proc {
   int      rest;
   int      addr;
   int      end;
+  int      captures; /**< Body creates closures, so its frames must live on the heap */
 } es_proc_t;
 
 typedef struct es_macro {
@@ -212,6 +421,17 @@ typedef struct es_macro {
   es_val_t trans;
 } es_macro_t;
 
+typedef struct es_weak {
+  es_obj_t base;
+  es_val_t val;  /**< Not traced, cleared to #f once nothing else references it */
+} es_weak_t;
+
+typedef struct es_ephemeron {
+  es_obj_t base;
+  es_val_t key;  /**< Not traced, es_unbound once the ephemeron is broken */
+  es_val_t val;  /**< Traced only while the key is reachable from elsewhere */
+} es_ephemeron_t;
+
 typedef struct es_buffer {
   es_obj_t base;
   size_t   size;
@@ -229,18 +449,48 @@ typedef struct es_bytecode {
 } es_bytecode_t;
 
 typedef struct es_cont {
-  es_obj_t   base;
-  es_inst_t* ip;
-  int        sp;
-  int        fp;
-  es_val_t   env;
-  es_val_t   args;
-  es_val_t   stack[ES_STACK_SIZE];
-  es_frame_t frames[ES_MAX_FRAMES];
+  es_obj_t base;
+  int      sp;      /**< Stack slots below the capture, the value passed to the continuation goes in the next one */
+  int      fp;      /**< Frame the continuation returns through, the one above it is its marker */
+  int      full;    /**< Both stacks were copied into saved, so it can be resumed once its extent is left */
+  es_val_t saved[]; /**< The sp stack slots, then the args and return offset of each of the fp + 1 frames */
 } es_cont_t;
 
+typedef enum es_iter_kind {
+  ES_ITER_LIST,
+  ES_ITER_VECTOR,
+  ES_ITER_STRING,
+  ES_ITER_PORT,
+  ES_ITER_GENERATOR
+} es_iter_kind_t;
+
+typedef enum es_gen_state {
+  ES_GEN_NEW,
+  ES_GEN_RUNNING,
+  ES_GEN_SUSPENDED,
+  ES_GEN_DONE
+} es_gen_state_t;
+
+/**
+ * Iterators step through a sequence, or run a generator procedure up to
+ * its next yield. A suspended generator keeps the part of both stacks
+ * above its marker frame in saved, rebased to start at 0, which is copied
+ * back on top of the stacks of whoever resumes it.
+ */
+typedef struct es_iter {
+  es_obj_t base;
+  es_val_t source;  /**< Rest of the list, the vector, string or port, or the generator procedure */
+  es_val_t saved;   /**< Vector holding the nstack stack slots then the args and return offset of the nframes frames */
+  int      kind;    /**< es_iter_kind_t */
+  int      pos;     /**< Index of the next element, or the es_gen_state_t of a generator */
+  int      sp;      /**< Running generator: stack slots below its body */
+  int      fp;      /**< Running generator: its marker frame */
+  int      nstack;
+  int      nframes;
+} es_iter_t;
+
+/* Port state lives off the heap, it is updated in place on every read */
 typedef struct es_port {
-  es_obj_t  base;
   FILE*     stream;
   char*     buf;
   int       size;
@@ -261,6 +511,11 @@ typedef struct es_port {
   };
 } es_port_t;
 
+typedef struct es_port_obj {
+  es_obj_t   base;
+  es_port_t* port; /**< Released by the finalizer when the port object dies */
+} es_port_obj_t;
+
 const es_val_t es_nil       = es_tagged_val(ES_NIL_TYPE, ES_VALUE_TAG);
 const es_val_t es_true      = es_tagged_val(1, ES_BOOL_TAG);
 const es_val_t es_false     = es_tagged_val(0, ES_BOOL_TAG);
@@ -269,6 +524,8 @@ const es_val_t es_void      = es_tagged_val(ES_VOID_TYPE, ES_VALUE_TAG);
 const es_val_t es_unbound   = es_tagged_val(ES_UNBOUND_TYPE, ES_VALUE_TAG);
 const es_val_t es_undefined = es_tagged_val(ES_UNDEFINED_TYPE, ES_VALUE_TAG);
 
+static const es_val_t es_small_string_tag = es_tagged_val(ES_STRING_TYPE, ES_VALUE_TAG); /**< Low byte of immediate strings */
+
 static const es_val_t symbol_define          = es_tagged_val(0, ES_SYMBOL_TAG);
 static const es_val_t symbol_if              = es_tagged_val(1, ES_SYMBOL_TAG);
 static const es_val_t symbol_begin           = es_tagged_val(2, ES_SYMBOL_TAG);
@@ -278,23 +535,74 @@ static const es_val_t symbol_quote           = es_tagged_val(5, ES_SYMBOL_TAG);
 static const es_val_t symbol_quasiquote      = es_tagged_val(6, ES_SYMBOL_TAG);
 static const es_val_t symbol_unquote         = es_tagged_val(7, ES_SYMBOL_TAG);
 static const es_val_t symbol_unquotesplicing = es_tagged_val(8, ES_SYMBOL_TAG);
+static const es_val_t symbol_receive         = es_tagged_val(9, ES_SYMBOL_TAG);
+static const es_val_t symbol_call_with_values = es_tagged_val(10, ES_SYMBOL_TAG);
 
-static void           ctx_init(es_ctx_t* ctx, size_t heap_size);
+static void           ctx_init(es_ctx_t* ctx, const es_heap_config_t* config);
 static void           ctx_init_env(es_ctx_t* ctx);
 static int            is_obj(es_val_t val);
 static es_type_t      obj_type_of(es_val_t val);
 static es_obj_t*      obj_reloc(es_val_t obj);
 static void           obj_init(es_val_t obj, es_type_t type);
 static void           es_mark_copy(es_heap_t* heap, es_val_t* pval, char** next);
+static void           es_obj_mark_copy(es_heap_t* heap, es_val_t obj, char** next);
 static int            es_obj_is_reloc(es_val_t val);
 static void*          heap_alloc(es_heap_t* heap, size_t size);
-static void           heap_init(es_heap_t* heap, size_t size);
+static void*          nursery_alloc(es_heap_t* heap, size_t size);
+static void*          large_alloc(es_heap_t* heap, size_t size);
+static void           large_sweep(es_heap_t* heap);
+static int            heap_in_nursery(es_heap_t* heap, es_val_t val);
+static int            heap_in_young(es_heap_t* heap, es_val_t val);
+static void*          region_alloc(es_heap_t* heap, size_t size);
+static size_t         region_used(es_heap_t* heap);
+static size_t         region_size(es_heap_t* heap);
+static void           region_reset(es_heap_t* heap);
+static void           heap_init(es_heap_t* heap, const es_heap_config_t* config);
+static void           heap_free(es_heap_t* heap);
+static void           heap_free_space(es_heap_t* heap, char* buffer);
+static void           obj_finalize(es_val_t obj);
+static void           heap_resize_to_space(es_heap_t* heap, size_t size);
+static void           heap_adjust(es_heap_t* heap);
+static size_t         heap_space_limit(es_heap_t* heap);
+static int            heap_fits(es_heap_t* heap, size_t request);
+static void           vm_abort(es_ctx_t* ctx, char* msg);
+static void           vm_deepen(es_ctx_t* ctx, es_val_t* sp, int fp);
+static es_val_t       fn_call_cc(es_ctx_t* ctx, int argc, es_val_t argv[]);
+static es_val_t       fn_call_ec(es_ctx_t* ctx, int argc, es_val_t argv[]);
+static es_val_t       fn_values(es_ctx_t* ctx, int argc, es_val_t argv[]);
+static es_val_t       fn_call_with_values(es_ctx_t* ctx, int argc, es_val_t argv[]);
+static es_val_t       fn_iterator_next(es_ctx_t* ctx, int argc, es_val_t argv[]);
+static int            heap_grow(es_ctx_t* ctx, size_t request);
+static void           objlist_init(es_objlist_t* list, int size);
+static void           objlist_push(es_objlist_t* list, es_val_t obj);
+static void           gc_remember(es_heap_t* heap, es_val_t obj);
+static void           gc_step(es_ctx_t* ctx, struct timeval* t0);
+static void           gc_finish_cycle(es_ctx_t* ctx);
+static void           gc_write_barrier(es_ctx_t* ctx, es_val_t obj, es_val_t val);
+static void           gc_finalizable(es_heap_t* heap, es_val_t obj);
+static void           gc_finalize(es_heap_t* heap, int minor);
+static void           gc_scan(es_heap_t* heap, char* scan, char** next);
+static es_weak_t*     es_weak_val(es_val_t val);
+static void           gc_par_copy(es_heap_t* heap, es_val_t* ref, char** next);
+static void           gc_par_queue(es_heap_t* heap, es_objlist_t* list, es_val_t obj);
+static es_val_t       image_rebase(struct es_image_map* map, es_val_t val);
+static void           heap_dump_edge(struct es_heap_dump* dump, es_val_t val);
+static es_ephemeron_t* es_ephemeron_val(es_val_t val);
+static void           es_port_finalize(es_val_t val);
+static void           es_bytecode_finalize(es_val_t val);
+static void           gc_mark(es_heap_t* heap, es_val_t obj);
+static void           gc_compact(es_ctx_t* ctx);
+static void           gc_record_pause(es_heap_t* heap, struct timeval* t0);
+static void           gc_record(es_heap_t* heap, struct timeval* t0, size_t condemned, size_t survived, int full);
 static void           symtab_init(es_symtab_t* symtab);
+static void           symtab_free(es_symtab_t* symtab);
 static char*          symtab_find_by_id(es_symtab_t* symtab, int id);
-static int            symtab_id_by_string(es_symtab_t* symtab, const char* cstr);
 static int            symtab_find_or_create(es_symtab_t* symtab, const char* cstr);
 static int            symtab_add_string(es_symtab_t* symtab, const char* cstr);
+static char*          symtab_intern(es_symtab_t* symtab, const char* cstr);
+static void           natives_init(void);
 static es_string_t*   es_string_val(es_val_t val);
+static int            es_string_length(es_val_t string);
 static es_pair_t*     es_pair_val(es_val_t val);
 static es_vec_t*      es_vector_val(es_val_t val);
 static es_closure_t*  es_closure_val(es_val_t val);
@@ -312,6 +620,7 @@ static es_val_t       compile_form(es_ctx_t* ctx, es_val_t bc, es_val_t exp, int
 static es_val_t       compile_call(es_ctx_t* ctx, es_val_t bc, es_val_t exp, int tail_pos, int next, es_val_t scope);
 static es_val_t       compile_args(es_ctx_t* ctx, es_val_t bc, es_val_t exp, es_val_t scope);
 static es_val_t       compile_lambda(es_ctx_t* ctx, es_val_t bc, es_val_t formals, es_val_t body, int tail_pos, int next, es_val_t scope);
+static es_val_t       compile_receive(es_ctx_t* ctx, es_val_t bc, es_val_t formals, es_val_t exp, es_val_t body, int tail_pos, int next, es_val_t scope);
 static es_val_t       compile_if(es_ctx_t* ctx, es_val_t bc, es_val_t exp, int tail_pos, int next, es_val_t scope);
 static es_val_t       compile_seq(es_ctx_t* ctx, es_val_t bc, es_val_t seq, int tail_pos, int next, es_val_t scope);
 static es_val_t       compile_define(es_ctx_t* ctx, es_val_t bc, es_val_t binding, es_val_t val, int tail_pos, int next, es_val_t scope);
@@ -319,26 +628,104 @@ static es_val_t       compile_set(es_ctx_t* ctx, es_val_t bc, es_val_t sym, es_v
 static es_val_t       compile_ref(es_ctx_t* ctx, es_val_t bc, es_val_t sym, int tail_pos, int next, es_val_t scope);
 static es_val_t       compile_const(es_ctx_t* ctx, es_val_t bc, es_val_t exp, int tail_pos, int next, es_val_t scope);
 static void           print_inst(es_ctx_t* ctx, es_val_t port, es_inst_t* inst);
+static void           emit_return(es_val_t code);
+static void           emit_tail_call(es_val_t code, int argc);
+static void           emit_apply_values(es_val_t code);
+static void           emit_iter_end(es_val_t code);
 static void*          es_vm_run(es_ctx_t* ctx, es_vm_mode_t mode, ...);
 static es_val_t       env_ref(es_ctx_t* ctx, es_val_t env, int slot);
+static void           profile_init(es_profile_t* profile);
+static void           profile_free(es_profile_t* profile);
+static void           profile_add_proc(es_ctx_t* ctx, int addr, int end);
+static void           profile_sample(es_ctx_t* ctx, es_type_t type);
 
 es_ctx_t* es_ctx_new(size_t heap_size)
+{
+  es_heap_config_t config = { heap_size, 0, ES_HEAP_GROWTH };
+  return es_ctx_new_config(&config);
+}
+
+es_ctx_t* es_ctx_new_config(const es_heap_config_t* config)
 {
   es_ctx_t* ctx = malloc(sizeof(es_ctx_t));
-  ctx_init(ctx, heap_size);
+  ctx_init(ctx, config);
   return ctx;
 }
 
-static void ctx_init(es_ctx_t* ctx, size_t heap_size)
+/*
+ * The value stack and the frames are reserved at their full depth without
+ * committing swap for them, so pages are only backed once touched. Calls
+ * check against soft limits ES_STACK_RETAIN deep; the first call past them
+ * raises them to the depth limit, and the pages it touched are given back
+ * once the outermost evaluation returns.
+ */
+static void* stack_reserve(size_t size)
+{
+  void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) {
+    fprintf(stderr, "eva: cannot reserve %zu bytes of stack\n", size);
+    exit(1);
+  }
+  return mem;
+}
+
+/* Gives back the pages of [mem + keep, mem + size), keeping them mapped */
+static void stack_release(void* mem, size_t keep, size_t size)
 {
-  heap_init(&ctx->heap, heap_size);
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  keep = (keep + page - 1) / page * page;
+  if (keep < size)
+    madvise((char*)mem + keep, size - keep, MADV_DONTNEED);
+}
+
+/* Releases what a deep evaluation touched past the retained part of the stacks */
+static void ctx_trim_stacks(es_ctx_t* ctx)
+{
+  int retain = ctx->max_depth < ES_STACK_RETAIN ? ctx->max_depth : ES_STACK_RETAIN;
+  if (ctx->stack_limit == ctx->stack + ctx->max_depth) {
+    stack_release(ctx->stack, retain * sizeof(es_val_t), (ctx->max_depth + ES_STACK_SLACK) * sizeof(es_val_t));
+    stack_release(ctx->frames, retain * sizeof(es_frame_t), ctx->max_depth * sizeof(es_frame_t));
+  }
+  ctx->stack_limit = ctx->stack + retain;
+  ctx->frame_limit = retain - 2;
+}
+
+/* Sets up an empty heap and VM, ready for bytecode and an environment */
+static void ctx_init_vm(es_ctx_t* ctx, const es_heap_config_t* config)
+{
+  heap_init(&ctx->heap, config);
+  profile_init(&ctx->profile);
   ctx->roots.top = 0;
+  ctx->ip = NULL;
   ctx->iport = es_void;
   ctx->oport = es_void;
+  ctx->env   = es_nil;
+  ctx->args  = es_nil;
+  ctx->bytecode = es_nil;
+  ctx->max_depth = config->max_depth > 0 ? config->max_depth : ES_MAX_DEPTH;
+  if (ctx->max_depth < ES_MIN_DEPTH)
+    ctx->max_depth = ES_MIN_DEPTH;
+  ctx->stack  = stack_reserve((ctx->max_depth + ES_STACK_SLACK) * sizeof(es_val_t));
+  ctx->frames = stack_reserve(ctx->max_depth * sizeof(es_frame_t));
+  ctx->stack_limit = ctx->stack;
+  ctx_trim_stacks(ctx);
   ctx->sp = ctx->stack;
   ctx->fp = 0;
-  ctx->bytecode = es_make_bytecode(ctx);
+  ctx->values = 1;
+  ctx->abort = NULL;
   symtab_init(&ctx->symtab);
+  symtab_init(&ctx->strings);
+}
+
+static void ctx_init(es_ctx_t* ctx, const es_heap_config_t* config)
+{
+  ctx_init_vm(ctx, config);
+  ctx->bytecode = es_make_bytecode(ctx);
+  emit_return(ctx->bytecode);       // ES_CONT_RETURN
+  emit_tail_call(ctx->bytecode, 1); // ES_CONT_CALL
+  emit_tail_call(ctx->bytecode, 0); // ES_VALUES_CALL
+  emit_apply_values(ctx->bytecode); // ES_VALUES_APPLY
+  emit_iter_end(ctx->bytecode);     // ES_ITER_END
   es_symbol_intern(ctx, "define");
   es_symbol_intern(ctx, "if");
   es_symbol_intern(ctx, "begin");
@@ -348,12 +735,25 @@ static void ctx_init(es_ctx_t* ctx, size_t heap_size)
   es_symbol_intern(ctx, "quasiquote");
   es_symbol_intern(ctx, "unquote");
   es_symbol_intern(ctx, "unquote-splicing");
+  es_symbol_intern(ctx, "receive");
+  es_symbol_intern(ctx, "call-with-values");
 
   ctx_init_env(ctx);
 }
 
+/**
+ * Releases a context along with its heap, symbol names and the native
+ * state of its ports and bytecode. Streams passed to es_make_port are
+ * left open.
+ */
 void es_ctx_free(es_ctx_t* ctx)
 {
+  heap_free(&ctx->heap);
+  symtab_free(&ctx->symtab);
+  symtab_free(&ctx->strings);
+  profile_free(&ctx->profile);
+  munmap(ctx->stack, (ctx->max_depth + ES_STACK_SLACK) * sizeof(es_val_t));
+  munmap(ctx->frames, ctx->max_depth * sizeof(es_frame_t));
   free(ctx);
 }
 
@@ -389,14 +789,66 @@ void es_ctx_set_env(es_ctx_t* ctx, es_val_t env)
 
 static void* es_alloc(es_ctx_t* ctx, es_type_t type, size_t size)
 {
-  void* mem = heap_alloc(&ctx->heap, size);
+  es_heap_t* heap = &ctx->heap;
+  void* mem;
+
+  heap->stats.bytes_allocated += size;
+  if (ctx->profile.interval && (ctx->profile.countdown -= size) <= 0) {
+    profile_sample(ctx, type);
+  }
+
+  if (size >= ES_LARGE_OBJECT_SIZE) {
+    if (!heap->no_gc && (heap->large_bytes + size > heap->large_limit || !heap_fits(heap, size))) {
+      es_gc(ctx);
+    }
+    mem = heap_fits(heap, size) ? large_alloc(heap, size) : NULL;
+    if (!mem) {
+      vm_abort(ctx, "out of memory");
+    }
+    obj_init(es_obj_to_val(mem), type);
+    obj_hdr_set_flags(es_val_to_obj(es_obj_to_val(mem)), ES_OBJ_LARGE);
+    gc_remember(heap, es_obj_to_val(mem));
+    return mem;
+  }
+
+  mem = heap->region_depth > 0 ? region_alloc(heap, size) : NULL;
+  if (mem) {
+    obj_init(es_obj_to_val(mem), type);
+    return mem;
+  }
+
+  mem = nursery_alloc(heap, size);
+  if (!mem && !heap->no_gc && size <= heap->nursery_size) {
+    struct timeval t0;
+    gettimeofday(&t0, NULL); // Incremental work shares the pause budget with the minor collection
+    es_gc_minor(ctx);
+    /* Survivors spilling into the nursery reserve leave no room for the next minor
+       collection, and a collection may have used the headroom past the memory cap */
+    if ((heap->next > heap->end && !heap_grow(ctx, 0)) || !heap_fits(heap, 0)) {
+      vm_abort(ctx, "out of memory");
+    }
+    if (heap->max_pause_us) {
+      gc_step(ctx, &t0);
+    }
+    mem = nursery_alloc(heap, size);
+  }
 
   if (!mem) {
-    es_gc(ctx);
-    mem = heap_alloc(&ctx->heap, size);
+    /* Too big for the nursery, or collection is inhibited: tenure directly */
+    mem = heap_alloc(heap, size);
+    if (!mem && !heap->no_gc) {
+      es_gc(ctx);
+      mem = heap_alloc(heap, size);
+      if (!mem && heap_grow(ctx, size)) {
+        mem = heap_alloc(heap, size);
+      }
+    }
     if (!mem) {
-      exit(1);
+      vm_abort(ctx, "out of memory");
     }
+    obj_init(es_obj_to_val(mem), type);
+    gc_remember(heap, es_obj_to_val(mem));
+    return mem;
   }
 
   obj_init(es_obj_to_val(mem), type);
@@ -423,205 +875,843 @@ static void* heap_alloc(es_heap_t* heap, size_t size)
   return mem;
 }
 
-static void heap_init(es_heap_t* heap, size_t size)
+static void* nursery_alloc(es_heap_t* heap, size_t size)
 {
-  heap->requested  = size;
-  heap->size       = align((size + 1) / 2, ES_DEFAULT_ALIGNMENT);
-  heap->buffer     = malloc(heap->size * 2);
-  heap->from_space = alignp(heap->buffer, ES_DEFAULT_ALIGNMENT);
-  heap->to_space   = alignp(heap->from_space + heap->size, ES_DEFAULT_ALIGNMENT);
-  heap->next       = heap->from_space;
-  heap->end        = heap->from_space + size;
-  heap->to_end     = heap->to_space + size;
+  char* mem = alignp(heap->nursery_next, ES_DEFAULT_ALIGNMENT);
+  if (size > (heap->nursery_end - mem)) {
+    return NULL;
+  }
+  heap->nursery_next = mem + size;
+  return mem;
 }
 
-void es_mark_copy(es_heap_t* heap, es_val_t* ref, char** next)
+/**
+ * Allocates an object in the large object space. Its header sits just
+ * before the object so it can be found again without a lookup.
+ */
+static void* large_alloc(es_heap_t* heap, size_t size)
 {
-  assert(*next < heap->to_end);
-  if (!is_obj(*ref))
-    return;
-
-  if (es_obj_is_reloc(*ref)) {
-    *ref = es_obj_to_val(es_val_to_obj(*ref)->reloc); // Update stale reference to relocated object
-  } else {
-    size_t size = es_size_of(*ref);                // Get size of object
-    *next = alignp(*next, ES_DEFAULT_ALIGNMENT); // Ensure next pointer is aligned
-    memcpy(*next, (void*)*ref, size);                 // Copy object from_space from_space-space into to_space-space
-    es_val_to_obj(*ref)->reloc = (es_obj_t*)*next;            // Leave forwarding pointer in old from_space-space object
-    *ref = es_obj_to_val(es_val_to_obj(*ref)->reloc);                    // Update current reference to_space point to_space new object in to_space-space
-    es_val_to_obj(*ref)->reloc = NULL;                        // Reset tombstone
-    *next += size;                                 // Update next pointer
+  char* buffer = malloc(sizeof(es_large_t) + size + ES_DEFAULT_ALIGNMENT);
+  if (!buffer) {
+    return NULL;
   }
+  char* mem = alignp(buffer + sizeof(es_large_t), ES_DEFAULT_ALIGNMENT);
+  es_large_t* large = (es_large_t*)mem - 1;
+  large->buffer = buffer;
+  large->size   = size;
+  large->next   = heap->large;
+  heap->large   = large;
+  heap->large_bytes += size;
+  return mem;
 }
 
-es_type_t es_type_of(es_val_t val)
+static es_val_t large_obj(es_large_t* large)
 {
-  switch(es_tag(val)) {
-  case ES_OBJ_TAG:    return obj_type_of(val);
-  case ES_VALUE_TAG:  return es_payload(es_type_t, val);
-  case ES_BOOL_TAG:   return ES_BOOL_TYPE;
-  case ES_FIXNUM_TAG: return ES_FIXNUM_TYPE;
-  case ES_SYMBOL_TAG: return ES_SYMBOL_TYPE;
-  case ES_CHAR_TAG:   return ES_CHAR_TYPE;
-  default:            return ES_INVALID_TYPE;
-  }
+  return es_obj_to_val(large + 1);
 }
 
-static es_val_t es_port_vprintf(es_ctx_t* ctx, es_val_t port, const char* fmt, va_list args);
-static void es_print(es_ctx_t* ctx, es_val_t val, es_val_t oport);
+static int is_large(es_val_t val)
+{
+  return obj_hdr_flags(es_val_to_obj(val)) & ES_OBJ_LARGE;
+}
 
-void es_printf(es_ctx_t* ctx, const char * fmt, ...) {
-  va_list args;
-  va_start(args, fmt);
-  es_port_vprintf(ctx, ctx->oport, fmt, args);
-  va_end(args);
+/**
+ * Frees the large objects the last full collection did not mark and
+ * clears the collector flags of the survivors, which are not copied and
+ * so do not get fresh headers like the rest of the heap.
+ */
+static void large_sweep(es_heap_t* heap)
+{
+  es_large_t** link = &heap->large;
+  heap->large_bytes = 0;
+  while(*link) {
+    es_large_t* large = *link;
+    es_obj_t*   obj   = es_val_to_obj(large_obj(large));
+    if (obj_hdr_flags(obj) & ES_OBJ_MARKED) {
+      obj_hdr_reset(obj);
+      obj_hdr_set_flags(obj, ES_OBJ_LARGE);
+      heap->large_bytes += large->size;
+      link = &large->next;
+    } else {
+      *link = large->next;
+      free(large->buffer);
+    }
+  }
+  heap->large_limit = heap->large_bytes + heap->size;
 }
 
-void es_write(es_ctx_t* ctx, es_val_t val)
+static int heap_in_nursery(es_heap_t* heap, es_val_t val)
 {
-  es_port_write(ctx, ctx->oport, val);
+  char* p = (char*)es_val_to_obj(val);
+  return p >= heap->nursery && p < heap->nursery_end;
 }
 
-int es_is_eq(es_val_t v1, es_val_t v2)
+static int heap_in_region(es_heap_t* heap, es_val_t val)
 {
-  return v1 == v2;
+  char* p = (char*)es_val_to_obj(val);
+  for(es_region_t* chunk = heap->region; chunk; chunk = chunk->prev) {
+    if (p >= chunk->start && p < chunk->end)
+      return 1;
+  }
+  return 0;
 }
 
-es_val_t es_make_bool(int value)
+/**
+ * @return Whether val is condemned by a minor collection, that is it
+ *         lives in the nursery or in the current region.
+ */
+static int heap_in_young(es_heap_t* heap, es_val_t val)
 {
-  return es_tagged_val(value == 0 ? 0 : 1, ES_BOOL_TAG);
+  return heap_in_nursery(heap, val) || (heap->region_depth && heap_in_region(heap, val));
 }
 
-int es_is_bool(es_val_t val)
-{
-  return ES_BOOL_TYPE == es_type_of(val);
+//=================
+// Regions
+//=================
+
+/*
+ * Objects allocated between es_region_begin and es_region_end are bump
+ * allocated into a chain of chunks instead of the nursery, so a request
+ * never triggers a minor collection however much it allocates. The
+ * region is young like the nursery: stores of its objects into older
+ * ones are remembered by the write barrier, and the minor collection run
+ * by es_region_end promotes whatever is still reachable before the
+ * chunks are reused. The garbage left behind is never traced. Any other
+ * collection happening inside a region condemns it along with the nursery.
+ */
+
+/**
+ * Bump allocates in the region, adding a chunk twice the size of the last
+ * one when it is full. The region never grows past the free old space, so
+ * the collection ending it can always promote all of it, nor past the
+ * memory cap.
+ *
+ * @return NULL if the region cannot grow, the object then goes to the
+ *         nursery instead.
+ */
+static void* region_alloc(es_heap_t* heap, size_t size)
+{
+  es_region_t* chunk = heap->region;
+  char* mem = chunk ? alignp(chunk->next, ES_DEFAULT_ALIGNMENT) : NULL;
+
+  if (!chunk || size > (chunk->end - mem)) {
+    ptrdiff_t room       = (heap->end - heap->next) - (ptrdiff_t)region_size(heap);
+    size_t    chunk_size = chunk ? (chunk->end - chunk->start) * 2 : heap->nursery_size;
+    if (chunk_size < size)
+      chunk_size = align(size, ES_DEFAULT_ALIGNMENT);
+    if (room > 0 && chunk_size > (size_t)room)
+      chunk_size = room & ~(ptrdiff_t)(ES_DEFAULT_ALIGNMENT - 1);
+    if (room <= 0 || chunk_size < size || !heap_fits(heap, chunk_size))
+      return NULL;
+    chunk = malloc(sizeof(es_region_t) + chunk_size + ES_DEFAULT_ALIGNMENT);
+    if (!chunk) {
+      return NULL;
+    }
+    chunk->prev  = heap->region;
+    chunk->start = alignp((char*)(chunk + 1), ES_DEFAULT_ALIGNMENT);
+    chunk->next  = chunk->start;
+    chunk->end   = chunk->start + chunk_size;
+    heap->region = chunk;
+    mem          = chunk->start;
+  }
+  chunk->next = mem + size;
+  return mem;
 }
 
-int es_is_true(es_val_t val)
+static size_t region_size(es_heap_t* heap)
 {
-  return es_bool_val(val) != 0;
+  size_t size = 0;
+  for(es_region_t* chunk = heap->region; chunk; chunk = chunk->prev) {
+    size += chunk->end - chunk->start;
+  }
+  return size;
 }
 
-int es_bool_val(es_val_t val)
+static size_t region_used(es_heap_t* heap)
 {
-  return es_payload(int, val);
+  size_t used = 0;
+  for(es_region_t* chunk = heap->region; chunk; chunk = chunk->prev) {
+    used += chunk->next - chunk->start;
+  }
+  return used;
 }
 
-void es_bool_print(es_ctx_t* ctx, es_val_t val, es_val_t port)
+/**
+ * Empties the region once a collection has moved its survivors out. Only
+ * the newest, largest chunk is kept for the next request.
+ */
+static void region_reset(es_heap_t* heap)
 {
-  es_port_printf(ctx, port, "#%c", es_is_true(val) ? 't' : 'f');
+  es_region_t* chunk = heap->region;
+  if (!chunk)
+    return;
+  while(chunk->prev) {
+    es_region_t* prev = chunk->prev;
+    chunk->prev = prev->prev;
+    free(prev);
+  }
+  chunk->next = chunk->start;
 }
 
-es_val_t es_make_char(int charcode)
+/**
+ * Starts a region: until the matching es_region_end, new objects are
+ * allocated in an arena which is dropped wholesale at the end. Regions
+ * nest, only the outermost one is reclaimed.
+ */
+void es_region_begin(es_ctx_t* ctx)
 {
-  return es_tagged_val(charcode, ES_CHAR_TAG);
+  ctx->heap.region_depth++;
 }
 
-int es_char_val(es_val_t val)
+/**
+ * Ends a region. Objects of the region which are still reachable, from
+ * the global environment, the roots or any older object, are promoted
+ * into the old space by a minor collection and the rest are discarded
+ * without being traced. Values the caller keeps in C locals must be
+ * rooted to survive.
+ */
+void es_region_end(es_ctx_t* ctx)
 {
-  return es_payload(int, val);
+  es_heap_t* heap = &ctx->heap;
+  if (heap->region_depth == 0)
+    return;
+  if (heap->region_depth == 1 && region_used(heap) > 0)
+    es_gc_minor(ctx); // Still inside the region, so its objects count as young
+  heap->region_depth--;
 }
 
-es_val_t es_make_char_cstr(char* buf)
-{
-  if (strcmp("space", buf) == 0) {
-    return es_make_char(' ');
-  } else if (strcmp("newline", buf) == 0) {
-    return es_make_char('\n');
-  } else if (strcmp("tab", buf) == 0) {
-    return es_make_char('\t');
-  } else {
-    return es_make_char(*buf);
+/**
+ * Initializes the heap.
+ *
+ * The old generation is a pair of semispaces. A nursery sits in front of it
+ * and is evacuated into the old from space on each minor collection, so the
+ * old space keeps nursery_size bytes in reserve to guarantee a full
+ * collection always fits in the to space.
+ *
+ * Sizes in the config count both semispaces, like es_ctx_new. A compacting
+ * heap has no to space and gets the whole size as its old space.
+ */
+static void heap_init(es_heap_t* heap, const es_heap_config_t* config)
+{
+  int spaces           = config->compact ? 1 : 2;
+  heap->compact        = config->compact;
+  heap->requested      = config->initial_size;
+  heap->size           = align((config->initial_size + spaces - 1) / spaces, ES_DEFAULT_ALIGNMENT);
+  heap->min_size       = heap->size;
+  heap->max_size       = config->max_size ? align((config->max_size + spaces - 1) / spaces, ES_DEFAULT_ALIGNMENT) : 0;
+  heap->growth         = config->growth_factor > 1.0 ? config->growth_factor : ES_HEAP_GROWTH;
+  heap->next_size      = heap->size;
+  heap->low_count      = 0;
+  if (heap->max_size && heap->max_size < heap->size) {
+    heap->max_size = heap->size;
+  }
+  heap->max_memory     = config->max_memory;
+  heap->buffer         = malloc(heap->size + ES_DEFAULT_ALIGNMENT);
+  heap->from_space     = alignp(heap->buffer, ES_DEFAULT_ALIGNMENT);
+  heap->to_buffer      = NULL;
+  heap->mapped         = NULL;
+  heap->mapped_size    = 0;
+  heap->to_space       = NULL;
+  heap->to_end         = NULL;
+  heap->to_size        = 0;
+  if (!heap->compact) {
+    heap_resize_to_space(heap, heap->size);
   }
+  heap->nursery_size   = align(heap->size / 8 < ES_NURSERY_SIZE ? heap->size / 8 : ES_NURSERY_SIZE, ES_DEFAULT_ALIGNMENT);
+  heap->nursery_buffer = malloc(heap->nursery_size + ES_DEFAULT_ALIGNMENT);
+  heap->nursery        = alignp(heap->nursery_buffer, ES_DEFAULT_ALIGNMENT);
+  heap->nursery_next   = heap->nursery;
+  heap->nursery_end    = heap->nursery + heap->nursery_size;
+  heap->region         = NULL;
+  heap->region_depth   = 0;
+  heap->next           = heap->from_space;
+  heap->end            = heap->from_space + heap->size - heap->nursery_size;
+  heap->mode           = ES_GC_IDLE;
+  heap->no_gc          = 0;
+  heap->max_pause_us   = heap->compact ? 0 : config->max_pause_us;
+  heap->gc_threads     = config->gc_threads > 1 ? config->gc_threads : 1;
+  heap->par            = NULL;
+  heap->inc_active     = 0;
+  heap->marked         = 0;
+  heap->large          = NULL;
+  heap->large_bytes    = 0;
+  heap->large_limit    = heap->size;
+  heap->last_alloc     = 0;
+  heap->last_live      = 0;
+  heap->epoch          = 0;
+  heap->minor_epoch    = 0;
+  memset(&heap->stats, 0, sizeof(heap->stats));
+  gettimeofday(&heap->last_gc, NULL);
+  objlist_init(&heap->remset, ES_REMSET_SIZE);
+  objlist_init(&heap->inc_log, ES_REMSET_SIZE);
+  objlist_init(&heap->inc_rescan, ES_REMSET_SIZE);
+  objlist_init(&heap->mark_stack, ES_REMSET_SIZE);
+  objlist_init(&heap->finalizable, ES_REMSET_SIZE);
+  objlist_init(&heap->weak, ES_REMSET_SIZE);
+  objlist_init(&heap->ephemerons, ES_REMSET_SIZE);
+}
+
+static void heap_free(es_heap_t* heap)
+{
+  for(int i = 0; i < heap->finalizable.count; i++) {
+    obj_finalize(heap->finalizable.items[i]);
+  }
+  while(heap->large) {
+    es_large_t* large = heap->large;
+    heap->large = large->next;
+    free(large->buffer);
+  }
+  heap_free_space(heap, heap->buffer);
+  heap_free_space(heap, heap->to_buffer);
+  free(heap->nursery_buffer);
+  while(heap->region) {
+    es_region_t* chunk = heap->region;
+    heap->region = chunk->prev;
+    free(chunk);
+  }
+  free(heap->remset.items);
+  free(heap->inc_log.items);
+  free(heap->inc_rescan.items);
+  free(heap->mark_stack.items);
+  free(heap->finalizable.items);
+  free(heap->weak.items);
+  free(heap->ephemerons.items);
 }
 
-int es_is_char(es_val_t val)
+static void objlist_init(es_objlist_t* list, int size)
 {
-  return ES_CHAR_TYPE == es_type_of(val);
+  list->items = malloc(size * sizeof(es_val_t));
+  list->count = 0;
+  list->size  = size;
 }
 
-static void es_char_print(es_ctx_t* ctx, es_val_t val, es_val_t port)
+static void objlist_push(es_objlist_t* list, es_val_t obj)
 {
-  int c = es_char_val(val);
-  switch(c) {
-    case ' ':  es_port_printf(ctx, port, "#\\space");   break;
-    case '\n': es_port_printf(ctx, port, "#\\newline"); break;
-    case '\t': es_port_printf(ctx, port, "#\\tab");     break;
-    default:   es_port_printf(ctx, port, "#\\%c", c);   break;
+  if (list->count >= list->size) {
+    list->size *= 2;
+    list->items = realloc(list->items, list->size * sizeof(es_val_t));
   }
+  list->items[list->count++] = obj;
 }
 
-static int is_obj(es_val_t val)
+/* Releases a semispace, which may come from a heap image mapping */
+static void heap_free_space(es_heap_t* heap, char* buffer)
 {
-  return ES_OBJ_TAG == es_tag(val) && es_val_to_obj(val) != NULL;
+  if (buffer && buffer == heap->mapped) {
+    munmap(heap->mapped, heap->mapped_size);
+    heap->mapped = NULL;
+  } else {
+    free(buffer);
+  }
 }
 
-es_obj_t* es_obj_val(es_val_t val)
+static void heap_resize_to_space(es_heap_t* heap, size_t size)
 {
-  return es_obj_to(es_obj_t*, val);
+  if (heap->to_buffer && heap->to_size == size)
+    return;
+  heap_free_space(heap, heap->to_buffer);
+  heap->to_buffer = malloc(size + ES_DEFAULT_ALIGNMENT);
+  heap->to_space  = alignp(heap->to_buffer, ES_DEFAULT_ALIGNMENT);
+  heap->to_size   = size;
+  heap->to_end    = heap->to_space + size;
 }
 
-static es_type_t obj_type_of(es_val_t val)
+/* Memory held by the heap: both semispaces, the nursery, large objects and regions */
+static size_t heap_footprint(es_heap_t* heap)
 {
-  return es_obj_val(val)->type;
+  return heap->size + heap->to_size + heap->nursery_size + heap->large_bytes + region_size(heap);
 }
 
-static es_obj_t* obj_reloc(es_val_t obj)
+/**
+ * @return Whether request more bytes outside of the semispaces stay
+ *         within the memory cap.
+ */
+static int heap_fits(es_heap_t* heap, size_t request)
 {
-  return es_obj_val(obj)->reloc;
+  return !heap->max_memory || heap_footprint(heap) + request <= heap->max_memory;
 }
 
-static void obj_init(es_val_t self, es_type_t type)
-{
-  es_obj_t* obj = es_obj_val(self);
-  obj->type  = type;
-  obj->reloc = NULL;
+/**
+ * @return The largest semispace size allowed by max_size and by what the
+ *         memory cap leaves once the nursery, large objects and regions
+ *         are accounted for. Two semispaces are counted unless
+ *         compacting, so the to space a copying collection needs is
+ *         always reserved and the collector never runs out of memory.
+ */
+static size_t heap_space_limit(es_heap_t* heap)
+{
+  size_t limit = heap->max_size ? heap->max_size : SIZE_MAX;
+  if (heap->max_memory) {
+    size_t other = heap->nursery_size + heap->large_bytes + region_size(heap);
+    size_t space = other < heap->max_memory ? (heap->max_memory - other) / (heap->compact ? 1 : 2) : 0;
+    space &= ~(size_t)(ES_DEFAULT_ALIGNMENT - 1);
+    if (space < limit)
+      limit = space;
+  }
+  return limit;
 }
 
-static int es_obj_is_reloc(es_val_t val)
-{
-  return obj_reloc(val) != NULL;
+/**
+ * Picks the semispace size for the next full collection from the
+ * occupancy left by the one that just finished.
+ */
+static void heap_adjust(es_heap_t* heap)
+{
+  size_t live   = heap->next - heap->from_space;
+  size_t usable = heap->size - heap->nursery_size;
+  size_t size   = heap->size;
+
+  if (live * 100 > usable * ES_HEAP_GROW_PCT) {
+    size_t limit = heap_space_limit(heap);
+    size = align((size_t)(heap->size * heap->growth), ES_DEFAULT_ALIGNMENT);
+    if (size > limit)
+      size = limit > heap->size ? limit : heap->size;
+    heap->low_count = 0;
+  } else if (live * 100 < usable * ES_HEAP_SHRINK_PCT && heap->size > heap->min_size) {
+    if (++heap->low_count >= ES_HEAP_SHRINK_DELAY) {
+      size = align((size_t)(heap->size / heap->growth), ES_DEFAULT_ALIGNMENT);
+      if (size < heap->min_size)
+        size = heap->min_size;
+      if (live + heap->nursery_size > size)
+        size = heap->size;
+      heap->low_count = 0;
+    }
+  } else {
+    heap->low_count = 0;
+  }
+  if (size > heap_space_limit(heap) && live + heap->nursery_size <= heap_space_limit(heap))
+    size = heap_space_limit(heap);
+  heap->next_size = size;
 }
 
-es_val_t es_make_error(es_ctx_t* ctx, char* errstr)
+/**
+ * Grows the heap immediately so that an allocation of request bytes fits
+ * in the old space.
+ *
+ * @return 1 on success, 0 if the heap is already at its maximum size.
+ */
+static int heap_grow(es_ctx_t* ctx, size_t request)
 {
-  es_error_t* error = es_alloc(ctx, ES_ERROR_TYPE, sizeof(es_error_t));
-  error->errstr = errstr;
-  return es_obj_to_val(error);
-}
+  es_heap_t* heap = &ctx->heap;
+  size_t live = heap->next - heap->from_space;
+  size_t need = align(live + request + heap->nursery_size + ES_DEFAULT_ALIGNMENT, ES_DEFAULT_ALIGNMENT);
+  size_t size = align((size_t)(heap->size * heap->growth), ES_DEFAULT_ALIGNMENT);
 
-int es_is_error(es_val_t val)
-{
-  return ES_ERROR_TYPE == es_type_of(val);
-}
+  size_t limit = heap_space_limit(heap);
 
-es_error_t* es_error_val(es_val_t val)
-{
-  return es_obj_to(es_error_t*, val);
-}
+  if (size < need)
+    size = need;
+  if (size > limit)
+    size = limit;
+  if (size < need)
+    return 0;
 
-static void es_error_print(es_ctx_t* ctx, es_val_t val, es_val_t port)
-{
-  es_port_printf(ctx, port, "#<error: %s>", es_error_val(val)->errstr);
+  heap->next_size = size;
+  es_gc(ctx);
+  return 1;
 }
 
-es_val_t es_make_fixnum(int value)
+/**
+ * Records an old object in the remembered set.
+ *
+ * @param heap The heap
+ * @param obj  An object outside of the nursery
+ */
+static void gc_remember(es_heap_t* heap, es_val_t obj)
 {
-  return es_tagged_val(value, ES_FIXNUM_TAG);
+  es_obj_t* o = es_val_to_obj(obj);
+  if (obj_hdr_flags(o) & ES_OBJ_REMEMBERED)
+    return;
+  obj_hdr_set_flags(o, ES_OBJ_REMEMBERED);
+  objlist_push(&heap->remset, obj);
 }
 
-int es_is_fixnum(es_val_t val)
+static void gc_finalizable(es_heap_t* heap, es_val_t obj)
 {
-  return ES_FIXNUM_TYPE == es_type_of(val);
+  objlist_push(&heap->finalizable, obj);
 }
 
-int es_fixnum_val(es_val_t fixnum)
+static void obj_finalize(es_val_t obj)
 {
-  return es_payload(int, fixnum);
+  switch(obj_type_of(obj)) {
+  case ES_PORT_TYPE:     es_port_finalize(obj);     break;
+  case ES_BYTECODE_TYPE: es_bytecode_finalize(obj); break;
+  default:                                          break;
+  }
 }
 
-es_val_t es_number_add(es_ctx_t* ctx, es_val_t v1, es_val_t v2)
-{
+/**
+ * Walks the finalization queue once a collection has traced everything
+ * but before it reuses the condemned memory. Survivors are either
+ * forwarded or marked; the rest are finalized and dropped from the queue.
+ *
+ * @param minor Only nursery and region objects were condemned
+ */
+static void gc_finalize(es_heap_t* heap, int minor)
+{
+  es_objlist_t* queue = &heap->finalizable;
+  int n = 0;
+  for(int i = 0; i < queue->count; i++) {
+    es_val_t  obj = queue->items[i];
+    es_obj_t* o   = es_val_to_obj(obj);
+    if (minor && !heap_in_young(heap, obj)) {
+      queue->items[n++] = obj;
+    } else if (obj_hdr_reloc(o)) {
+      queue->items[n++] = es_obj_retag(obj_hdr_reloc(o), obj);
+    } else if (obj_hdr_flags(o) & ES_OBJ_MARKED) {
+      queue->items[n++] = obj;
+    } else {
+      obj_finalize(obj);
+    }
+  }
+  queue->count = n;
+}
+
+static void gc_log_mutation(es_heap_t* heap, es_val_t obj)
+{
+  es_obj_t* o = es_val_to_obj(obj);
+  if (obj_hdr_flags(o) & ES_OBJ_LOGGED)
+    return;
+  obj_hdr_set_flags(o, ES_OBJ_LOGGED);
+  objlist_push(&heap->inc_log, obj);
+}
+
+/**
+ * Bytecode, environments and iterators are updated in place without going
+ * through the write barrier, so replicating one logs it up front.
+ */
+static void gc_log_unbarriered(es_heap_t* heap, es_val_t obj)
+{
+  switch(obj_type_of(obj)) {
+  case ES_BYTECODE_TYPE:
+  case ES_ENV_TYPE:
+  case ES_ITERATOR_TYPE:
+    gc_log_mutation(heap, obj);
+    break;
+  default:
+    break;
+  }
+}
+
+static int heap_in_to_space(es_heap_t* heap, es_val_t val)
+{
+  char* p = (char*)es_val_to_obj(val);
+  return p >= heap->to_space && p < heap->to_end;
+}
+
+static int heap_in_snapshot(es_heap_t* heap, es_val_t val)
+{
+  char* p = (char*)es_val_to_obj(val);
+  return p >= heap->from_space && p < heap->snapshot_end;
+}
+
+/**
+ * @return Whether val was reached by the collection tracing so far, or
+ *         is not condemned by it.
+ */
+static int gc_is_live(es_heap_t* heap, es_val_t val)
+{
+  if (!is_obj(val))
+    return 1;
+  es_obj_t* o = es_val_to_obj(val);
+  switch(heap->mode) {
+  case ES_GC_MINOR: return !heap_in_young(heap, val) || obj_hdr_reloc(o);
+  case ES_GC_MARK:  return obj_hdr_flags(o) & ES_OBJ_MARKED;
+  default:          return heap_in_to_space(heap, val) || (obj_hdr_flags(o) & ES_OBJ_MARKED) || obj_hdr_reloc(o);
+  }
+}
+
+/**
+ * Resolves the weak references met by a collection once its scan is done.
+ *
+ * Ephemerons whose key turned out to be live have their value traced,
+ * which may in turn revive the keys of others, until a fixpoint. The rest
+ * are broken, and weak boxes whose value did not survive are cleared.
+ */
+static void gc_process_weak(es_heap_t* heap, char** next)
+{
+  es_objlist_t* pending = &heap->ephemerons;
+  int progress = 1;
+
+  while(progress) {
+    char* from = *next;
+    int n = 0;
+    progress = 0;
+    for(int i = 0; i < pending->count; i++) {
+      es_val_t        obj = pending->items[i];
+      es_ephemeron_t* eph = es_ephemeron_val(obj);
+      if (gc_is_live(heap, eph->key)) {
+        es_mark_copy(heap, &eph->key, next);
+        es_mark_copy(heap, &eph->val, next);
+        progress = 1;
+      } else {
+        pending->items[n++] = obj;
+      }
+    }
+    pending->count = n;
+    if (progress)
+      gc_scan(heap, from, next);         // May queue more ephemerons and weak boxes
+  }
+
+  for(int i = 0; i < pending->count; i++) {
+    es_ephemeron_t* eph = es_ephemeron_val(pending->items[i]);
+    eph->key = es_unbound;
+    eph->val = es_false;
+  }
+
+  for(int i = 0; i < heap->weak.count; i++) {
+    es_weak_t* weak = es_weak_val(heap->weak.items[i]);
+    if (!gc_is_live(heap, weak->val))
+      weak->val = es_false;
+    else if (heap->mode != ES_GC_MARK)
+      es_mark_copy(heap, &weak->val, next); // Already copied, only the reference is updated
+  }
+
+  pending->count    = 0;
+  heap->weak.count  = 0;
+}
+
+/**
+ * Write barrier, must be called when storing val into a field of obj.
+ *
+ * Stores of a young reference into an old object put the object in the
+ * remembered set so the next minor collection treats it as a root. During
+ * an incremental cycle, stores into an object that was already replicated
+ * are logged so the replica is brought up to date when the cycle ends.
+ */
+static void gc_write_barrier(es_ctx_t* ctx, es_val_t obj, es_val_t val)
+{
+  es_heap_t* heap = &ctx->heap;
+  if (is_obj(val) && heap_in_young(heap, val) && !heap_in_young(heap, obj)) {
+    gc_remember(heap, obj);
+  }
+  if (heap->inc_active && es_obj_is_reloc(obj)) {
+    gc_log_mutation(heap, obj);
+  }
+}
+
+void es_mark_copy(es_heap_t* heap, es_val_t* ref, char** next)
+{
+  if (!is_obj(*ref))
+    return;
+
+  switch(heap->mode) {
+  case ES_GC_PARALLEL:                           // Copying races with other threads
+    gc_par_copy(heap, ref, next);
+    return;
+  case ES_GC_MARK:                               // Compaction marks in place, nothing moves yet
+    gc_mark(heap, *ref);
+    return;
+  case ES_GC_RELOCATE:                           // The image map is passed as the copy pointer
+    *ref = image_rebase((struct es_image_map*)next, *ref);
+    return;
+  case ES_GC_VISIT:                              // So is the heap dump
+    heap_dump_edge((struct es_heap_dump*)next, *ref);
+    return;
+  case ES_GC_UPDATE:                             // Forwarding addresses are already assigned
+    if (es_obj_is_reloc(*ref))
+      *ref = es_obj_retag(obj_reloc(*ref), *ref);
+    return;
+  case ES_GC_MINOR:                              // Old objects are not condemned by a minor collection
+    if (!heap_in_young(heap, *ref))
+      return;
+    break;
+  case ES_GC_SLICE:                              // Only objects older than the cycle are replicated
+    if (!heap_in_snapshot(heap, *ref)) {
+      heap->inc_dirty |= !heap_in_to_space(heap, *ref);
+      return;
+    }
+    break;
+  default:
+    if (heap_in_to_space(heap, *ref))
+      return;
+    if (is_large(*ref)) {                        // Large objects are marked in place, never copied
+      gc_mark(heap, *ref);
+      return;
+    }
+    break;
+  }
+
+  if (es_obj_is_reloc(*ref)) {
+    *ref = es_obj_retag(obj_reloc(*ref), *ref);    // Update stale reference to relocated object
+  } else {
+    if (heap->mode == ES_GC_SLICE) {
+      gc_log_unbarriered(heap, *ref);
+    }
+    size_t size = es_size_of(*ref);                // Get size of object
+    *next = alignp(*next, ES_DEFAULT_ALIGNMENT); // Ensure next pointer is aligned
+    assert(*next + size <= (heap->mode == ES_GC_MINOR ? heap->end : heap->to_end));
+    memcpy(*next, es_val_to_obj(*ref), size);      // Copy object from_space from_space-space into to_space-space
+    obj_hdr_set_reloc(es_val_to_obj(*ref), *next); // Leave forwarding pointer in old from_space-space object
+    *ref = es_obj_retag(*next, *ref);              // Update current reference to_space point to_space new object in to_space-space
+    obj_hdr_reset(es_val_to_obj(*ref));            // Reset tombstone
+    *next += size;                                 // Update next pointer
+  }
+}
+
+es_type_t es_type_of(es_val_t val)
+{
+  switch(es_tag(val)) {
+  case ES_OBJ_TAG:    return obj_type_of(val);
+  case ES_PAIR_TAG:    return ES_PAIR_TYPE;
+  case ES_CLOSURE_TAG: return ES_CLOSURE_TYPE;
+  case ES_VALUE_TAG:  return es_payload(es_type_t, val & 0xff); // Small strings keep their characters above the low byte
+  case ES_BOOL_TAG:   return ES_BOOL_TYPE;
+  case ES_FIXNUM_TAG: return ES_FIXNUM_TYPE;
+  case ES_SYMBOL_TAG: return ES_SYMBOL_TYPE;
+  case ES_CHAR_TAG:   return ES_CHAR_TYPE;
+  default:            return ES_INVALID_TYPE;
+  }
+}
+
+static es_val_t es_port_vprintf(es_ctx_t* ctx, es_val_t port, const char* fmt, va_list args);
+static void es_print(es_ctx_t* ctx, es_val_t val, es_val_t oport);
+
+void es_printf(es_ctx_t* ctx, const char * fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  es_port_vprintf(ctx, ctx->oport, fmt, args);
+  va_end(args);
+}
+
+void es_write(es_ctx_t* ctx, es_val_t val)
+{
+  es_port_write(ctx, ctx->oport, val);
+}
+
+int es_is_eq(es_val_t v1, es_val_t v2)
+{
+  return v1 == v2;
+}
+
+es_val_t es_make_bool(int value)
+{
+  return es_tagged_val(value == 0 ? 0 : 1, ES_BOOL_TAG);
+}
+
+int es_is_bool(es_val_t val)
+{
+  return ES_BOOL_TYPE == es_type_of(val);
+}
+
+int es_is_true(es_val_t val)
+{
+  return es_bool_val(val) != 0;
+}
+
+int es_bool_val(es_val_t val)
+{
+  return es_payload(int, val);
+}
+
+void es_bool_print(es_ctx_t* ctx, es_val_t val, es_val_t port)
+{
+  es_port_printf(ctx, port, "#%c", es_is_true(val) ? 't' : 'f');
+}
+
+es_val_t es_make_char(int charcode)
+{
+  return es_tagged_val(charcode, ES_CHAR_TAG);
+}
+
+int es_char_val(es_val_t val)
+{
+  return es_payload(int, val);
+}
+
+es_val_t es_make_char_cstr(char* buf)
+{
+  if (strcmp("space", buf) == 0) {
+    return es_make_char(' ');
+  } else if (strcmp("newline", buf) == 0) {
+    return es_make_char('\n');
+  } else if (strcmp("tab", buf) == 0) {
+    return es_make_char('\t');
+  } else {
+    return es_make_char(*buf);
+  }
+}
+
+int es_is_char(es_val_t val)
+{
+  return ES_CHAR_TYPE == es_type_of(val);
+}
+
+static void es_char_print(es_ctx_t* ctx, es_val_t val, es_val_t port)
+{
+  int c = es_char_val(val);
+  switch(c) {
+    case ' ':  es_port_printf(ctx, port, "#\\space");   break;
+    case '\n': es_port_printf(ctx, port, "#\\newline"); break;
+    case '\t': es_port_printf(ctx, port, "#\\tab");     break;
+    default:   es_port_printf(ctx, port, "#\\%c", c);   break;
+  }
+}
+
+static int is_obj(es_val_t val)
+{
+  return ((ES_OBJ_TAGS >> es_tag(val)) & 1) && es_val_to_obj(val) != NULL;
+}
+
+es_obj_t* es_obj_val(es_val_t val)
+{
+  return es_obj_to(es_obj_t*, val);
+}
+
+static es_type_t obj_type_of(es_val_t val)
+{
+  return obj_hdr_type(es_obj_val(val));
+}
+
+static es_obj_t* obj_reloc(es_val_t obj)
+{
+  return obj_hdr_reloc(es_obj_val(obj));
+}
+
+static void obj_init(es_val_t self, es_type_t type)
+{
+  es_obj_val(self)->header = obj_header(type, 0);
+}
+
+static int es_obj_is_reloc(es_val_t val)
+{
+  return obj_reloc(val) != NULL;
+}
+
+es_val_t es_make_error(es_ctx_t* ctx, char* errstr)
+{
+  es_error_t* error = es_alloc(ctx, ES_ERROR_TYPE, sizeof(es_error_t));
+  error->errstr = errstr;
+  return es_obj_to_val(error);
+}
+
+int es_is_error(es_val_t val)
+{
+  return ES_ERROR_TYPE == es_type_of(val);
+}
+
+es_error_t* es_error_val(es_val_t val)
+{
+  return es_obj_to(es_error_t*, val);
+}
+
+static void es_error_print(es_ctx_t* ctx, es_val_t val, es_val_t port)
+{
+  es_port_printf(ctx, port, "#<error: %s>", es_error_val(val)->errstr);
+}
+
+es_val_t es_make_fixnum(int value)
+{
+  return es_tagged_val(value, ES_FIXNUM_TAG);
+}
+
+int es_fixnum_val(es_val_t fixnum)
+{
+  return es_payload(int, fixnum);
+}
+
+es_val_t es_number_add(es_ctx_t* ctx, es_val_t v1, es_val_t v2)
+{
   int a = es_fixnum_val(v1);
   int b = es_fixnum_val(v2);
   return es_make_fixnum(a + b);
@@ -666,12 +1756,7 @@ es_val_t es_make_pair(es_ctx_t* ctx, es_val_t head, es_val_t tail)
   pair->head = head;
   pair->tail = tail;
   gc_unroot(ctx, 2);
-  return es_obj_to_val(pair);
-}
-
-int es_is_pair(es_val_t val)
-{
-  return ES_PAIR_TYPE == es_type_of(val);
+  return es_obj_to_val(pair) | ES_PAIR_TAG;
 }
 
 es_pair_t* es_pair_val(es_val_t val)
@@ -689,13 +1774,15 @@ es_val_t es_pair_cdr(es_val_t pair)
   return es_pair_val(pair)->tail;
 }
 
-void es_pair_set_head(es_val_t pair, es_val_t value)
+void es_pair_set_head(es_ctx_t* ctx, es_val_t pair, es_val_t value)
 {
+  gc_write_barrier(ctx, pair, value);
   es_pair_val(pair)->head = value;
 }
 
-void es_pair_set_tail(es_val_t pair, es_val_t value)
+void es_pair_set_tail(es_ctx_t* ctx, es_val_t pair, es_val_t value)
 {
+  gc_write_barrier(ctx, pair, value);
   es_pair_val(pair)->tail = value;
 }
 
@@ -721,9 +1808,15 @@ static void es_pair_print(es_ctx_t* ctx, es_val_t val, es_val_t port)
   es_port_printf(ctx, port, ")");
 }
 
+/**
+ * Makes a port reading from or writing to stream. The port's buffers are
+ * released once it is collected, the stream stays owned by the caller.
+ */
 es_val_t es_make_port(es_ctx_t* ctx, FILE* stream)
 {
-  es_port_t* port = es_alloc(ctx, ES_PORT_TYPE, sizeof(es_port_t));
+  es_port_obj_t* obj = es_alloc(ctx, ES_PORT_TYPE, sizeof(es_port_obj_t));
+  es_port_t* port = malloc(sizeof(es_port_t));
+  obj->port    = port;
   port->stream = stream;
   port->eof    = 0;
   port->top    = 0;
@@ -734,7 +1827,16 @@ es_val_t es_make_port(es_ctx_t* ctx, FILE* stream)
   port->colnum = 0;
   port->size   = 65536;
   port->buf    = malloc(port->size);
-  return es_obj_to_val(port);
+  gc_finalizable(&ctx->heap, es_obj_to_val(obj));
+  return es_obj_to_val(obj);
+}
+
+static void es_port_finalize(es_val_t val)
+{
+  es_port_obj_t* obj = es_obj_to(es_port_obj_t*, val);
+  free(obj->port->buf);
+  free(obj->port);
+  obj->port = NULL;
 }
 
 int es_is_port(es_val_t val)
@@ -744,7 +1846,7 @@ int es_is_port(es_val_t val)
 
 es_port_t* es_port_val(es_val_t val)
 {
-  return es_obj_to(es_port_t*, val);
+  return es_obj_to(es_port_obj_t*, val)->port;
 }
 
 es_val_t es_port_vprintf(es_ctx_t* ctx, es_val_t port, const char* fmt, va_list args)
@@ -940,6 +2042,7 @@ es_val_t es_make_proc(es_ctx_t* ctx, int arity, int rest, int addr, int end)
   proc->rest  = rest;
   proc->addr  = addr;
   proc->end   = end;
+  proc->captures = 1;
   return es_obj_to_val(proc);
 }
 
@@ -972,27 +2075,204 @@ static int es_proc_arity(es_val_t proc)
 }
 */
 
-es_val_t es_make_cont(es_ctx_t* ctx)
-{
-  es_cont_t* k = es_alloc(ctx, ES_CONT_TYPE, sizeof(es_cont_t));
-
+/**
+ * Captures the continuation returning through frame fp, with its value in
+ * stack slot sp. Escape-only continuations copy nothing: they can only be
+ * resumed while their marker frame is live, which leaves the stacks below
+ * it as they were. Full ones also copy that live part of both stacks.
+ */
+static es_val_t cont_capture(es_ctx_t* ctx, int sp, int fp, int full)
+{
+  int        n = full ? sp + 2 * (fp + 1) : 0;
+  es_cont_t* k = es_alloc(ctx, ES_CONT_TYPE, sizeof(es_cont_t) + n * sizeof(es_val_t));
+  es_inst_t* inst = es_bytecode_val(ctx->bytecode)->inst;
+  k->sp   = sp;
+  k->fp   = fp;
+  k->full = full;
+  if (full) {
+    memcpy(k->saved, ctx->stack, sp * sizeof(es_val_t));
+    for(int i = 0; i <= fp; i++) {
+      k->saved[sp + 2 * i]     = ctx->frames[i].args;
+      k->saved[sp + 2 * i + 1] = es_make_fixnum(ctx->frames[i].knt - inst); // The instructions may be reallocated
+    }
+  }
   return es_obj_to_val(k);
 }
 
-int es_is_cont(es_val_t val)
-{
-  return ES_CONT_TYPE == es_type_of(val);
-}
+/**
+ * Kept for embedders of the former API. Continuations are captured by the
+ * running VM, through call/cc and call/ec, so there is none to make from C.
+ *
+ * @return An error.
+ */
+es_val_t es_make_cont(es_ctx_t* ctx)
+{
+  return es_make_error(ctx, "continuations can only be captured by call/cc or call/ec");
+}
+
+int es_is_cont(es_val_t val)
+{
+  return ES_CONT_TYPE == es_type_of(val);
+}
 
 es_cont_t* es_cont_val(es_val_t val)
 {
   return es_obj_to(es_cont_t*, val);
 }
 
+/* Puts back the stacks copied by a full continuation */
+static void cont_restore(es_ctx_t* ctx, es_cont_t* k)
+{
+  es_inst_t* inst = es_bytecode_val(ctx->bytecode)->inst;
+  if (ctx->stack + k->sp > ctx->stack_limit || k->fp >= ctx->frame_limit)
+    vm_deepen(ctx, ctx->stack + k->sp, k->fp);
+  memcpy(ctx->stack, k->saved, k->sp * sizeof(es_val_t));
+  for(int i = 0; i <= k->fp; i++) {
+    ctx->frames[i].args = k->saved[k->sp + 2 * i];
+    ctx->frames[i].knt  = inst + es_fixnum_val(k->saved[k->sp + 2 * i + 1]);
+  }
+}
+
+static size_t es_cont_size_of(es_val_t val)
+{
+  es_cont_t* k = es_cont_val(val);
+  return sizeof(es_cont_t) + (k->full ? k->sp + 2 * (k->fp + 1) : 0) * sizeof(es_val_t);
+}
+
+static void es_cont_mark_copy(es_heap_t* heap, es_val_t pval, char** next)
+{
+  es_cont_t* k = es_cont_val(pval);
+  for(int i = 0, n = k->full ? k->sp + 2 * (k->fp + 1) : 0; i < n; i++)
+    es_mark_copy(heap, &k->saved[i], next);
+}
+
+/**
+ * Makes an iterator over a list, vector, string or port, or a generator
+ * running procedure proc. proc is called with the iterator itself, calling
+ * it with a value yields that value to iterator-next.
+ */
+es_val_t es_make_iterator(es_ctx_t* ctx, es_val_t source)
+{
+  es_iter_t* it;
+  int        kind;
+  if (es_is_pair(source) || es_is_nil(source))
+    kind = ES_ITER_LIST;
+  else if (es_is_vector(source))
+    kind = ES_ITER_VECTOR;
+  else if (es_is_string(source))
+    kind = ES_ITER_STRING;
+  else if (es_is_port(source))
+    kind = ES_ITER_PORT;
+  else if (es_is_closure(source))
+    kind = ES_ITER_GENERATOR;
+  else
+    return es_make_error(ctx, "cannot iterate over value");
+  gc_root(ctx, source);
+  it = es_alloc(ctx, ES_ITERATOR_TYPE, sizeof(es_iter_t));
+  it->source  = source;
+  it->saved   = es_nil;
+  it->kind    = kind;
+  it->pos     = 0; // Also ES_GEN_NEW
+  it->sp      = 0;
+  it->fp      = 0;
+  it->nstack  = 0;
+  it->nframes = 0;
+  gc_unroot(ctx, 1);
+  return es_obj_to_val(it);
+}
+
+int es_is_iterator(es_val_t val)
+{
+  return ES_ITERATOR_TYPE == es_type_of(val);
+}
+
+static es_iter_t* es_iter_val(es_val_t val)
+{
+  return es_obj_to(es_iter_t*, val);
+}
+
+static int es_is_generator(es_val_t val)
+{
+  return es_is_iterator(val) && es_iter_val(val)->kind == ES_ITER_GENERATOR;
+}
+
+/**
+ * Steps an iterator over a sequence.
+ *
+ * @return The next element, or the eof object once the sequence is done.
+ */
+static es_val_t iter_step(es_ctx_t* ctx, es_val_t val)
+{
+  es_iter_t* it  = es_iter_val(val);
+  es_val_t   src = it->source;
+  switch(it->kind) {
+  case ES_ITER_LIST:
+    if (!es_is_pair(src))
+      return es_eof_obj;
+    gc_write_barrier(ctx, val, es_cdr(src));
+    it->source = es_cdr(src);
+    return es_car(src);
+  case ES_ITER_VECTOR:
+    return it->pos < es_vector_len(src) ? es_vector_ref(src, it->pos++) : es_eof_obj;
+  case ES_ITER_STRING:
+    return it->pos < es_string_length(src) ? es_make_char(es_string_ref(src, it->pos++)) : es_eof_obj;
+  case ES_ITER_PORT:
+    return es_port_read(ctx, src);
+  }
+  return es_make_error(ctx, "generators are stepped by the VM");
+}
+
+static void es_iter_mark_copy(es_heap_t* heap, es_val_t val, char** next)
+{
+  es_iter_t* it = es_iter_val(val);
+  es_mark_copy(heap, &it->source, next);
+  es_mark_copy(heap, &it->saved, next);
+}
+
+/**
+ * Strings of up to ES_SMALL_STRING_MAX characters are immediates: the low
+ * byte holds the string type under the value tag, the next byte the length
+ * and the bytes above it the characters.
+ */
+static es_val_t small_string_make(const char* chars, size_t length)
+{
+  es_val_t val = es_small_string_tag | (es_val_t)length << 8;
+  for(size_t i = 0; i < length; i++)
+    val |= (es_val_t)(unsigned char)chars[i] << (16 + 8 * i);
+  return val;
+}
+
+static int es_is_small_string(es_val_t val)
+{
+  return (val & 0xff) == es_small_string_tag;
+}
+
+static size_t small_string_length(es_val_t val)
+{
+  return (val >> 8) & 0xff;
+}
+
+/**
+ * @return The characters of string, decoded into buf when they are packed
+ *         in the value itself.
+ */
+static const char* es_string_chars(es_val_t string, char buf[ES_SMALL_STRING_MAX + 1])
+{
+  if (!es_is_small_string(string))
+    return es_string_val(string)->value;
+  size_t length = small_string_length(string);
+  for(size_t i = 0; i < length; i++)
+    buf[i] = es_string_ref(string, i);
+  buf[length] = '\0';
+  return buf;
+}
+
 es_val_t es_make_string(es_ctx_t* ctx, char* cstr)
 {
   es_string_t* string;
   long length = strlen(cstr);
+  if (length <= ES_SMALL_STRING_MAX)
+    return small_string_make(cstr, length);
   string = es_alloc(ctx, ES_STRING_TYPE, sizeof(es_string_t) + length + 1);
   string->length = length;
   strcpy(string->value, cstr);
@@ -1002,6 +2282,11 @@ es_val_t es_make_string(es_ctx_t* ctx, char* cstr)
 es_val_t es_string_make(es_ctx_t* ctx, int length, char c)
 {
   es_string_t* string;
+  if (length <= ES_SMALL_STRING_MAX) {
+    char chars[ES_SMALL_STRING_MAX];
+    memset(chars, c, sizeof(chars));
+    return small_string_make(chars, length);
+  }
   string = es_alloc(ctx, ES_STRING_TYPE, sizeof(es_string_t) + length + 1);
   string->length = length;
   for(int i = 0; i < string->length; i++) {
@@ -1011,8 +2296,15 @@ es_val_t es_string_make(es_ctx_t* ctx, int length, char c)
   return es_obj_to_val(string);
 }
 
+static int es_string_length(es_val_t string)
+{
+  return es_is_small_string(string) ? small_string_length(string) : es_string_val(string)->length;
+}
+
 int es_string_ref(es_val_t string, int k)
 {
+  if (es_is_small_string(string))
+    return (char)(string >> (16 + 8 * k));
   es_string_t* s = es_string_val(string);
   return s->value[k];
 }
@@ -1045,7 +2337,8 @@ static size_t es_string_size_of(es_val_t value)
 
 static void es_string_print(es_ctx_t* ctx, es_val_t self, es_val_t port)
 {
-  es_port_printf(ctx, port,"\"%s\"", es_string_val(self)->value);
+  char buf[ES_SMALL_STRING_MAX + 1];
+  es_port_printf(ctx, port,"\"%s\"", es_string_chars(self, buf));
 }
 
 es_val_t es_make_symbol(int value)
@@ -1053,11 +2346,6 @@ es_val_t es_make_symbol(int value)
   return es_tagged_val(value, ES_SYMBOL_TAG);
 }
 
-int es_is_symbol(es_val_t val)
-{
-  return ES_SYMBOL_TYPE == es_type_of(val);
-}
-
 int es_symbol_val(es_val_t val)
 {
   return es_payload(int, val);
@@ -1066,11 +2354,7 @@ int es_symbol_val(es_val_t val)
 es_val_t es_symbol_intern(es_ctx_t* ctx, const char* cstr)
 {
   es_symtab_t* symtab = &ctx->symtab;
-  int id = symtab_find_or_create(symtab, cstr);
-  if (id < 0) {
-    return es_make_error(ctx, "symtab count exceeded");
-  }
-  return es_make_symbol(id);
+  return es_make_symbol(symtab_find_or_create(symtab, cstr));
 }
 
 es_val_t es_symbol_to_string(es_ctx_t* ctx, es_val_t val)
@@ -1089,6 +2373,7 @@ static void es_symbol_print(es_ctx_t* ctx, es_val_t sym, es_val_t port)
 es_val_t es_make_buffer(es_ctx_t* ctx, size_t size)
 {
   es_buffer_t* buffer = es_alloc(ctx, ES_BUFFER_TYPE, sizeof(es_buffer_t) + size);
+  buffer->size = size;
   return es_obj_to_val(buffer);
 }
 
@@ -1099,7 +2384,7 @@ es_buffer_t* es_buffer_val(es_val_t val)
 
 static size_t es_buffer_size_of(es_val_t buffer)
 {
-  return es_buffer_val(buffer)->size;
+  return sizeof(es_buffer_t) + es_buffer_val(buffer)->size;
 }
 
 int es_is_unbound(es_val_t val)
@@ -1157,8 +2442,9 @@ int es_vector_len(es_val_t vector)
   return es_vector_val(vector)->length;
 }
 
-void es_vector_set(es_val_t vector, int idx, es_val_t val)
+void es_vector_set(es_ctx_t* ctx, es_val_t vector, int idx, es_val_t val)
 {
+  gc_write_barrier(ctx, vector, val);
   es_vector_val(vector)->array[idx] = val;
 }
 
@@ -1175,7 +2461,7 @@ es_val_t es_vector_from_list(es_ctx_t* ctx, es_val_t list)
   length = es_list_length(list);
   vector = es_make_vector(ctx, length);
   for(i = 0; i < length; i++, list = es_cdr(list)) {
-    es_vector_set(vector, i, es_car(list));
+    es_vector_set(ctx, vector, i, es_car(list));
   }
   gc_unroot(ctx, 1);
   return vector;
@@ -1233,8 +2519,9 @@ static es_val_t es_env_val_of(es_val_t env, int slot)
   return es_env_val(env)->slots[slot].val;
 }
 
-static void env_set_val(es_val_t env, int slot, es_val_t val)
+static void env_set_val(es_ctx_t* ctx, es_val_t env, int slot, es_val_t val)
 {
+  gc_write_barrier(ctx, env, val);
   es_env_val(env)->slots[slot].val = val;
 }
 
@@ -1284,7 +2571,7 @@ static int env_reserve_loc(es_ctx_t* ctx, es_val_t env, es_val_t sym, es_val_t i
   int loc = es_env_loc(env, sym);
   if (loc > -1) {
     if (es_is_unbound(es_env_val_of(env, loc))) {
-      env_set_val(env, loc, init);
+      env_set_val(ctx, env, loc, init);
     }
     return loc;
   }
@@ -1311,7 +2598,7 @@ static int env_reserve_loc(es_ctx_t* ctx, es_val_t env, es_val_t sym, es_val_t i
   }
 
   es_env_val(env)->slots[es_env_val(env)->count].sym = sym;
-  es_env_val(env)->slots[es_env_val(env)->count].val = init;
+  env_set_val(ctx, env, es_env_val(env)->count, init);
   return es_env_val(env)->count++;
 }
 
@@ -1326,8 +2613,76 @@ es_val_t es_define(es_ctx_t* ctx, char* symbol, es_val_t val)
   return es_define_symbol(ctx, es_ctx_env(ctx), es_symbol_intern(ctx, symbol), val);
 }
 
+/*
+ * Natives are written to images by name, since they may come from any
+ * shared object. Every process shares one registry of the names native
+ * functions were defined under, and the builtins are always in it.
+ */
+typedef struct es_native {
+  char*    name;
+  es_pfn_t fn;
+} es_native_t;
+
+static es_native_t*    natives;
+static int             natives_count, natives_size;
+static pthread_mutex_t natives_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t  natives_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Makes fn known to images under name. A name already registered keeps
+ * the function it was first registered with, and a function keeps its
+ * first name.
+ */
+void es_register_fn(const char* name, es_pfn_t fn)
+{
+  pthread_mutex_lock(&natives_lock);
+  for(int i = 0; i < natives_count; i++) {
+    if (natives[i].fn == fn || strcmp(natives[i].name, name) == 0) {
+      pthread_mutex_unlock(&natives_lock);
+      return;
+    }
+  }
+  if (natives_count == natives_size) {
+    natives_size = natives_size ? natives_size * 2 : 128;
+    natives      = realloc(natives, natives_size * sizeof(es_native_t));
+  }
+  natives[natives_count].name = strcpy(malloc(strlen(name) + 1), name);
+  natives[natives_count].fn   = fn;
+  natives_count++;
+  pthread_mutex_unlock(&natives_lock);
+}
+
+/* @return The registry index of fn, -1 if it was never registered */
+static int natives_index(es_pfn_t fn)
+{
+  int index = -1;
+  pthread_once(&natives_once, natives_init);
+  pthread_mutex_lock(&natives_lock);
+  for(int i = 0; i < natives_count && index < 0; i++) {
+    if (natives[i].fn == fn)
+      index = i;
+  }
+  pthread_mutex_unlock(&natives_lock);
+  return index;
+}
+
+/* @return The function registered under name, NULL if there is none */
+static es_pfn_t natives_find(const char* name)
+{
+  es_pfn_t fn = NULL;
+  pthread_once(&natives_once, natives_init);
+  pthread_mutex_lock(&natives_lock);
+  for(int i = 0; i < natives_count && !fn; i++) {
+    if (strcmp(natives[i].name, name) == 0)
+      fn = natives[i].fn;
+  }
+  pthread_mutex_unlock(&natives_lock);
+  return fn;
+}
+
 es_val_t es_define_fn(es_ctx_t* ctx, char* name, es_pfn_t fn, int arity)
 {
+  es_register_fn(name, fn);
   return es_define(ctx, name, es_make_fn(ctx, arity, fn));
 }
 
@@ -1352,6 +2707,7 @@ static es_val_t env_set(es_ctx_t* ctx, es_val_t env, int slot, es_val_t val)
   if (es_is_unbound(e->slots[slot].val)) {
     return es_make_error(ctx, "unbound symbol");
   }
+  gc_write_barrier(ctx, env, val);
   e->slots[slot].val = val;
   return es_void;
 }
@@ -1384,23 +2740,21 @@ static es_val_t env_ref(es_ctx_t* ctx, es_val_t env, int slot)
  */
 static es_val_t es_make_args(es_ctx_t* ctx, es_args_t* parent, int arity, int rest, int argc, es_val_t* argv)
 {
-  gc_root(ctx, parent);
-  es_args_t* env = es_alloc(ctx, ES_ARGS_TYPE, sizeof(es_args_t) + argc * sizeof(es_val_t));
+  es_val_t lst = es_nil;
+  gc_root2(ctx, parent, lst);
+  for(int j = argc - 1; rest && j >= arity; j--) {
+    lst = es_cons(ctx, argv[j], lst);
+  }
+  int size = arity + rest;
+  es_args_t* env = es_alloc(ctx, ES_ARGS_TYPE, sizeof(es_args_t) + size * sizeof(es_val_t));
   int i = 0;
   env->parent = parent;
-  env->size   = argc;
+  env->size   = size;
   for(; i < arity; i++)
-    env->args[i] = argv[i];
-  if (rest && argc > arity) {
-    es_val_t iter = env->args[i] = es_cons(ctx, argv[i], es_nil);
-    for(int j = i + 1; j < argc; j++) {
-      es_set_cdr(iter, es_cons(ctx, argv[j], es_nil));
-      iter = es_cdr(iter);
-    }
-  } else {
-    env->args[i] = es_nil;
-  }
-  gc_unroot(ctx, 1);
+    env->args[i] = i < argc ? argv[i] : es_undefined;
+  if (rest)
+    env->args[i] = lst;
+  gc_unroot(ctx, 2);
   return es_obj_to_val(env);
 }
 
@@ -1428,9 +2782,17 @@ es_val_t es_make_bytecode(es_ctx_t* ctx)
   b->cpool_size = ES_CONST_POOL_SIZE;
   b->next_const = 0;
   b->next_inst  = 0;
+  gc_finalizable(&ctx->heap, es_obj_to_val(b));
   return es_obj_to_val(b);
 }
 
+static void es_bytecode_finalize(es_val_t val)
+{
+  es_bytecode_t* bc = es_bytecode_val(val);
+  free(bc->inst);
+  bc->inst = NULL;
+}
+
 int es_is_bytecode(es_val_t val)
 {
   return ES_BYTECODE_TYPE == es_type_of(val);
@@ -1498,7 +2860,7 @@ static void emit(es_val_t code, es_inst_t inst)
   es_bytecode_t* b = es_bytecode_val(code);
   if (b->next_inst >= b->inst_size) {
     b->inst_size += b->inst_size / 2;
-    b->inst = realloc(b->inst, b->inst_size);
+    b->inst = realloc(b->inst, b->inst_size * sizeof(es_inst_t));
   }
 
   b->inst[b->next_inst++] = inst;
@@ -1519,6 +2881,11 @@ static void emit_halt(es_val_t code)
   emit(code, (es_inst_t){ opcode(HALT) });
 }
 
+static void emit_return(es_val_t code)
+{
+  emit(code, (es_inst_t){ opcode(RETURN) });
+}
+
 static void emit_global_ref(es_val_t code, int idx)
 {
   emit(code, (es_inst_t){ opcode(GLOBAL_REF), idx });
@@ -1574,7 +2941,22 @@ static void emit_closed_set(es_val_t code, int depth, int idx)
   emit(code, (es_inst_t){ opcode(CLOSED_SET), depth, idx });
 }
 
-static int alloc_const(es_val_t code, es_val_t v)
+static void emit_receive(es_val_t code, int tail, int idx, int lifted)
+{
+  emit(code, (es_inst_t){ tail ? opcode(TAIL_RECEIVE) : opcode(RECEIVE), idx, lifted });
+}
+
+static void emit_apply_values(es_val_t code)
+{
+  emit(code, (es_inst_t){ opcode(APPLY_VALUES) });
+}
+
+static void emit_iter_end(es_val_t code)
+{
+  emit(code, (es_inst_t){ opcode(ITER_END) });
+}
+
+static int alloc_const(es_ctx_t* ctx, es_val_t code, es_val_t v)
 {
   es_bytecode_t* b = es_bytecode_val(code);
   assert(b->next_const < b->cpool_size);
@@ -1582,6 +2964,7 @@ static int alloc_const(es_val_t code, es_val_t v)
     if (es_is_eq(v, b->consts[i]))
       return i;
   }
+  gc_write_barrier(ctx, code, v);
   b->consts[b->next_const] = v;
   return b->next_const++;
 }
@@ -1602,12 +2985,7 @@ es_val_t es_make_closure(es_ctx_t* ctx, es_val_t env, es_val_t proc)
   closure->proc = proc;
   closure->env  = (es_args_t*)env;
   gc_unroot(ctx, 2);
-  return es_obj_to_val(closure);
-}
-
-int es_is_closure(es_val_t value)
-{
-  return ES_CLOSURE_TYPE == es_type_of(value);
+  return es_obj_to_val(closure) | ES_CLOSURE_TAG;
 }
 
 es_closure_t* es_closure_val(es_val_t val)
@@ -1658,6 +3036,281 @@ static void es_macro_mark_copy(es_heap_t* heap, es_val_t val, char** next)
   es_mark_copy(heap, &macro->trans, next);
 }
 
+es_val_t es_make_weak_box(es_ctx_t* ctx, es_val_t val)
+{
+  es_weak_t* weak;
+  gc_root(ctx, val);
+  weak = es_alloc(ctx, ES_WEAK_TYPE, sizeof(es_weak_t));
+  weak->val = val;
+  gc_unroot(ctx, 1);
+  return es_obj_to_val(weak);
+}
+
+int es_is_weak_box(es_val_t val)
+{
+  return ES_WEAK_TYPE == es_type_of(val);
+}
+
+static es_weak_t* es_weak_val(es_val_t val)
+{
+  return es_obj_to(es_weak_t*, val);
+}
+
+/**
+ * @return The boxed value, or #f once it has been collected.
+ */
+es_val_t es_weak_box_value(es_val_t box)
+{
+  return es_weak_val(box)->val;
+}
+
+/* The referent is left to gc_process_weak once tracing is over */
+static void es_weak_mark_copy(es_heap_t* heap, es_val_t val, char** next)
+{
+  switch(heap->mode) {
+  case ES_GC_UPDATE:
+  case ES_GC_RELOCATE:
+    es_mark_copy(heap, &es_weak_val(val)->val, next);
+    break;
+  case ES_GC_SLICE:
+    heap->inc_dirty = 1; // Weak references are only resolved by the final pause
+    break;
+  case ES_GC_VISIT:      // Nothing is retained through a weak reference
+    break;
+  default:
+    gc_par_queue(heap, &heap->weak, val);
+    break;
+  }
+}
+
+es_val_t es_make_ephemeron(es_ctx_t* ctx, es_val_t key, es_val_t val)
+{
+  es_ephemeron_t* eph;
+  gc_root2(ctx, key, val);
+  eph = es_alloc(ctx, ES_EPHEMERON_TYPE, sizeof(es_ephemeron_t));
+  eph->key = key;
+  eph->val = val;
+  gc_unroot(ctx, 2);
+  return es_obj_to_val(eph);
+}
+
+int es_is_ephemeron(es_val_t val)
+{
+  return ES_EPHEMERON_TYPE == es_type_of(val);
+}
+
+static es_ephemeron_t* es_ephemeron_val(es_val_t val)
+{
+  return es_obj_to(es_ephemeron_t*, val);
+}
+
+static int ephemeron_is_broken(es_val_t eph)
+{
+  return es_ephemeron_val(eph)->key == es_unbound;
+}
+
+/**
+ * @return The key, or #f once the ephemeron is broken.
+ */
+es_val_t es_ephemeron_key(es_val_t eph)
+{
+  return ephemeron_is_broken(eph) ? es_false : es_ephemeron_val(eph)->key;
+}
+
+/**
+ * @return The value, or #f once the ephemeron is broken.
+ */
+es_val_t es_ephemeron_value(es_val_t eph)
+{
+  return ephemeron_is_broken(eph) ? es_false : es_ephemeron_val(eph)->val;
+}
+
+static void ephemeron_set_value(es_ctx_t* ctx, es_val_t eph, es_val_t val)
+{
+  gc_write_barrier(ctx, eph, val);
+  es_ephemeron_val(eph)->val = val;
+}
+
+/* The value is traced once something else has kept the key alive */
+static void es_ephemeron_mark_copy(es_heap_t* heap, es_val_t val, char** next)
+{
+  es_ephemeron_t* eph = es_ephemeron_val(val);
+  switch(heap->mode) {
+  case ES_GC_UPDATE:
+  case ES_GC_RELOCATE:
+    es_mark_copy(heap, &eph->key, next);
+    es_mark_copy(heap, &eph->val, next);
+    break;
+  case ES_GC_SLICE:
+    heap->inc_dirty = 1;
+    break;
+  case ES_GC_VISIT:
+    break;
+  default:
+    if (gc_is_live(heap, eph->key)) {
+      es_mark_copy(heap, &eph->key, next);
+      es_mark_copy(heap, &eph->val, next);
+    } else {
+      gc_par_queue(heap, &heap->ephemerons, val);
+    }
+    break;
+  }
+}
+
+/*
+ * Weak tables are a vector of [epoch, young, count, buckets]. Each bucket
+ * is a list of ephemerons. Keys hash by identity, so a table hashed before
+ * the last full collection may have moved keys and is rehashed on its next
+ * use. Minor collections only move young keys: young holds the minor epoch
+ * the table was hashed in while it has any, and #f otherwise, so tables of
+ * tenured keys are not rehashed after every minor collection.
+ */
+enum { WT_EPOCH, WT_YOUNG, WT_COUNT, WT_BUCKETS, WT_SIZE };
+
+static int weak_table_epoch(es_ctx_t* ctx)
+{
+  return (int)(ctx->heap.epoch & 0xfffffff);
+}
+
+static int weak_table_minor_epoch(es_ctx_t* ctx)
+{
+  return (int)(ctx->heap.minor_epoch & 0xfffffff);
+}
+
+static int weak_table_is_stale(es_ctx_t* ctx, es_val_t table)
+{
+  es_val_t young = es_vector_ref(table, WT_YOUNG);
+  return es_fixnum_val(es_vector_ref(table, WT_EPOCH)) != weak_table_epoch(ctx)
+    || (es_is_fixnum(young) && es_fixnum_val(young) != weak_table_minor_epoch(ctx));
+}
+
+static int weak_table_key_is_young(es_ctx_t* ctx, es_val_t key)
+{
+  return is_obj(key) && heap_in_young(&ctx->heap, key);
+}
+
+static int weak_table_hash(es_val_t key, int size)
+{
+  uintptr_t h = key >> ES_TAG_BITS;
+  h ^= h >> 4;
+  h ^= h >> 12;
+  return (int)(h % (uintptr_t)size);
+}
+
+es_val_t es_make_weak_table(es_ctx_t* ctx)
+{
+  es_val_t table = es_make_vector(ctx, WT_SIZE), buckets;
+  gc_root(ctx, table);
+  buckets = es_make_vector(ctx, ES_WEAK_TABLE_SIZE);
+  for(int i = 0; i < ES_WEAK_TABLE_SIZE; i++)
+    es_vector_set(ctx, buckets, i, es_nil);
+  es_vector_set(ctx, table, WT_EPOCH, es_make_fixnum(weak_table_epoch(ctx)));
+  es_vector_set(ctx, table, WT_YOUNG, es_false);
+  es_vector_set(ctx, table, WT_COUNT, es_make_fixnum(0));
+  es_vector_set(ctx, table, WT_BUCKETS, buckets);
+  gc_unroot(ctx, 1);
+  return table;
+}
+
+/**
+ * Relinks the table's entries by their current addresses, dropping broken
+ * ephemerons and growing the bucket vector when chains get long. Only the
+ * bucket vector is allocated, before the current addresses are read.
+ */
+static void weak_table_sync(es_ctx_t* ctx, es_val_t table)
+{
+  es_val_t old, buckets = es_nil;
+  int count = es_fixnum_val(es_vector_ref(table, WT_COUNT));
+  int size, young = 0;
+
+  if (!weak_table_is_stale(ctx, table))
+    return;
+
+  gc_root2(ctx, table, buckets);
+  size = es_vector_len(es_vector_ref(table, WT_BUCKETS));
+  if (count > 2 * size)
+    size *= 2;
+  buckets = es_make_vector(ctx, size);
+  old = es_vector_ref(table, WT_BUCKETS);
+
+  for(int i = 0; i < size; i++)
+    es_vector_set(ctx, buckets, i, es_nil);
+
+  count = 0;
+  for(int i = 0, len = es_vector_len(old); i < len; i++) {
+    es_val_t cell = es_vector_ref(old, i);
+    while(!es_is_nil(cell)) {
+      es_val_t next = es_cdr(cell);
+      if (!ephemeron_is_broken(es_car(cell))) {
+        es_val_t key = es_ephemeron_val(es_car(cell))->key;
+        int h = weak_table_hash(key, size);
+        es_set_cdr(ctx, cell, es_vector_ref(buckets, h));
+        es_vector_set(ctx, buckets, h, cell);
+        young |= weak_table_key_is_young(ctx, key);
+        count++;
+      }
+      cell = next;
+    }
+  }
+
+  es_vector_set(ctx, table, WT_EPOCH, es_make_fixnum(weak_table_epoch(ctx)));
+  es_vector_set(ctx, table, WT_YOUNG, young ? es_make_fixnum(weak_table_minor_epoch(ctx)) : es_false);
+  es_vector_set(ctx, table, WT_COUNT, es_make_fixnum(count));
+  es_vector_set(ctx, table, WT_BUCKETS, buckets);
+  gc_unroot(ctx, 2);
+}
+
+static es_val_t weak_table_find(es_val_t table, es_val_t key)
+{
+  es_val_t buckets = es_vector_ref(table, WT_BUCKETS);
+  es_val_t cell = es_vector_ref(buckets, weak_table_hash(key, es_vector_len(buckets)));
+  for(; !es_is_nil(cell); cell = es_cdr(cell)) {
+    if (es_ephemeron_val(es_car(cell))->key == key)
+      return es_car(cell);
+  }
+  return es_void;
+}
+
+es_val_t es_weak_table_ref(es_ctx_t* ctx, es_val_t table, es_val_t key, es_val_t fallback)
+{
+  gc_root3(ctx, table, key, fallback);
+  weak_table_sync(ctx, table);
+  gc_unroot(ctx, 3);
+  es_val_t eph = weak_table_find(table, key);
+  return es_is_void(eph) ? fallback : es_ephemeron_val(eph)->val;
+}
+
+void es_weak_table_set(es_ctx_t* ctx, es_val_t table, es_val_t key, es_val_t val)
+{
+  es_val_t cell = es_nil;
+  gc_root4(ctx, table, key, val, cell);
+  cell = es_make_ephemeron(ctx, key, val);
+  cell = es_cons(ctx, cell, es_nil);
+  weak_table_sync(ctx, table);
+
+  es_val_t eph = weak_table_find(table, key);
+  if (!es_is_void(eph)) {
+    ephemeron_set_value(ctx, eph, val);
+  } else {
+    es_val_t buckets = es_vector_ref(table, WT_BUCKETS);
+    int h = weak_table_hash(key, es_vector_len(buckets));
+    es_set_cdr(ctx, cell, es_vector_ref(buckets, h));
+    es_vector_set(ctx, buckets, h, cell);
+    es_vector_set(ctx, table, WT_COUNT, es_make_fixnum(es_fixnum_val(es_vector_ref(table, WT_COUNT)) + 1));
+    if (weak_table_key_is_young(ctx, key))
+      es_vector_set(ctx, table, WT_YOUNG, es_make_fixnum(weak_table_minor_epoch(ctx)));
+  }
+  gc_unroot(ctx, 4);
+}
+
+int es_weak_table_count(es_ctx_t* ctx, es_val_t table)
+{
+  gc_root(ctx, table);
+  weak_table_sync(ctx, table);
+  gc_unroot(ctx, 1);
+  return es_fixnum_val(es_vector_ref(table, WT_COUNT));
+}
+
 // PRINTER
 void es_print(es_ctx_t* ctx, es_val_t val, es_val_t oport)
 {
@@ -1682,6 +3335,9 @@ void es_print(es_ctx_t* ctx, es_val_t val, es_val_t oport)
   case ES_ENV_TYPE:      es_env_print(ctx, val, oport);                 break;
   case ES_CONT_TYPE:     es_port_printf(ctx, oport, "#<continuation>"); break;
   case ES_MACRO_TYPE:    es_port_printf(ctx, oport, "#<macro>");        break;
+  case ES_WEAK_TYPE:     es_port_printf(ctx, oport, "#<weak-box>");     break;
+  case ES_EPHEMERON_TYPE: es_port_printf(ctx, oport, "#<ephemeron>");   break;
+  case ES_ITERATOR_TYPE: es_port_printf(ctx, oport, "#<iterator>");     break;
   case ES_INVALID_TYPE:
   default:
     break;
@@ -1692,10 +3348,10 @@ void es_print(es_ctx_t* ctx, es_val_t val, es_val_t oport)
 size_t es_size_of(es_val_t val)
 {
   switch(es_type_of(val)) {
-  case ES_STRING_TYPE:       return es_string_size_of(val);
+  case ES_STRING_TYPE:       return es_is_small_string(val) ? sizeof(es_val_t) : es_string_size_of(val);
   case ES_PAIR_TYPE:         return sizeof(es_pair_t);
   case ES_CLOSURE_TYPE:      return sizeof(es_closure_t);
-  case ES_PORT_TYPE:         return sizeof(es_port_t);
+  case ES_PORT_TYPE:         return sizeof(es_port_obj_t);
   case ES_VECTOR_TYPE:       return es_vector_size_of(val);
   case ES_FN_TYPE:           return sizeof(es_fn_t);
   case ES_BYTECODE_TYPE:     return sizeof(es_bytecode_t);
@@ -1705,6 +3361,10 @@ size_t es_size_of(es_val_t val)
   case ES_ARGS_TYPE:         return es_args_size_of(val);
   case ES_MACRO_TYPE:        return sizeof(es_macro_t);
   case ES_BUFFER_TYPE:       return es_buffer_size_of(val);
+  case ES_CONT_TYPE:         return es_cont_size_of(val);
+  case ES_WEAK_TYPE:         return sizeof(es_weak_t);
+  case ES_EPHEMERON_TYPE:    return sizeof(es_ephemeron_t);
+  case ES_ITERATOR_TYPE:     return sizeof(es_iter_t);
   case ES_INVALID_TYPE:      return -1;
   case ES_NIL_TYPE:
   case ES_BOOL_TYPE:
@@ -1715,65 +3375,1895 @@ size_t es_size_of(es_val_t val)
   case ES_UNBOUND_TYPE:
   case ES_UNDEFINED_TYPE:
   case ES_VOID_TYPE:
-  case ES_CONT_TYPE:
     return sizeof(es_val_t);
   }
+  return -1;
+}
+
+static void es_obj_mark_copy(es_heap_t* heap, es_val_t obj, char** next)
+{
+  switch(es_type_of(obj)) {
+  case ES_PAIR_TYPE:      es_pair_mark_copy(heap, obj, next);     break;
+  case ES_CLOSURE_TYPE:   es_closure_mark_copy(heap, obj, next);  break;
+  case ES_VECTOR_TYPE:    es_vector_mark_copy(heap, obj, next);   break;
+  case ES_ENV_TYPE:       es_env_mark_copy(heap, obj, next);      break;
+  case ES_ARGS_TYPE:      es_args_mark_copy(heap, obj, next);     break;
+  case ES_BYTECODE_TYPE:  es_bytecode_mark_copy(heap, obj, next); break;
+  case ES_MACRO_TYPE:     es_macro_mark_copy(heap, obj, next);    break;
+  case ES_WEAK_TYPE:      es_weak_mark_copy(heap, obj, next);     break;
+  case ES_EPHEMERON_TYPE: es_ephemeron_mark_copy(heap, obj, next); break;
+  case ES_CONT_TYPE:      es_cont_mark_copy(heap, obj, next);     break;
+  case ES_ITERATOR_TYPE:  es_iter_mark_copy(heap, obj, next);     break;
+  default:                                                        break;
+  }
+}
+
+static void gc_mark_root(es_heap_t* heap, es_val_t* ref, char** next)
+{
+  es_val_t val = *ref;
+  es_mark_copy(heap, &val, next);
+  if (heap->mode != ES_GC_SLICE) {
+    *ref = val; // An incremental cycle leaves the mutator on the originals until it ends
+  }
+}
+
+enum { ES_CTX_ROOTS = 5 };
+
+static int gc_root_count(es_ctx_t* ctx)
+{
+  return ES_CTX_ROOTS + ctx->roots.top + (int)(ctx->sp - ctx->stack) + ctx->fp;
+}
+
+/**
+ * @return The i-th root slot: the context registers, then the root
+ *         stack, the value stack and the frame arguments.
+ */
+static es_val_t* gc_root_slot(es_ctx_t* ctx, int i)
+{
+  switch(i) {
+  case 0: return &ctx->env;
+  case 1: return &ctx->iport;
+  case 2: return &ctx->oport;
+  case 3: return &ctx->bytecode;
+  case 4: return &ctx->args;
+  }
+  i -= ES_CTX_ROOTS;
+  if (i < ctx->roots.top)
+    return ctx->roots.stack[i];
+  i -= ctx->roots.top;
+  if (i < ctx->sp - ctx->stack)
+    return &ctx->stack[i];
+  i -= ctx->sp - ctx->stack;
+  return &ctx->frames[i].args;
+}
+
+static void gc_mark_roots(es_ctx_t* ctx, char** next)
+{
+  for(int i = 0, n = gc_root_count(ctx); i < n; i++) {
+    gc_mark_root(&ctx->heap, gc_root_slot(ctx, i), next);
+  }
+}
+
+/* Cheney scan, interleaved with tracing the large objects marked on the way */
+static void gc_scan(es_heap_t* heap, char* scan, char** next)
+{
+  while(scan < *next || heap->mark_stack.count > 0) {
+    if (heap->mark_stack.count > 0) {
+      es_obj_mark_copy(heap, heap->mark_stack.items[--heap->mark_stack.count], next);
+      continue;
+    }
+    es_val_t obj = es_obj_to_val(scan);
+    es_obj_mark_copy(heap, obj, next);
+    scan = alignp(scan + es_size_of(obj), ES_DEFAULT_ALIGNMENT);
+  }
+}
+
+static void gc_flip(es_heap_t* heap, char* next)
+{
+  char* tmp;
+
+  gc_finalize(heap, 0);
+  size_t size      = heap->to_size;
+  tmp              = heap->buffer;
+  heap->buffer     = heap->to_buffer;
+  heap->to_buffer  = tmp;
+  heap->to_size    = heap->size;
+  heap->size       = size;
+  tmp              = heap->from_space;
+  heap->from_space = heap->to_space;
+  heap->end        = heap->from_space + heap->size - heap->nursery_size;
+  heap->to_space   = tmp;
+  heap->to_end     = heap->to_space + heap->to_size;
+  heap->next       = next;
+
+  heap->nursery_next = heap->nursery;
+  heap->remset.count = 0;
+  region_reset(heap);
+
+  large_sweep(heap);
+  heap_adjust(heap);
+
+  /* Give back memory now rather than holding a stale to space until the next collection */
+  if (heap->next_size < heap->to_size) {
+    heap_resize_to_space(heap, heap->next_size);
+  }
+}
+
+/**
+ * Minor collection: evacuates live nursery objects into the old space.
+ *
+ * Roots are the context roots plus the remembered set, so the cost is
+ * proportional to the survivors rather than the size of the old space.
+ * Falls back to a full collection when the old space could not absorb
+ * every nursery object.
+ */
+void es_gc_minor(es_ctx_t* ctx)
+{
+  es_heap_t* heap = &ctx->heap;
+  struct timeval t0;
+  char* scan, *next;
+
+  ptrdiff_t young = (heap->nursery_next - heap->nursery) + region_used(heap);
+
+  if (heap->end - (char*)alignp(heap->next, ES_DEFAULT_ALIGNMENT) < young) {
+    es_gc(ctx);
+    return;
+  }
+
+  gettimeofday(&t0, NULL);
+  heap->mode = ES_GC_MINOR;
+  scan = next = heap->next;
+
+  gc_mark_roots(ctx, &next);
+
+  for(int i = 0; i < heap->remset.count; i++) {
+    es_val_t obj = heap->remset.items[i];
+    obj_hdr_clear_flags(es_val_to_obj(obj), ES_OBJ_REMEMBERED);
+    es_obj_mark_copy(heap, obj, &next);
+  }
+  heap->remset.count = 0;
+
+  /* Replicas waiting for the end of an incremental cycle may point into the nursery too */
+  for(int i = 0; i < heap->inc_rescan.count; i++) {
+    es_obj_mark_copy(heap, heap->inc_rescan.items[i], &next);
+  }
+
+  gc_scan(heap, scan, &next);
+  gc_process_weak(heap, &next);
+
+  gc_finalize(heap, 1);
+  gc_record(heap, &t0, young, next - scan, 0);
+
+  heap->next         = next;
+  heap->nursery_next = heap->nursery;
+  heap->mode         = ES_GC_IDLE;
+  region_reset(heap);
+}
+
+static long gc_elapsed_us(struct timeval* t0)
+{
+  struct timeval t1, dt;
+  gettimeofday(&t1, NULL);
+  timeval_subtract(&dt, &t1, t0);
+  return dt.tv_sec * 1000000L + dt.tv_usec;
+}
+
+static size_t heap_used(es_heap_t* heap)
+{
+  return (heap->next - heap->from_space) + (heap->nursery_next - heap->nursery) + region_used(heap);
+}
+
+static void gc_record_pause(es_heap_t* heap, struct timeval* t0)
+{
+  es_gc_stats_t* stats = &heap->stats;
+  uint64_t pause = gc_elapsed_us(t0);
+  int bucket = 0;
+
+  while(bucket < ES_GC_PAUSE_BUCKETS - 1 && pause >= ((uint64_t)1 << bucket))
+    bucket++;
+
+  stats->pauses++;
+  stats->pause_histogram[bucket]++;
+  stats->total_pause_us += pause;
+  stats->last_pause_us   = pause;
+  if (pause > stats->max_pause_us)
+    stats->max_pause_us = pause;
+}
+
+/**
+ * Records a finished collection which started at t0.
+ *
+ * @param condemned Bytes in use in the collected spaces when it started
+ * @param survived  Bytes the collection moved into their new location
+ * @param full      Whether the whole heap was collected
+ */
+static void gc_record(es_heap_t* heap, struct timeval* t0, size_t condemned, size_t survived, int full)
+{
+  es_gc_stats_t* stats = &heap->stats;
+  struct timeval dt;
+  long mutator_us;
+
+  gc_record_pause(heap, t0);
+
+  stats->collections++;
+  heap->minor_epoch++;
+  if (full) {
+    heap->epoch++;
+    stats->full_collections++;
+    heap->last_live = heap->next - heap->from_space;
+  } else {
+    stats->minor_collections++;
+  }
+  stats->last_bytes_copied = survived;
+  stats->bytes_copied     += survived;
+  stats->survival_ratio    = condemned ? (double)survived / condemned : 0.0;
+
+  timeval_subtract(&dt, t0, &heap->last_gc);
+  mutator_us = dt.tv_sec * 1000000L + dt.tv_usec;
+  if (mutator_us > 0) {
+    stats->alloc_rate = (stats->bytes_allocated - heap->last_alloc) * 1000000.0 / mutator_us;
+  }
+  gettimeofday(&heap->last_gc, NULL);
+  heap->last_alloc = stats->bytes_allocated;
+}
+
+/**
+ * Starts an incremental cycle.
+ *
+ * The cycle replicates the old space into the to space while the mutator
+ * keeps running on the original objects, so no read barrier is needed.
+ * Objects allocated or promoted after this point are left to the final
+ * pause in gc_finish_cycle.
+ */
+static void gc_start_cycle(es_ctx_t* ctx)
+{
+  es_heap_t* heap = &ctx->heap;
+
+  heap_resize_to_space(heap, heap->next_size > heap->size ? heap->next_size : heap->size);
+
+  heap->inc_active       = 1;
+  heap->snapshot_end     = heap->next;
+  heap->inc_scan         = heap->to_space;
+  heap->inc_next         = heap->to_space;
+  heap->inc_log.count    = 0;
+  heap->inc_rescan.count = 0;
+
+  heap->mode = ES_GC_SLICE;
+  gc_mark_roots(ctx, &heap->inc_next);
+  heap->mode = ES_GC_IDLE;
+}
+
+/**
+ * Runs the Cheney scan of the incremental cycle until it is complete or
+ * budget_us microseconds have elapsed since t0.
+ *
+ * @return 1 once every replica has been scanned.
+ */
+static int gc_slice(es_heap_t* heap, struct timeval* t0, uint64_t budget_us)
+{
+  int n = 0;
+  heap->mode = ES_GC_SLICE;
+  while(heap->inc_scan < heap->inc_next) {
+    es_val_t obj = es_obj_to_val(heap->inc_scan);
+    heap->inc_dirty = 0;
+    es_obj_mark_copy(heap, obj, &heap->inc_next);
+    if (heap->inc_dirty) {
+      objlist_push(&heap->inc_rescan, obj);
+    }
+    heap->inc_scan = alignp(heap->inc_scan + es_size_of(obj), ES_DEFAULT_ALIGNMENT);
+    if ((++n & 63) == 0 && gc_elapsed_us(t0) >= budget_us)
+      break;
+  }
+  heap->mode = ES_GC_IDLE;
+  return heap->inc_scan >= heap->inc_next;
+}
+
+/**
+ * Final pause of an incremental cycle.
+ *
+ * Brings mutated replicas up to date, traces everything the cycle skipped
+ * (replicas pointing at new objects, the roots and the nursery) and flips.
+ */
+static void gc_finish_cycle(es_ctx_t* ctx)
+{
+  es_heap_t* heap = &ctx->heap;
+  char* next = heap->inc_next;
+
+  heap->mode = ES_GC_FULL;
+
+  for(int i = 0; i < heap->inc_log.count; i++) {
+    es_val_t  obj  = heap->inc_log.items[i];
+    es_obj_t* copy = obj_reloc(obj);
+    memcpy(copy, es_val_to_obj(obj), es_size_of(obj));
+    obj_hdr_reset(copy);
+    es_obj_mark_copy(heap, es_obj_to_val(copy), &next);
+  }
+  for(int i = 0; i < heap->inc_rescan.count; i++) {
+    es_obj_mark_copy(heap, heap->inc_rescan.items[i], &next);
+  }
+
+  gc_mark_roots(ctx, &next);
+  gc_scan(heap, heap->inc_scan, &next);
+  gc_process_weak(heap, &next);
+
+  heap->inc_active       = 0;
+  heap->inc_log.count    = 0;
+  heap->inc_rescan.count = 0;
+  heap->mode             = ES_GC_IDLE;
+
+  gc_flip(heap, next);
+}
+
+/**
+ * Performs one bounded unit of incremental work, called from es_alloc
+ * after a minor collection.
+ *
+ * The budget counts from t0, the start of the whole pause, so the slice
+ * only gets what the minor collection before it left, though at least
+ * half the budget so that the cycle keeps progressing. The final pause
+ * of the cycle is not bounded by the budget, as it traces the roots and
+ * everything promoted since the cycle started. When the last slice used
+ * up half the budget, it is left to a fresh pause.
+ */
+static void gc_step(es_ctx_t* ctx, struct timeval* t0)
+{
+  es_heap_t* heap = &ctx->heap;
+  es_gc_stats_t* stats = &heap->stats;
+  struct timeval start;
+  int scanned = heap->inc_active && heap->inc_scan >= heap->inc_next;
+  uint64_t spent = gc_elapsed_us(t0), budget = heap->max_pause_us, pause;
+
+  gettimeofday(&start, NULL);
+  budget = spent * 2 < budget ? budget - spent : budget / 2;
+
+  if (!heap->inc_active) {
+    size_t used   = heap->next - heap->from_space;
+    size_t usable = heap->end - heap->from_space;
+    if (used * 100 < usable * ES_GC_INC_START_PCT)
+      return;
+    gc_start_cycle(ctx);
+  }
+
+  if (gc_slice(heap, &start, budget) && (scanned || gc_elapsed_us(t0) * 2 < heap->max_pause_us)) {
+    size_t condemned = heap_used(heap);
+    gc_finish_cycle(ctx);
+    gc_record(heap, &start, condemned, heap->next - heap->from_space, 1);
+    pause = gc_elapsed_us(t0);
+    if (pause > stats->max_final_pause_us)
+      stats->max_final_pause_us = pause;
+  } else {
+    gc_record_pause(heap, &start);
+    pause = gc_elapsed_us(t0);
+    if (pause > stats->max_step_pause_us)
+      stats->max_step_pause_us = pause;
+  }
+}
+
+static void gc_mark(es_heap_t* heap, es_val_t obj)
+{
+  es_obj_t* o = es_val_to_obj(obj);
+  if (obj_hdr_flags(o) & ES_OBJ_MARKED)
+    return;
+  obj_hdr_set_flags(o, ES_OBJ_MARKED);
+  if (!(obj_hdr_flags(o) & ES_OBJ_LARGE))
+    heap->marked += align(es_size_of(obj), ES_DEFAULT_ALIGNMENT);
+  objlist_push(&heap->mark_stack, obj);
+}
+
+/**
+ * Assigns each marked object in [scan, end) the next address from dest.
+ *
+ * @return The address following the last forwarded object.
+ */
+static char* compact_forward(char* scan, char* end, char* dest)
+{
+  while(scan < end) {
+    es_val_t obj  = es_obj_to_val(scan);
+    size_t   size = es_size_of(obj);
+    if (obj_hdr_flags(es_val_to_obj(obj)) & ES_OBJ_MARKED) {
+      obj_hdr_set_reloc(es_val_to_obj(obj), dest);
+      dest += align(size, ES_DEFAULT_ALIGNMENT);
+    }
+    scan = alignp(scan + size, ES_DEFAULT_ALIGNMENT);
+  }
+  return dest;
+}
+
+static void compact_update(es_heap_t* heap, char* scan, char* end)
+{
+  while(scan < end) {
+    es_val_t obj = es_obj_to_val(scan);
+    if (obj_hdr_flags(es_val_to_obj(obj)) & ES_OBJ_MARKED) {
+      es_obj_mark_copy(heap, obj, NULL);
+    }
+    scan = alignp(scan + es_size_of(obj), ES_DEFAULT_ALIGNMENT);
+  }
+}
+
+/**
+ * Slides marked objects in [scan, end) to their forwarding addresses.
+ * Objects only ever move towards the start of the space, so each move
+ * can overwrite nothing but dead or already moved objects.
+ */
+static void compact_move(char* scan, char* end)
+{
+  while(scan < end) {
+    es_val_t obj  = es_obj_to_val(scan);
+    size_t   size = es_size_of(obj);
+    char*    next = alignp(scan + size, ES_DEFAULT_ALIGNMENT);
+    if (obj_hdr_flags(es_val_to_obj(obj)) & ES_OBJ_MARKED) {
+      es_obj_t* dest = obj_reloc(obj);
+      memmove(dest, scan, size);
+      obj_hdr_reset(dest);
+    }
+    scan = next;
+  }
+}
+
+/**
+ * Full collection of a compacting heap.
+ *
+ * Marks live objects in place, assigns them forwarding addresses in the
+ * reloc field, updates every reference and then slides the survivors to
+ * the start of the old space, followed by the nursery survivors. With no
+ * to space, the heap only needs room for its live data plus the nursery
+ * reserve. Resizing moves the survivors into a freshly allocated space.
+ */
+static void gc_compact(es_ctx_t* ctx)
+{
+  es_heap_t* heap = &ctx->heap;
+  char* buffer = NULL, *base, *next = NULL;
+  size_t size;
+
+  heap->mode   = ES_GC_MARK;
+  heap->marked = 0;
+  gc_mark_roots(ctx, NULL);
+  gc_scan(heap, next, &next);            // Nothing to scan, only drains the mark stack
+  gc_process_weak(heap, &next);
+
+  size = heap->next_size;
+  if (size < heap->marked + heap->nursery_size + ES_DEFAULT_ALIGNMENT) {
+    size = align(heap->marked + heap->nursery_size + ES_DEFAULT_ALIGNMENT, ES_DEFAULT_ALIGNMENT);
+  }
+  base = heap->from_space;
+  if (size != heap->size) {
+    buffer = malloc(size + ES_DEFAULT_ALIGNMENT);
+    base   = alignp(buffer, ES_DEFAULT_ALIGNMENT);
+  }
+
+  next = compact_forward(heap->from_space, heap->next, base);
+  next = compact_forward(heap->nursery, heap->nursery_next, next);
+  for(es_region_t* chunk = heap->region; chunk; chunk = chunk->prev) {
+    next = compact_forward(chunk->start, chunk->next, next);
+  }
+  gc_finalize(heap, 0);
+
+  heap->mode = ES_GC_UPDATE;
+  gc_mark_roots(ctx, NULL);
+  compact_update(heap, heap->from_space, heap->next);
+  compact_update(heap, heap->nursery, heap->nursery_next);
+  for(es_region_t* chunk = heap->region; chunk; chunk = chunk->prev) {
+    compact_update(heap, chunk->start, chunk->next);
+  }
+  for(es_large_t* large = heap->large; large; large = large->next) {
+    if (obj_hdr_flags(es_val_to_obj(large_obj(large))) & ES_OBJ_MARKED) {
+      es_obj_mark_copy(heap, large_obj(large), NULL);
+    }
+  }
+
+  compact_move(heap->from_space, heap->next);
+  compact_move(heap->nursery, heap->nursery_next);
+  for(es_region_t* chunk = heap->region; chunk; chunk = chunk->prev) {
+    compact_move(chunk->start, chunk->next);
+  }
+
+  if (buffer) {
+    heap_free_space(heap, heap->buffer);
+    heap->buffer     = buffer;
+    heap->from_space = base;
+    heap->size       = size;
+  }
+  heap->next         = next;
+  heap->end          = heap->from_space + heap->size - heap->nursery_size;
+  heap->nursery_next = heap->nursery;
+  heap->remset.count = 0;
+  heap->mode         = ES_GC_IDLE;
+  region_reset(heap);
+
+  large_sweep(heap);
+  heap_adjust(heap);
+}
+
+//=================
+// Parallel copying
+//=================
+
+/*
+ * A full copying collection can be shared by heap->gc_threads threads.
+ * Roots are claimed in chunks, each thread copies into its own buffer
+ * carved from the to space and keeps the copies it has yet to scan on a
+ * private grey stack. Part of it is published on a shared stack whenever
+ * that runs dry, for idle threads to steal from. Threads race to forward
+ * an object by installing the reloc address in its header with a compare
+ * and swap; the loser discards its copy.
+ *
+ * Gaps left at the end of a buffer or by a discarded copy are filled with
+ * a buffer object, so the to space can still be walked linearly.
+ */
+typedef struct es_gc_worker {
+  char*             next;   /**< Next free byte of the copy buffer, must come first */
+  char*             limit;  /**< End of the copy buffer */
+  es_objlist_t      grey;   /**< Copies whose fields have not been scanned, private */
+  es_objlist_t      shared; /**< Copies left for other threads to steal */
+  pthread_mutex_t   lock;   /**< Guards shared */
+  pthread_t         thread;
+  int               id;
+  struct es_gc_par* par;
+} es_gc_worker_t;
+
+typedef struct es_gc_par {
+  es_ctx_t*       ctx;
+  es_gc_worker_t* workers;
+  int             count;    /**< Threads taking part, updated atomically */
+  int             idle;     /**< Threads out of work, updated atomically */
+  int             root;     /**< Next root chunk to claim, updated atomically */
+  char*           top;      /**< Next unclaimed byte of the to space, updated atomically */
+  pthread_mutex_t lock;     /**< Guards the heap's weak reference queues */
+} es_gc_par_t;
+
+#define ES_GC_FILLER_MIN ((size_t)align(sizeof(es_buffer_t), ES_DEFAULT_ALIGNMENT))
+
+static void gc_par_fill(char* p, size_t size)
+{
+  es_buffer_t* filler = (es_buffer_t*)p;
+  filler->base.header = obj_header(ES_BUFFER_TYPE, 0);
+  filler->size        = size - sizeof(es_buffer_t);
+}
+
+static char* gc_par_claim(es_heap_t* heap, size_t size)
+{
+  char* p = __atomic_fetch_add(&heap->par->top, size, __ATOMIC_RELAXED);
+  assert(p + size <= heap->to_end);
+  return p;
+}
+
+static void gc_par_retire(es_gc_worker_t* w)
+{
+  if (w->next < w->limit)
+    gc_par_fill(w->next, w->limit - w->next);
+  w->next = w->limit = NULL;
+}
+
+/**
+ * Allocates a copy in the thread's buffer. What is left of the buffer is
+ * kept either empty or large enough to hold a filler.
+ */
+static char* gc_par_alloc(es_heap_t* heap, es_gc_worker_t* w, size_t size)
+{
+  if (size > ES_GC_LAB_SIZE / 8)
+    return gc_par_claim(heap, size);
+
+  size_t left = w->limit - w->next;
+  if (size != left && size + ES_GC_FILLER_MIN > left) {
+    gc_par_retire(w);
+    w->next  = gc_par_claim(heap, ES_GC_LAB_SIZE);
+    w->limit = w->next + ES_GC_LAB_SIZE;
+  }
+  char* p = w->next;
+  w->next += size;
+  return p;
+}
+
+static void gc_par_free(es_gc_worker_t* w, char* p, size_t size)
+{
+  if (p + size == w->next)
+    w->next = p;
+  else
+    gc_par_fill(p, size);
+}
+
+static int gc_par_has_work(es_gc_worker_t* w)
+{
+  return __atomic_load_n(&w->shared.count, __ATOMIC_RELAXED) > 0;
+}
+
+/* Moves n entries from the bottom of one grey stack to the top of another */
+static void gc_par_move(es_objlist_t* from, es_objlist_t* to, int n)
+{
+  for(int i = 0; i < n; i++) {
+    objlist_push(to, from->items[i]);
+  }
+  from->count -= n;
+  memmove(from->items, from->items + n, from->count * sizeof(es_val_t));
+}
+
+static void gc_par_push(es_gc_worker_t* w, es_val_t obj)
+{
+  objlist_push(&w->grey, obj);
+  if (w->grey.count >= ES_GC_PUBLISH_MIN && !gc_par_has_work(w)) {
+    pthread_mutex_lock(&w->lock);
+    gc_par_move(&w->grey, &w->shared, w->grey.count / 2);
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+static int gc_par_pop(es_gc_worker_t* w, es_val_t* obj)
+{
+  int found = 0;
+  if (w->grey.count > 0) {
+    *obj = w->grey.items[--w->grey.count];
+    return 1;
+  }
+  if (!gc_par_has_work(w))
+    return 0;
+  pthread_mutex_lock(&w->lock);
+  if (w->shared.count > 0) {
+    *obj  = w->shared.items[--w->shared.count];
+    found = 1;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return found;
+}
+
+/**
+ * Takes up to half of the oldest entries of another thread's shared stack.
+ *
+ * @return Whether anything was stolen.
+ */
+static int gc_par_steal(es_gc_worker_t* w)
+{
+  es_gc_par_t* par = w->par;
+  int count = __atomic_load_n(&par->count, __ATOMIC_ACQUIRE);
+
+  for(int i = 1; i < count; i++) {
+    es_gc_worker_t* victim = &par->workers[(w->id + i) % count];
+    if (!gc_par_has_work(victim))
+      continue;
+    pthread_mutex_lock(&victim->lock);
+    int n = (victim->shared.count + 1) / 2;
+    if (n > ES_GC_STEAL_MAX)
+      n = ES_GC_STEAL_MAX;
+    gc_par_move(&victim->shared, &w->grey, n);
+    pthread_mutex_unlock(&victim->lock);
+    if (n > 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* es_mark_copy for ES_GC_PARALLEL, next is the calling thread's worker */
+static void gc_par_copy(es_heap_t* heap, es_val_t* ref, char** next)
+{
+  es_gc_worker_t* w = (es_gc_worker_t*)next;
+  es_obj_t*       o = es_val_to_obj(*ref);
+
+  if (heap_in_to_space(heap, *ref))
+    return;
+
+  if (is_large(*ref)) {                          // Whoever marks it first scans it
+    uint64_t marked = (uint64_t)ES_OBJ_MARKED << ES_HDR_FLAGS_SHIFT;
+    if (!(__atomic_fetch_or(&o->header, marked, __ATOMIC_ACQ_REL) & marked))
+      gc_par_push(w, *ref);
+    return;
+  }
+
+  uint64_t header = __atomic_load_n(&o->header, __ATOMIC_ACQUIRE);
+  if (!(header & ES_HDR_RELOC_MASK)) {
+    size_t    size = align(es_size_of(*ref), ES_DEFAULT_ALIGNMENT);
+    es_obj_t* copy = (es_obj_t*)gc_par_alloc(heap, w, size);
+    int       won;
+    memcpy(copy, o, size);
+    obj_hdr_reset(copy);
+    do {
+      won = __atomic_compare_exchange_n(&o->header, &header, header | (uintptr_t)copy, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    } while(!won && !(header & ES_HDR_RELOC_MASK));
+    if (won) {
+      gc_par_push(w, es_obj_to_val(copy));
+      *ref = es_obj_retag(copy, *ref);
+      return;
+    }
+    gc_par_free(w, (char*)copy, size);        // Another thread forwarded it first
+  }
+  *ref = es_obj_retag((uintptr_t)(header & ES_HDR_RELOC_MASK), *ref);
+}
+
+static void gc_par_queue(es_heap_t* heap, es_objlist_t* list, es_val_t obj)
+{
+  if (heap->par) {
+    pthread_mutex_lock(&heap->par->lock);
+    objlist_push(list, obj);
+    pthread_mutex_unlock(&heap->par->lock);
+  } else {
+    objlist_push(list, obj);
+  }
+}
+
+static void gc_par_mark_roots(es_gc_worker_t* w)
+{
+  es_ctx_t* ctx   = w->par->ctx;
+  int       count = gc_root_count(ctx);
+  for(;;) {
+    int i = __atomic_fetch_add(&w->par->root, 1, __ATOMIC_RELAXED) * ES_GC_ROOT_CHUNK;
+    if (i >= count)
+      return;
+    for(int end = i + ES_GC_ROOT_CHUNK < count ? i + ES_GC_ROOT_CHUNK : count; i < end; i++) {
+      gc_mark_root(&ctx->heap, gc_root_slot(ctx, i), (char**)w);
+    }
+  }
+}
+
+/**
+ * Body of each copying thread. A thread is done once every thread is out
+ * of work: only running threads hold grey objects, so none can be left.
+ */
+static void* gc_par_work(void* arg)
+{
+  es_gc_worker_t* w    = arg;
+  es_gc_par_t*    par  = w->par;
+  es_heap_t*      heap = &par->ctx->heap;
+  es_val_t        obj;
+
+  gc_par_mark_roots(w);
+
+  for(;;) {
+    while(gc_par_pop(w, &obj)) {
+      es_obj_mark_copy(heap, obj, (char**)w);
+    }
+    if (gc_par_steal(w))
+      continue;
+
+    __atomic_add_fetch(&par->idle, 1, __ATOMIC_SEQ_CST);
+    for(;;) {
+      int count = __atomic_load_n(&par->count, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&par->idle, __ATOMIC_SEQ_CST) == count) {
+        gc_par_retire(w);
+        return NULL;
+      }
+      int busy = 0;
+      for(int i = 0; i < count && !busy; i++) {
+        busy = gc_par_has_work(&par->workers[i]);
+      }
+      if (busy) {
+        __atomic_sub_fetch(&par->idle, 1, __ATOMIC_SEQ_CST);
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+/**
+ * Copies everything reachable from the roots into the to space using
+ * heap->gc_threads threads, the calling one included.
+ *
+ * @return The to space copy pointer once every thread is done.
+ */
+static char* gc_par_copy_all(es_ctx_t* ctx)
+{
+  es_heap_t*     heap = &ctx->heap;
+  int            n    = heap->gc_threads;
+  es_gc_par_t    par;
+
+  par.ctx     = ctx;
+  par.workers = malloc(n * sizeof(es_gc_worker_t));
+  par.count   = n;
+  par.idle    = 0;
+  par.root    = 0;
+  par.top     = heap->to_space;
+  pthread_mutex_init(&par.lock, NULL);
+
+  for(int i = 0; i < n; i++) {
+    es_gc_worker_t* w = &par.workers[i];
+    w->next  = w->limit = NULL;
+    w->id    = i;
+    w->par   = &par;
+    objlist_init(&w->grey, ES_REMSET_SIZE);
+    objlist_init(&w->shared, ES_REMSET_SIZE);
+    pthread_mutex_init(&w->lock, NULL);
+  }
+
+  heap->par  = &par;
+  heap->mode = ES_GC_PARALLEL;
+
+  int started = 1;
+  for(; started < n; started++) {
+    if (pthread_create(&par.workers[started].thread, NULL, gc_par_work, &par.workers[started]) != 0)
+      break;
+  }
+  __atomic_store_n(&par.count, started, __ATOMIC_SEQ_CST); // Threads that failed to start never get work
+  gc_par_work(&par.workers[0]);
+  for(int i = 1; i < started; i++) {
+    pthread_join(par.workers[i].thread, NULL);
+  }
+
+  heap->mode = ES_GC_FULL;
+  heap->par  = NULL;
+
+  for(int i = 0; i < n; i++) {
+    free(par.workers[i].grey.items);
+    free(par.workers[i].shared.items);
+    pthread_mutex_destroy(&par.workers[i].lock);
+  }
+  pthread_mutex_destroy(&par.lock);
+  free(par.workers);
+  return par.top;
+}
+
+static void gc_copy(es_ctx_t* ctx)
+{
+  es_heap_t* heap = &ctx->heap;
+  char* scan, *next;
+
+  /* The to space must hold everything in use, whatever was decided before */
+  size_t used = heap_used(heap);
+  size_t size = heap->next_size > used ? heap->next_size : heap->size;
+  if (size < used)
+    size = align(used, ES_DEFAULT_ALIGNMENT); // A region can hold more than the old space
+
+  /* Parallel copies leave gaps in the to space, bounded by an eighth of the copies plus a buffer per thread */
+  int parallel = heap->gc_threads > 1 && used >= ES_GC_PAR_MIN_USED;
+  if (parallel) {
+    size_t slack = align(used + used / 4 + heap->gc_threads * ES_GC_LAB_SIZE, ES_DEFAULT_ALIGNMENT);
+    if (slack > heap_space_limit(heap))
+      parallel = 0;
+    else if (size < slack)
+      size = slack;
+  }
+  heap_resize_to_space(heap, size);
+
+  scan = next = heap->to_space;
+
+  heap->mode = ES_GC_FULL;
+  if (parallel) {
+    next = scan = gc_par_copy_all(ctx);       // Only weak references are left to the serial scan
+  } else {
+    gc_mark_roots(ctx, &next);
+    gc_scan(heap, scan, &next);
+  }
+  gc_process_weak(heap, &next);
+  heap->mode = ES_GC_IDLE;
+
+  gc_flip(heap, next);
+}
+
+void es_gc(es_ctx_t* ctx)
+{
+  es_heap_t* heap = &ctx->heap;
+  size_t condemned = heap_used(heap);
+  struct timeval t0;
+
+  gettimeofday(&t0, NULL);
+
+  if (heap->inc_active) {
+    gc_finish_cycle(ctx);
+  } else if (heap->compact) {
+    gc_compact(ctx);
+  } else {
+    gc_copy(ctx);
+  }
+
+  gc_record(heap, &t0, condemned, heap->next - heap->from_space, 1);
+}
+
+void es_gc_stats(es_ctx_t* ctx, es_gc_stats_t* stats)
+{
+  *stats = ctx->heap.stats;
+}
+
+//=================
+// Collection policy
+//=================
+
+/*
+ * Collections happen on their own when the nursery or the old space is
+ * exhausted. Embedders can do better than calling es_gc defensively:
+ * es_gc_maybe only collects when the expected reclaim pays for the copy,
+ * and es_gc_hint spends idle time on the collections that would otherwise
+ * land in the middle of the next request. Both decide from the
+ * telemetry the collector already keeps: survival, copy throughput and
+ * allocation rate.
+ */
+
+/* Estimated pause to copy bytes, from the throughput of the collections so far */
+static uint64_t gc_predict_us(es_heap_t* heap, size_t bytes)
+{
+  es_gc_stats_t* stats = &heap->stats;
+  double rate = stats->total_pause_us > 0 && stats->bytes_copied > 0
+    ? (double)stats->bytes_copied / stats->total_pause_us : ES_GC_COPY_RATE;
+  return (uint64_t)(bytes / rate);
+}
+
+/**
+ * @return Whether the old space grew enough since the last full
+ *         collection for one to reclaim a worthwhile share of it. Growth
+ *         is an upper bound on what a collection can reclaim, while its
+ *         cost is the live data it copies.
+ */
+static int gc_full_worthwhile(es_heap_t* heap)
+{
+  size_t used = heap->next - heap->from_space;
+  size_t grown = used > heap->last_live ? used - heap->last_live : 0;
+  return grown > 0 && grown * 100 >= heap->last_live * ES_GC_WORTHWHILE_PCT && grown >= heap->nursery_size;
+}
+
+/**
+ * @return Whether the allocation rate measured over the last collections
+ *         would fill the rest of the nursery within the hint horizon, so
+ *         a minor collection is coming soon anyway.
+ */
+static int gc_nursery_filling(es_heap_t* heap, size_t young)
+{
+  return young > 0 && (heap->nursery_size - young) < heap->stats.alloc_rate * ES_GC_HINT_HORIZON_US / 1000000.0;
+}
+
+/**
+ * Collects only if it is expected to pay off: a full collection when the
+ * old space grew by a good share since the last one, a minor collection
+ * when the nursery is more than half full, or partly full and filling
+ * fast enough at the current allocation rate that it would be exhausted
+ * soon, nothing otherwise.
+ *
+ * @return 1 if a collection was run.
+ */
+int es_gc_maybe(es_ctx_t* ctx)
+{
+  es_heap_t* heap  = &ctx->heap;
+  size_t     young = heap->nursery_next - heap->nursery;
+  if (heap->mode != ES_GC_IDLE || heap->no_gc)
+    return 0;
+  if (gc_full_worthwhile(heap)) {
+    es_gc(ctx);
+    return 1;
+  }
+  if (young * 2 >= heap->nursery_size ||
+      (young * 100 >= heap->nursery_size * ES_GC_RATE_MIN_PCT && gc_nursery_filling(heap, young))) {
+    es_gc_minor(ctx);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Tells the collector the embedder expects to be idle for about idle_us
+ * microseconds, between two requests for instance. The time goes to the
+ * pending incremental cycle if there is one, else to a full collection if
+ * it is worthwhile and predicted to fit, else to the nursery if the
+ * current allocation rate would fill it soon anyway.
+ *
+ * @return 1 if any collection work was done.
+ */
+int es_gc_hint(es_ctx_t* ctx, unsigned idle_us)
+{
+  es_heap_t* heap  = &ctx->heap;
+  size_t     young = heap->nursery_next - heap->nursery;
+
+  if (heap->mode != ES_GC_IDLE || heap->no_gc || idle_us == 0)
+    return 0;
+
+  if (heap->inc_active) {
+    unsigned budget = heap->max_pause_us;
+    struct timeval t0;
+    gettimeofday(&t0, NULL);
+    heap->max_pause_us = idle_us;
+    gc_step(ctx, &t0);
+    heap->max_pause_us = budget;
+    return 1;
+  }
+
+  if (gc_full_worthwhile(heap) && gc_predict_us(heap, heap_used(heap)) <= idle_us) {
+    es_gc(ctx);
+    return 1;
+  }
+
+  if (young > 0 && gc_predict_us(heap, young * heap->stats.survival_ratio) <= idle_us &&
+      (young * 2 >= heap->nursery_size || gc_nursery_filling(heap, young))) {
+    es_gc_minor(ctx);
+    return 1;
+  }
+  return 0;
+}
+
+//=================
+// Heap images
+//=================
+
+/*
+ * An image holds a fully collected context: a header, the symbol names,
+ * the large objects and the instructions of each bytecode object, then
+ * the old space at a page aligned offset. The old space is mapped
+ * privately rather than read, so only the pages touched while its
+ * references are rebased get loaded. Threaded opcodes are rebased by how
+ * far this binary was loaded from the one that wrote the image, which
+ * must be the same build. Natives are written as indices into a list of
+ * their registered names, and error strings as indices into a table of
+ * the image's own, so neither depends on where the code or data they
+ * came from was loaded.
+ */
+#define ES_IMAGE_MAGIC "EVAIMG02"
+#define ES_IMAGE_ALIGN 65536 /**< Old space offset in an image, a multiple of any page size */
+
+typedef struct es_image_header {
+  char     magic[8];
+  char     build[48];   /**< Version and build time of the binary which wrote it */
+  uint64_t text;        /**< Address of es_ctx_new in that binary */
+  uint64_t heap_base;   /**< Address of the old space when it was saved */
+  uint64_t heap_used;   /**< Bytes in use in the old space */
+  uint64_t heap_size;   /**< Size of the old space */
+  uint64_t heap_offset; /**< File offset of the old space */
+  uint64_t env;         /**< Global environment */
+  uint64_t bytecode;    /**< Bytecode of the context */
+  uint32_t epoch;       /**< Heap epoch to start from, newer than any weak table in the image */
+  uint32_t symbols;     /**< Symbol names following the header */
+  uint32_t next_gensym;
+  uint32_t natives;     /**< Native function names following the symbol names */
+  uint32_t strings;     /**< Error strings following the native names */
+  uint32_t large;       /**< Large objects following the error strings */
+  uint32_t blobs;       /**< Instruction arrays following the large objects, in heap order */
+} es_image_header_t;
+
+typedef struct es_image_seg {
+  uint64_t from;        /**< Saved address */
+  uint64_t size;
+  char*    to;          /**< Address it was loaded at */
+} es_image_seg_t;
+
+typedef struct es_image_map {
+  es_image_seg_t* segs;
+  int             count;
+  intptr_t        text;     /**< Distance between the code of this binary and the one that wrote the image */
+  es_pfn_t*       natives;  /**< Functions registered under the native names of the image, NULL if unknown */
+  uint32_t        nnatives;
+} es_image_map_t;
+
+static const char* image_build(void)
+{
+  return ES_VERSION_STR " " __DATE__ " " __TIME__;
+}
+
+static es_val_t image_rebase(es_image_map_t* map, es_val_t val)
+{
+  for(int i = 0; i < map->count; i++) {
+    if (val >= map->segs[i].from && val < map->segs[i].from + map->segs[i].size)
+      return (es_val_t)(map->segs[i].to + (val - map->segs[i].from));
+  }
+  return val;
+}
+
+/**
+ * @return Whether obj can be carried over to another process. Ports are
+ *         written without their state and continuations are refused.
+ */
+static int image_can_save(es_val_t obj)
+{
+  return obj_type_of(obj) != ES_CONT_TYPE;
+}
+
+static int image_write_space(FILE* file, char* scan, char* end, es_image_header_t* hdr)
+{
+  while(scan < end) {
+    es_val_t obj = es_obj_to_val(scan);
+    if (!image_can_save(obj))
+      return -1;
+    if (obj_type_of(obj) == ES_BYTECODE_TYPE) {
+      es_bytecode_t* bc   = es_bytecode_val(obj);
+      uint64_t       size = bc->inst_size;
+      fwrite(&size, sizeof(size), 1, file);
+      fwrite(bc->inst, sizeof(es_inst_t), bc->inst_size, file);
+      hdr->blobs++;
+    }
+    scan = alignp(scan + es_size_of(obj), ES_DEFAULT_ALIGNMENT);
+  }
+  return 0;
+}
+
+/**
+ * Collects the heap and writes it out as an image loadable with
+ * es_ctx_load_image. Only works between calls into the VM. The context's
+ * ports are not carried over.
+ *
+ * @return 0 on success, -1 if the heap cannot be saved or writing failed.
+ */
+int es_ctx_save_image(es_ctx_t* ctx, const char* path)
+{
+  es_heap_t*        heap = &ctx->heap;
+  es_image_header_t hdr;
+  es_symtab_t       strings;
+  es_port_t*        none = NULL;
+  FILE*             file;
+  long              pos;
+
+  if (ctx->fp > 0 || ctx->sp != ctx->stack)
+    return -1;
+
+  es_gc(ctx);
+
+  for(es_large_t* large = heap->large; large; large = large->next) {
+    if (!image_can_save(large_obj(large)))
+      return -1;
+  }
+
+  if (!(file = fopen(path, "wb")))
+    return -1;
+
+  /* Error strings get a table of their own, leaving the symbols of ctx untouched */
+  symtab_init(&strings);
+  for(char* scan = heap->from_space; scan < heap->next; ) {
+    es_val_t obj = es_obj_to_val(scan);
+    if (obj_type_of(obj) == ES_ERROR_TYPE)
+      symtab_add_string(&strings, es_error_val(obj)->errstr);
+    scan = alignp(scan + es_size_of(obj), ES_DEFAULT_ALIGNMENT);
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, ES_IMAGE_MAGIC, sizeof(hdr.magic));
+  strncpy(hdr.build, image_build(), sizeof(hdr.build) - 1);
+  hdr.text        = (uintptr_t)&es_ctx_new;
+  hdr.heap_base   = (uintptr_t)heap->from_space;
+  hdr.heap_used   = heap->next - heap->from_space;
+  hdr.heap_size   = heap->size;
+  hdr.env         = ctx->env;
+  hdr.bytecode    = ctx->bytecode;
+  hdr.epoch       = heap->epoch + 1;
+  hdr.symbols     = ctx->symtab.next_id;
+  hdr.next_gensym = ctx->symtab.next_gensym;
+  fwrite(&hdr, sizeof(hdr), 1, file);
+
+  for(int i = 0; i < ctx->symtab.next_id; i++) {
+    char* name = symtab_find_by_id(&ctx->symtab, i);
+    fwrite(name, strlen(name) + 1, 1, file);
+  }
+
+  pthread_once(&natives_once, natives_init);
+  pthread_mutex_lock(&natives_lock);
+  for(hdr.natives = 0; hdr.natives < (uint32_t)natives_count; hdr.natives++) {
+    fwrite(natives[hdr.natives].name, strlen(natives[hdr.natives].name) + 1, 1, file);
+  }
+  pthread_mutex_unlock(&natives_lock);
+
+  for(hdr.strings = 0; hdr.strings < (uint32_t)strings.next_id; hdr.strings++) {
+    char* str = symtab_find_by_id(&strings, hdr.strings);
+    fwrite(str, strlen(str) + 1, 1, file);
+  }
+
+  for(es_large_t* large = heap->large; large; large = large->next) {
+    uint64_t rec[2] = { large_obj(large), large->size };
+    fwrite(rec, sizeof(rec), 1, file);
+    fwrite((void*)large_obj(large), large->size, 1, file);
+    hdr.large++;
+  }
+
+  if (image_write_space(file, heap->from_space, heap->next, &hdr) < 0) {
+    symtab_free(&strings);
+    fclose(file);
+    remove(path);
+    return -1;
+  }
+
+  pos = ftell(file);
+  hdr.heap_offset = (pos + ES_IMAGE_ALIGN - 1) / ES_IMAGE_ALIGN * ES_IMAGE_ALIGN;
+  fseek(file, hdr.heap_offset, SEEK_SET);
+  fwrite(heap->from_space, hdr.heap_used, 1, file);
+
+  /* Port state belongs to this process, natives and error strings are
+     written as indices valid in any process */
+  for(char* scan = heap->from_space; scan < heap->next; ) {
+    es_val_t obj = es_obj_to_val(scan);
+    long     off = hdr.heap_offset + (scan - heap->from_space);
+    uint64_t index;
+    switch(obj_type_of(obj)) {
+    case ES_PORT_TYPE:
+      fseek(file, off + offsetof(es_port_obj_t, port), SEEK_SET);
+      fwrite(&none, sizeof(none), 1, file);
+      break;
+    case ES_FN_TYPE: {
+      int native = natives_index(es_fn_val(obj)->pfn);
+      if (native < 0 || native >= (int)hdr.natives) {
+        symtab_free(&strings);
+        fclose(file);
+        remove(path);
+        return -1;
+      }
+      index = native;
+      fseek(file, off + offsetof(es_fn_t, pfn), SEEK_SET);
+      fwrite(&index, sizeof(index), 1, file);
+      break;
+    }
+    case ES_ERROR_TYPE:
+      index = symtab_find_or_create(&strings, es_error_val(obj)->errstr);
+      fseek(file, off + offsetof(es_error_t, errstr), SEEK_SET);
+      fwrite(&index, sizeof(index), 1, file);
+      break;
+    default:
+      break;
+    }
+    scan = alignp(scan + es_size_of(obj), ES_DEFAULT_ALIGNMENT);
+  }
+  symtab_free(&strings);
+
+  /* Extend the file over the whole old space, the unused part stays a hole */
+  fseek(file, hdr.heap_offset + hdr.heap_size - 1, SEEK_SET);
+  fputc(0, file);
+
+  rewind(file);
+  fwrite(&hdr, sizeof(hdr), 1, file);
+  int failed = ferror(file);
+  if (fclose(file) != 0 || failed) {
+    remove(path);
+    return -1;
+  }
+  return 0;
+}
+
+/* Reads a nul terminated name of at most size - 1 characters */
+static int image_read_name(FILE* file, char* name, int size)
+{
+  int len = 0, c;
+  while((c = fgetc(file)) > 0 && len < size - 1)
+    name[len++] = (char)c;
+  name[len] = '\0';
+  return c == 0;
+}
+
+static es_port_t* port_dup(es_port_t* port)
+{
+  es_port_t* copy = malloc(sizeof(es_port_t));
+  *copy     = *port;
+  copy->buf = malloc(port->size);
+  memcpy(copy->buf, port->buf, port->size);
+  return copy;
+}
+
+/**
+ * Rebases references and native pointers of the objects in [scan, end).
+ * Instructions are read from file, or duplicated from the ones the
+ * objects still point to when cloning. Ports are given their own copy of
+ * the state they point to, if any. Error strings are moved into the
+ * string table of ctx, which must already hold those of the image.
+ */
+static int image_relocate(es_ctx_t* ctx, es_image_map_t* map, char* scan, char* end, FILE* file)
+{
+  es_heap_t* heap = &ctx->heap;
+  while(scan < end) {
+    es_val_t obj = es_obj_to_val(scan);
+    es_obj_mark_copy(heap, obj, (char**)map);
+    switch(obj_type_of(obj)) {
+    case ES_FN_TYPE:
+      if (file) {
+        uint64_t index = (uintptr_t)es_fn_val(obj)->pfn;
+        if (index >= map->nnatives || !map->natives[index])
+          return -1;
+        es_fn_val(obj)->pfn = map->natives[index];
+      }
+      break;
+    case ES_ERROR_TYPE:
+      if (file) {
+        uint64_t id = (uintptr_t)es_error_val(obj)->errstr;
+        if (id >= (uint64_t)ctx->strings.next_id)
+          return -1;
+        es_error_val(obj)->errstr = symtab_find_by_id(&ctx->strings, id);
+      } else {
+        // The string may belong to the context being cloned
+        es_error_val(obj)->errstr = symtab_intern(&ctx->strings, es_error_val(obj)->errstr);
+      }
+      break;
+    case ES_BYTECODE_TYPE: {
+      es_bytecode_t* bc = es_bytecode_val(obj);
+      uint64_t size;
+      if (!file) {
+        es_inst_t* inst = malloc(bc->inst_size * sizeof(es_inst_t));
+        bc->inst = memcpy(inst, bc->inst, bc->inst_size * sizeof(es_inst_t));
+        gc_finalizable(heap, obj);
+        break;
+      }
+      if (fread(&size, sizeof(size), 1, file) != 1)
+        return -1;
+      bc->inst      = malloc(size * sizeof(es_inst_t));
+      bc->inst_size = (int)size;
+      if (fread(bc->inst, sizeof(es_inst_t), size, file) != size)
+        return -1;
+#ifdef LABELS_AS_VALUES
+      for(int i = 0; i < bc->inst_size; i++) {
+        if (bc->inst[i].opcode)
+          bc->inst[i].opcode = (char*)bc->inst[i].opcode + map->text;
+      }
+#endif
+      gc_finalizable(heap, obj);
+      break;
+    }
+    case ES_PORT_TYPE:
+      if (es_obj_to(es_port_obj_t*, obj)->port) {
+        es_obj_to(es_port_obj_t*, obj)->port = port_dup(es_obj_to(es_port_obj_t*, obj)->port);
+        gc_finalizable(heap, obj);
+      }
+      break;
+    default:
+      break;
+    }
+    scan = alignp(scan + es_size_of(obj), ES_DEFAULT_ALIGNMENT);
+  }
+  return 0;
+}
+
+/**
+ * Makes space, holding used bytes of objects, the old space of a freshly
+ * initialized heap. The heap takes over buffer, which is unmapped rather
+ * than freed if mapped is set.
+ */
+static void heap_adopt(es_heap_t* heap, char* buffer, char* space, size_t size, size_t used, int mapped)
+{
+  heap_free_space(heap, heap->buffer);
+  heap->buffer      = buffer;
+  heap->mapped      = mapped ? buffer : NULL;
+  heap->mapped_size = mapped ? size : 0;
+  heap->from_space  = space;
+  heap->size        = size;
+  heap->next        = space + used;
+  heap->end         = space + size - heap->nursery_size;
+  if (heap->end < heap->next)
+    heap->end = heap->next; // The first minor collection grows the heap
+  if (heap->next_size < size)
+    heap->next_size = size;
+  heap->large_limit = heap->large_bytes + size;
+  if (!heap->compact)
+    heap_resize_to_space(heap, size);
+}
+
+/**
+ * Creates a context from an image written by es_ctx_save_image with the
+ * same build of the library. The input and output ports are left unset.
+ *
+ * @param config Heap settings, NULL for the defaults of es_ctx_new
+ * @return The context, or NULL if the image could not be loaded.
+ */
+es_ctx_t* es_ctx_load_image(const char* path, const es_heap_config_t* config)
+{
+  es_heap_config_t  defaults = { ES_DEFAULT_HEAP_SIZE, 0, ES_HEAP_GROWTH };
+  es_image_header_t hdr;
+  es_image_map_t    map;
+  es_ctx_t*         ctx;
+  es_heap_t*        heap;
+  char              name[1024];
+  char*             space;
+  int               fd, ok = 1;
+  FILE*             file = fopen(path, "rb");
+
+  if (!file)
+    return NULL;
+  if (fread(&hdr, sizeof(hdr), 1, file) != 1 ||
+      memcmp(hdr.magic, ES_IMAGE_MAGIC, sizeof(hdr.magic)) != 0 ||
+      strncmp(hdr.build, image_build(), sizeof(hdr.build)) != 0) {
+    fclose(file);
+    return NULL;
+  }
+
+  ctx  = malloc(sizeof(es_ctx_t));
+  heap = &ctx->heap;
+  ctx_init_vm(ctx, config ? config : &defaults);
+
+  for(uint32_t i = 0; i < hdr.symbols && ok; i++) {
+    ok = image_read_name(file, name, sizeof(name)) && symtab_add_string(&ctx->symtab, name) == (int)i;
+  }
+  ctx->symtab.next_gensym = hdr.next_gensym;
+
+  map.segs     = malloc((hdr.large + 1) * sizeof(es_image_seg_t));
+  map.count    = 0;
+  map.text     = (char*)&es_ctx_new - (char*)(uintptr_t)hdr.text;
+  map.natives  = malloc((hdr.natives + 1) * sizeof(es_pfn_t));
+  map.nnatives = hdr.natives;
+
+  for(uint32_t i = 0; i < hdr.natives && ok; i++) {
+    ok = image_read_name(file, name, sizeof(name));
+    map.natives[i] = ok ? natives_find(name) : NULL;
+  }
+
+  for(uint32_t i = 0; i < hdr.strings && ok; i++) {
+    ok = image_read_name(file, name, sizeof(name)) && symtab_add_string(&ctx->strings, name) == (int)i;
+  }
+
+  for(uint32_t i = 0; i < hdr.large && ok; i++) {
+    uint64_t rec[2];
+    char*    mem;
+    ok = fread(rec, sizeof(rec), 1, file) == 1 && (mem = large_alloc(heap, rec[1])) != NULL &&
+         fread(mem, rec[1], 1, file) == 1;
+    if (ok) {
+      map.segs[map.count].from = rec[0];
+      map.segs[map.count].size = rec[1];
+      map.segs[map.count].to   = mem;
+      map.count++;
+    }
+  }
+
+  space = MAP_FAILED;
+  if (ok && (fd = open(path, O_RDONLY)) >= 0) {
+    space = mmap(NULL, hdr.heap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, hdr.heap_offset);
+    close(fd);
+  }
+  if (space == MAP_FAILED) {
+    ok = 0;
+  } else {
+    map.segs[map.count].from = hdr.heap_base;
+    map.segs[map.count].size = hdr.heap_used;
+    map.segs[map.count].to   = space;
+    map.count++;
+
+    heap_adopt(heap, space, space, hdr.heap_size, hdr.heap_used, 1);
+    heap->epoch = hdr.epoch;
+
+    heap->mode = ES_GC_RELOCATE;
+    ok = image_relocate(ctx, &map, heap->from_space, heap->next, file) == 0;
+    for(es_large_t* large = heap->large; large && ok; large = large->next) {
+      char* obj = (char*)large_obj(large);
+      ok = image_relocate(ctx, &map, obj, obj + large->size, file) == 0;
+    }
+    heap->mode = ES_GC_IDLE;
+
+    ctx->env      = image_rebase(&map, hdr.env);
+    ctx->bytecode = image_rebase(&map, hdr.bytecode);
+  }
+
+  free(map.segs);
+  free(map.natives);
+  fclose(file);
+  if (!ok) {
+    es_ctx_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+/**
+ * Copies a context, for instance one warmed up once and cloned for each
+ * request. The old space and large objects are copied and their
+ * references rebased; ports and bytecode get their own copies of the
+ * native state. Only works between calls into the VM. The nursery of the
+ * original is evacuated first.
+ *
+ * @return The copy, or NULL if ctx is running.
+ */
+es_ctx_t* es_ctx_clone(es_ctx_t* ctx)
+{
+  es_heap_t*       from   = &ctx->heap;
+  int              spaces = from->compact ? 1 : 2;
+  es_heap_config_t config = {
+    from->requested, from->max_size * spaces, from->growth, from->max_pause_us, from->compact, from->gc_threads,
+    from->max_memory, ctx->max_depth
+  };
+  es_image_map_t   map;
+  es_ctx_t*        copy;
+  es_heap_t*       heap;
+  char*            buffer, *space;
+  size_t           used;
+  int              count = 1;
+
+  if (ctx->fp > 0 || ctx->sp != ctx->stack)
+    return NULL;
+
+  if (from->inc_active)
+    es_gc(ctx);
+  es_gc_minor(ctx);
+
+  copy = malloc(sizeof(es_ctx_t));
+  heap = &copy->heap;
+  ctx_init_vm(copy, &config);
+
+  for(es_large_t* large = from->large; large; large = large->next) {
+    count++;
+  }
+  map.segs     = malloc(count * sizeof(es_image_seg_t));
+  map.count    = 0;
+  map.text     = 0;
+  map.natives  = NULL;
+  map.nnatives = 0;
+
+  for(es_large_t* large = from->large; large; large = large->next) {
+    char* mem = large_alloc(heap, large->size);
+    memcpy(mem, (void*)large_obj(large), large->size);
+    map.segs[map.count].from = large_obj(large);
+    map.segs[map.count].size = large->size;
+    map.segs[map.count].to   = mem;
+    map.count++;
+  }
+
+  used   = from->next - from->from_space;
+  buffer = malloc(from->size + ES_DEFAULT_ALIGNMENT);
+  space  = alignp(buffer, ES_DEFAULT_ALIGNMENT);
+  memcpy(space, from->from_space, used);
+  map.segs[map.count].from = (uintptr_t)from->from_space;
+  map.segs[map.count].size = used;
+  map.segs[map.count].to   = space;
+  map.count++;
+
+  heap_adopt(heap, buffer, space, from->size, used, 0);
+  heap->epoch = from->epoch + 1;
+
+  for(int i = 0; i < ctx->symtab.next_id; i++) {
+    symtab_add_string(&copy->symtab, symtab_find_by_id(&ctx->symtab, i));
+  }
+  copy->symtab.next_gensym = ctx->symtab.next_gensym;
+
+  heap->mode = ES_GC_RELOCATE;
+  image_relocate(copy, &map, space, space + used, NULL);
+  for(es_large_t* large = heap->large; large; large = large->next) {
+    char* obj = (char*)large_obj(large);
+    image_relocate(copy, &map, obj, obj + large->size, NULL);
+  }
+  heap->mode = ES_GC_IDLE;
+
+  copy->env      = image_rebase(&map, ctx->env);
+  copy->bytecode = image_rebase(&map, ctx->bytecode);
+  copy->iport    = image_rebase(&map, ctx->iport);
+  copy->oport    = image_rebase(&map, ctx->oport);
+  copy->args     = image_rebase(&map, ctx->args);
+
+  free(map.segs);
+  return copy;
+}
+
+// Allocation profiler
+static const char* type_names[ES_TYPE_COUNT] = {
+  "nil", "bool", "fixnum", "symbol", "char", "string", "pair", "eof",
+  "closure", "unbound", "undefined", "void", "port", "vector", "fn", "env",
+  "args", "proc", "bytecode", "cont", "macro", "buffer", "error", "weak",
+  "ephemeron", "iterator"
+};
+
+static void profile_init(es_profile_t* profile)
+{
+  profile->interval   = 0;
+  profile->countdown  = 0;
+  profile->procs_size = 64;
+  profile->procs      = calloc(profile->procs_size, sizeof(es_proc_range_t));
+  profile->nprocs     = 1;
+  profile->procs[0].addr = 0;
+  profile->procs[0].end  = 0;
+  profile->procs[0].name = es_void;
+  profile->sites_size = 64;
+  profile->sites      = malloc(profile->sites_size * sizeof(es_call_site_t));
+  profile->nsites     = 0;
+}
+
+static void profile_free(es_profile_t* profile)
+{
+  free(profile->procs);
+  free(profile->sites);
+}
+
+/**
+ * Registers the bytecode range of a lambda compiled while sampling is
+ * enabled, so samples can be attributed to it. Code compiled before is
+ * found in the bytecode when sampling starts.
+ */
+static void profile_add_proc(es_ctx_t* ctx, int addr, int end)
+{
+  es_profile_t* profile = &ctx->profile;
+  if (!profile->interval)
+    return;
+  if (profile->nprocs >= profile->procs_size) {
+    profile->procs_size *= 2;
+    profile->procs = realloc(profile->procs, profile->procs_size * sizeof(es_proc_range_t));
+  }
+  es_proc_range_t* range = &profile->procs[profile->nprocs++];
+  memset(range, 0, sizeof(es_proc_range_t));
+  range->addr = addr;
+  range->end  = end;
+  range->name = es_void;
+}
+
+static void profile_add_site(es_profile_t* profile, int addr, size_t n)
+{
+  for(int i = 0; i < profile->nsites; i++) {
+    if (profile->sites[i].addr == addr) {
+      profile->sites[i].samples += n;
+      return;
+    }
+  }
+  if (profile->nsites >= profile->sites_size) {
+    profile->sites_size *= 2;
+    profile->sites = realloc(profile->sites, profile->sites_size * sizeof(es_call_site_t));
+  }
+  profile->sites[profile->nsites].addr    = addr;
+  profile->sites[profile->nsites].samples = n;
+  profile->nsites++;
+}
+
+/* Innermost registered lambda containing addr, 0 for top level code */
+static int profile_find_proc(es_profile_t* profile, int addr)
+{
+  int best = 0;
+  for(int i = 1; i < profile->nprocs; i++) {
+    es_proc_range_t* range = &profile->procs[i];
+    if (addr >= range->addr && addr < range->end &&
+        (best == 0 || range->end - range->addr < profile->procs[best].end - profile->procs[best].addr)) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+/**
+ * Takes a sample for an allocation which used up the countdown. Each
+ * sample stands for interval bytes, so a large object may count several
+ * times. Argument frames are allocated by the closure call instructions
+ * just after the instruction pointer moves past them, which gives the
+ * call site.
+ */
+static void profile_sample(es_ctx_t* ctx, es_type_t type)
+{
+  es_profile_t*  profile = &ctx->profile;
+  es_bytecode_t* bc      = es_is_bytecode(ctx->bytecode) ? es_bytecode_val(ctx->bytecode) : NULL;
+  size_t n = 0;
+  int addr = -1;
+
+  while(profile->countdown <= 0) {
+    profile->countdown += profile->interval;
+    n++;
+  }
+
+  if (bc && ctx->ip >= bc->inst && ctx->ip < bc->inst + bc->next_inst) {
+    addr = ctx->ip - bc->inst;
+  }
+  profile->procs[addr < 0 ? 0 : profile_find_proc(profile, addr)].samples[type] += n;
+  if (type == ES_ARGS_TYPE && addr > 0) {
+    profile_add_site(profile, addr - 1, n);
+  }
+}
+
+/**
+ * Registers the range of every lambda compiled so far, from the CLOSURE
+ * instructions of the bytecode. Lambdas bound by define are followed by
+ * the GLOBAL_SET which names them.
+ */
+static void profile_scan_procs(es_ctx_t* ctx)
+{
+  es_bytecode_t* bc;
+  if (!es_is_bytecode(ctx->bytecode))
+    return;
+  bc = es_bytecode_val(ctx->bytecode);
+  for(int i = 0; i < bc->next_inst; i++) {
+    if (bc->inst[i].opcode != opcode(CLOSURE))
+      continue;
+    es_proc_t* proc = es_proc_val(bc->consts[bc->inst[i].operand1]);
+    profile_add_proc(ctx, proc->addr, proc->end);
+    if (i + 1 < bc->next_inst && bc->inst[i + 1].opcode == opcode(GLOBAL_SET))
+      ctx->profile.procs[ctx->profile.nprocs - 1].name = es_env_val(ctx->env)->slots[bc->inst[i + 1].operand1].sym;
+  }
+}
+
+void es_alloc_profile_start(es_ctx_t* ctx, size_t sample_bytes)
+{
+  es_profile_t* profile = &ctx->profile;
+  memset(profile->procs[0].samples, 0, sizeof(profile->procs[0].samples));
+  profile->nprocs    = 1;
+  profile->nsites    = 0;
+  profile->interval  = sample_bytes;
+  profile->countdown = sample_bytes;
+  if (sample_bytes)
+    profile_scan_procs(ctx);
+}
+
+void es_alloc_profile_stop(es_ctx_t* ctx)
+{
+  ctx->profile.interval = 0;
+}
+
+typedef struct es_profile_row {
+  int    index;
+  size_t samples;
+} es_profile_row_t;
+
+static int profile_row_cmp(const void* a, const void* b)
+{
+  size_t x = ((const es_profile_row_t*)a)->samples;
+  size_t y = ((const es_profile_row_t*)b)->samples;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void profile_print_proc(es_ctx_t* ctx, es_val_t port, int index)
+{
+  es_proc_range_t* range = &ctx->profile.procs[index];
+  if (index == 0)
+    es_port_printf(ctx, port, "<top-level>");
+  else if (es_is_symbol(range->name))
+    es_port_printf(ctx, port, "%@", range->name);
+  else
+    es_port_printf(ctx, port, "#<lambda@%d>", range->addr);
+}
+
+/**
+ * Prints the samples taken since es_alloc_profile_start, per procedure
+ * broken down by type, then per call site for argument frames. Both
+ * tables are sorted by sample count.
+ */
+void es_alloc_profile_dump(es_ctx_t* ctx, es_val_t port)
+{
+  es_profile_t* profile = &ctx->profile;
+  es_profile_row_t* rows = malloc((profile->nprocs + profile->nsites) * sizeof(es_profile_row_t));
+  int n = 0;
+
+  for(int i = 0; i < profile->nprocs; i++) {
+    size_t total = 0;
+    for(int t = 0; t < ES_TYPE_COUNT; t++)
+      total += profile->procs[i].samples[t];
+    if (total) {
+      rows[n].index   = i;
+      rows[n].samples = total;
+      n++;
+    }
+  }
+  qsort(rows, n, sizeof(es_profile_row_t), profile_row_cmp);
+
+  es_port_printf(ctx, port, "allocation samples, one per %zu bytes\n", profile->interval);
+  for(int i = 0; i < n; i++) {
+    es_proc_range_t* range = &profile->procs[rows[i].index];
+    es_port_printf(ctx, port, "%10zu  ", rows[i].samples);
+    profile_print_proc(ctx, port, rows[i].index);
+    for(int t = 0; t < ES_TYPE_COUNT; t++) {
+      if (range->samples[t])
+        es_port_printf(ctx, port, " %s:%zu", type_names[t], range->samples[t]);
+    }
+    es_port_printf(ctx, port, "\n");
+  }
+
+  n = 0;
+  for(int i = 0; i < profile->nsites; i++) {
+    rows[n].index   = i;
+    rows[n].samples = profile->sites[i].samples;
+    n++;
+  }
+  qsort(rows, n, sizeof(es_profile_row_t), profile_row_cmp);
+
+  es_port_printf(ctx, port, "argument frame samples by call site\n");
+  for(int i = 0; i < n; i++) {
+    es_call_site_t* site = &profile->sites[rows[i].index];
+    es_port_printf(ctx, port, "%10zu  %d in ", rows[i].samples, site->addr);
+    profile_print_proc(ctx, port, profile_find_proc(profile, site->addr));
+    es_port_printf(ctx, port, "\n");
+  }
+
+  free(rows);
+}
+
+//=================
+// Heap census
+//=================
+
+typedef void (*es_heap_visit_t)(es_heap_t* heap, es_val_t obj, void* data);
+
+/* Calls visit on every object of the old space, nursery, region and large object space */
+static void heap_walk(es_heap_t* heap, es_heap_visit_t visit, void* data)
+{
+  char* spaces[][2] = {
+    { heap->from_space, heap->next }, { heap->nursery, heap->nursery_next }
+  };
+  for(int i = 0; i < 2; i++) {
+    for(char* scan = spaces[i][0]; scan < spaces[i][1]; ) {
+      es_val_t obj = es_obj_to_val(scan);
+      visit(heap, obj, data);
+      scan = alignp(scan + es_size_of(obj), ES_DEFAULT_ALIGNMENT);
+    }
+  }
+  for(es_region_t* chunk = heap->region; chunk; chunk = chunk->prev) {
+    for(char* scan = chunk->start; scan < chunk->next; ) {
+      es_val_t obj = es_obj_to_val(scan);
+      visit(heap, obj, data);
+      scan = alignp(scan + es_size_of(obj), ES_DEFAULT_ALIGNMENT);
+    }
+  }
+  for(es_large_t* large = heap->large; large; large = large->next) {
+    visit(heap, large_obj(large), data);
+  }
+}
+
+typedef struct es_census {
+  size_t count[ES_TYPE_COUNT];
+  size_t bytes[ES_TYPE_COUNT];
+} es_census_t;
+
+static void census_visit(es_heap_t* heap, es_val_t obj, void* data)
+{
+  es_census_t* census = data;
+  es_type_t    type   = obj_type_of(obj);
+  census->count[type]++;
+  census->bytes[type] += align(es_size_of(obj), ES_DEFAULT_ALIGNMENT);
+}
+
+/**
+ * Collects, then prints how many live objects of each type the heap holds
+ * and how many bytes they take, largest first.
+ */
+void es_heap_census(es_ctx_t* ctx, es_val_t port)
+{
+  es_census_t      census = { { 0 }, { 0 } };
+  es_profile_row_t rows[ES_TYPE_COUNT];
+  size_t           count = 0, bytes = 0;
+  int              n = 0;
+
+  gc_root(ctx, port);
+  es_gc(ctx);
+  gc_unroot(ctx, 1);
+  heap_walk(&ctx->heap, census_visit, &census);
+
+  for(int t = 0; t < ES_TYPE_COUNT; t++) {
+    if (census.count[t]) {
+      rows[n].index   = t;
+      rows[n].samples = census.bytes[t];
+      n++;
+    }
+    count += census.count[t];
+    bytes += census.bytes[t];
+  }
+  qsort(rows, n, sizeof(es_profile_row_t), profile_row_cmp);
+
+  es_port_printf(ctx, port, "live objects by type\n");
+  for(int i = 0; i < n; i++) {
+    int t = rows[i].index;
+    es_port_printf(ctx, port, "%10zu bytes %10zu objects  %s\n", census.bytes[t], census.count[t], type_names[t]);
+  }
+  es_port_printf(ctx, port, "%10zu bytes %10zu objects  total\n", bytes, count);
 }
 
-void es_gc(es_ctx_t* ctx)
-{
-/* TODO: Ensure scan and next pointers respect alignment */
-  //printf("running gc\n");
-  //struct timeval t0, t1, dt;
-  char* scan, *next, *tmp;
+/*
+ * A heap dump is a text file describing the object graph for offline
+ * retainer analysis. After a header line, each root slot holding an object
+ * gets a line, followed by one line per live object listing its address,
+ * type, size in bytes and the addresses it references:
+ *
+ *   eva-heap-dump 1
+ *   root <env|iport|oport|bytecode|args|root|stack|frame> <address>
+ *   obj <address> <type> <bytes> [<address>...]
+ *
+ * Weak references retain nothing and are left out.
+ */
+typedef struct es_heap_dump {
+  FILE* file;
+} es_heap_dump_t;
 
-  //gettimeofday(&t0, NULL);
+static void heap_dump_edge(es_heap_dump_t* dump, es_val_t val)
+{
+  fprintf(dump->file, " %#lx", (unsigned long)(uintptr_t)es_val_to_obj(val));
+}
 
-  es_heap_t* heap = &ctx->heap;
-  scan = next = heap->to_space;
+static void heap_dump_visit(es_heap_t* heap, es_val_t obj, void* data)
+{
+  es_heap_dump_t* dump = data;
+  fprintf(dump->file, "obj %#lx %s %zu", (unsigned long)(uintptr_t)es_val_to_obj(obj), type_names[obj_type_of(obj)], es_size_of(obj));
+  es_obj_mark_copy(heap, obj, (char**)dump);
+  fputc('\n', dump->file);
+}
 
-  es_mark_copy(heap, &ctx->env, &next);
-  es_mark_copy(heap, &ctx->iport, &next);
-  es_mark_copy(heap, &ctx->oport, &next);
-  es_mark_copy(heap, &ctx->bytecode, &next);
+/**
+ * Collects, then writes the graph of live objects to path.
+ *
+ * @return 0 on success, -1 if the file could not be written.
+ */
+int es_heap_dump(es_ctx_t* ctx, const char* path)
+{
+  static const char* root_names[ES_CTX_ROOTS] = { "env", "iport", "oport", "bytecode", "args" };
+  es_heap_t*     heap = &ctx->heap;
+  es_heap_dump_t dump;
+  int            ok;
 
-  for(int i = 0; i < ctx->roots.top; i++) {
-    es_mark_copy(heap, ctx->roots.stack[i], &next);
-  }
+  if (!(dump.file = fopen(path, "w")))
+    return -1;
 
-  es_mark_copy(heap, &ctx->env, &next);
-  for(int i = 0; i < ctx->sp - ctx->stack; i++) {
-    es_mark_copy(heap, &ctx->stack[i], &next);
-  }
-  for(int i = 1; i < ctx->fp; i++) {
-    es_mark_copy(heap, &ctx->frames[i].args, &next);
-  }
+  es_gc(ctx);
 
-  while(scan < next) {
-    es_val_t obj = es_obj_to_val(scan);
-    switch(es_type_of(obj)) {
-    case ES_PAIR_TYPE:      es_pair_mark_copy(heap, obj, &next);     break;
-    case ES_CLOSURE_TYPE:   es_closure_mark_copy(heap, obj, &next);  break;
-    case ES_VECTOR_TYPE:    es_vector_mark_copy(heap, obj, &next);   break;
-    case ES_ENV_TYPE:       es_env_mark_copy(heap, obj, &next);      break;
-    case ES_ARGS_TYPE:      es_args_mark_copy(heap, obj, &next);     break;
-    case ES_BYTECODE_TYPE:  es_bytecode_mark_copy(heap, obj, &next); break;
-    case ES_MACRO_TYPE:     es_macro_mark_copy(heap, obj, &next);    break;
-    default:                                                         break;
-    }
-    scan = alignp(scan + es_size_of(obj), ES_DEFAULT_ALIGNMENT);
+  fprintf(dump.file, "eva-heap-dump 1\n");
+  for(int i = 0, n = gc_root_count(ctx); i < n; i++) {
+    es_val_t    val  = *gc_root_slot(ctx, i);
+    const char* name = i < ES_CTX_ROOTS ? root_names[i]
+                     : i < ES_CTX_ROOTS + ctx->roots.top ? "root"
+                     : i < ES_CTX_ROOTS + ctx->roots.top + (ctx->sp - ctx->stack) ? "stack" : "frame";
+    if (is_obj(val))
+      fprintf(dump.file, "root %s %#lx\n", name, (unsigned long)(uintptr_t)es_val_to_obj(val));
   }
 
-  tmp              = heap->from_space;
-  heap->from_space = heap->to_space;
-  heap->end        = heap->from_space + heap->size;
-  heap->to_space   = tmp;
-  heap->to_end     = heap->to_space + heap->size;
-  heap->next       = next;
+  heap->mode = ES_GC_VISIT;
+  heap_walk(heap, heap_dump_visit, &dump);
+  heap->mode = ES_GC_IDLE;
 
-  //gettimeofday(&t1, NULL);
-  //timeval_subtract(&dt, &t1, &t0);
-  //printf("gc time: %f\n", dt.tv_sec * 1000.0 + dt.tv_usec / 1000.0);
+  ok = !ferror(dump.file);
+  return fclose(dump.file) == 0 && ok ? 0 : -1;
 }
 
 //=================
@@ -1785,13 +5275,18 @@ es_val_t es_make_list(es_ctx_t* ctx, ...)
   va_list argp;
   va_start(argp, ctx);
   e = va_arg(argp, es_val_t);
-  if (es_val_to_obj(e) == NULL)
+  if (es_is_void(e)) {
+    va_end(argp);
     return es_nil;
+  }
   tail = list = es_cons(ctx, e, es_nil);
-  while(es_val_to_obj(e = va_arg(argp, es_val_t)) != NULL) {
-    es_set_cdr(tail, es_cons(ctx, e, es_nil));
-    tail = es_cdr(tail);
+  gc_root2(ctx, list, tail);
+  while(!es_is_void(e = va_arg(argp, es_val_t))) {
+    e = es_cons(ctx, e, es_nil);
+    es_set_cdr(ctx, tail, e);
+    tail = e;
   }
+  gc_unroot(ctx, 2);
   va_end(argp);
   return list;
 }
@@ -1947,12 +5442,12 @@ static es_token_t peek(es_val_t port, char* pbuf)
   return t;
 }
 
-static es_val_t reverse(es_val_t lst)
+static es_val_t reverse(es_ctx_t* ctx, es_val_t lst)
 {
   es_val_t res = es_nil;
   while(!es_is_nil(lst)) {
     es_val_t next = es_cdr(lst);
-    es_pair_set_tail(lst, res);
+    es_pair_set_tail(ctx, lst, res);
     res = lst;
     lst = next;
   }
@@ -1962,33 +5457,50 @@ static es_val_t reverse(es_val_t lst)
 static es_val_t parse_list(es_ctx_t* ctx, es_val_t port)
 {
   char buf[1024];
+  es_val_t e = es_nil, lst = es_nil, node = es_nil;
   if (peek(port, buf) == tk_rpar) {
     next(port, buf);
     return es_nil;
   }
-  es_val_t e = es_parse(ctx, port);
-  if (es_is_error(e)) return e;
-  es_val_t lst = es_cons(ctx, e, es_nil);
-  es_val_t node = lst;
+  /* The port is read in place, so it must follow the collector from the first allocation */
+  gc_root4(ctx, port, lst, node, e);
+  e = es_parse(ctx, port);
+  if (es_is_error(e)) {
+    gc_unroot(ctx, 4);
+    return e;
+  }
+  lst = node = es_cons(ctx, e, es_nil);
   while(peek(port, buf) != tk_rpar) {
     if (peek(port, buf) == tk_dot) {
       next(port, buf);
-      es_set_cdr(node, es_parse(ctx, port));
+      e = es_parse(ctx, port);
+      es_set_cdr(ctx, node, e);
       if (peek(port, buf) != tk_rpar) {
         printf("error syntax dotted list [Line %d, Column: %d]\n", es_port_linum(port), es_port_colnum(port));
         eat_line(port);
+        gc_unroot(ctx, 4);
         return es_make_error(ctx, "syntax dotted list");
       }
       next(port, buf);
+      gc_unroot(ctx, 4);
       return lst;
     }
-    es_set_cdr(node, es_cons(ctx, es_parse(ctx, port), es_nil));
-    node = es_cdr(node);
+    e = es_parse(ctx, port);
+    e = es_cons(ctx, e, es_nil);
+    es_set_cdr(ctx, node, e);
+    node = e;
   }
   next(port, buf);
+  gc_unroot(ctx, 4);
   return lst;
 }
 
+static es_val_t parse_quoted(es_ctx_t* ctx, es_val_t port, es_val_t sym)
+{
+  es_val_t e = es_parse(ctx, port);
+  return es_cons(ctx, sym, es_cons(ctx, e, es_nil));
+}
+
 static es_val_t es_parse(es_ctx_t* ctx, es_val_t port)
 {
   char buf[1024];
@@ -2008,20 +5520,23 @@ static es_val_t es_parse(es_ctx_t* ctx, es_val_t port)
   case tk_char:
     return es_make_char_cstr(buf);
   case tk_quot:
-    return es_make_list(ctx, symbol_quote, es_parse(ctx, port), NULL);
+    return parse_quoted(ctx, port, symbol_quote);
   case tk_qquot:
-    return es_make_list(ctx, symbol_quasiquote, es_parse(ctx, port), NULL);
+    return parse_quoted(ctx, port, symbol_quasiquote);
   case tk_unquot:
-    return es_make_list(ctx, symbol_unquote, es_parse(ctx, port), NULL);
+    return parse_quoted(ctx, port, symbol_unquote);
   case tk_unquot_splice:
-    return es_make_list(ctx, symbol_unquotesplicing, es_parse(ctx, port), NULL);
+    return parse_quoted(ctx, port, symbol_unquotesplicing);
   case tk_hlpar: {
-      es_val_t lst = es_nil;
+      es_val_t lst = es_nil, e;
+      gc_root2(ctx, port, lst);
       while(peek(port, buf) != tk_rpar) {
-        lst = es_cons(ctx, es_parse(ctx, port), lst);
+        e = es_parse(ctx, port);
+        lst = es_cons(ctx, e, lst);
       }
       next(port, buf);
-      return es_vector_from_list(ctx, reverse(lst));
+      gc_unroot(ctx, 2);
+      return es_vector_from_list(ctx, reverse(ctx, lst));
     }
   case tk_lpar:
     return parse_list(ctx, port);
@@ -2032,23 +5547,55 @@ static es_val_t es_parse(es_ctx_t* ctx, es_val_t port)
 
 static void symtab_init(es_symtab_t* symtab)
 {
-  symtab->next_id = 0;
+  symtab->nslots      = ES_SYMTAB_SLOTS;
+  symtab->slots       = calloc(symtab->nslots, sizeof(es_symtab_slot_t));
+  symtab->names_size  = ES_SYMTAB_SLOTS / 2;
+  symtab->names       = malloc(symtab->names_size * sizeof(char*));
+  symtab->arena       = NULL;
+  symtab->arena_used  = 0;
+  symtab->arena_size  = 0;
+  symtab->next_id     = 0;
   symtab->next_gensym = 0;
 }
 
+static void symtab_free(es_symtab_t* symtab)
+{
+  while (symtab->arena) {
+    char* prev = *(char**)symtab->arena;
+    free(symtab->arena);
+    symtab->arena = prev;
+  }
+  free(symtab->slots);
+  free(symtab->names);
+  symtab->slots   = NULL;
+  symtab->names   = NULL;
+  symtab->next_id = 0;
+}
+
 static char* symtab_find_by_id(es_symtab_t* symtab, int id)
 {
-  return symtab->table[id];
+  return symtab->names[id];
 }
 
-static int symtab_id_by_string(es_symtab_t* symtab, const char* cstr)
+static uint32_t symtab_hash(const char* cstr)
 {
-  for(int i = 0; i < symtab->next_id; i++) {
-    if (strcmp(symtab->table[i], cstr) == 0) {
-      return i;
+  uint32_t hash = 2166136261u;
+  for(const unsigned char* p = (const unsigned char*)cstr; *p; p++) {
+    hash = (hash ^ *p) * 16777619u;
+  }
+  return hash;
+}
+
+static es_symtab_slot_t* symtab_slot(es_symtab_t* symtab, const char* cstr, uint32_t hash)
+{
+  size_t mask = symtab->nslots - 1;
+  for(size_t i = hash & mask;; i = (i + 1) & mask) {
+    es_symtab_slot_t* slot = &symtab->slots[i];
+    if (slot->id == 0 ||
+        (slot->hash == hash && strcmp(symtab->names[slot->id - 1], cstr) == 0)) {
+      return slot;
     }
   }
-  return -1;
 }
 
 es_val_t es_gensym(es_ctx_t* ctx) {
@@ -2066,22 +5613,69 @@ static int symtab_count(es_symtab_t* symtab)
 
 static int symtab_find_or_create(es_symtab_t* symtab, const char* cstr)
 {
-  int id = symtab_id_by_string(symtab, cstr);
-  if (id < 0) {
-    return symtab_add_string(symtab, cstr);
+  return symtab_add_string(symtab, cstr);
+}
+
+/* @return A copy of cstr which lives as long as the symbol table */
+static char* symtab_intern(es_symtab_t* symtab, const char* cstr)
+{
+  return symtab_find_by_id(symtab, symtab_find_or_create(symtab, cstr));
+}
+
+static void symtab_grow(es_symtab_t* symtab)
+{
+  es_symtab_slot_t* slots  = symtab->slots;
+  size_t            nslots = symtab->nslots;
+  symtab->nslots *= 2;
+  symtab->slots   = calloc(symtab->nslots, sizeof(es_symtab_slot_t));
+  for(size_t i = 0; i < nslots; i++) {
+    if (slots[i].id) {
+      size_t mask = symtab->nslots - 1, j = slots[i].hash & mask;
+      while (symtab->slots[j].id) j = (j + 1) & mask;
+      symtab->slots[j] = slots[i];
+    }
+  }
+  free(slots);
+}
+
+static char* symtab_store(es_symtab_t* symtab, const char* cstr)
+{
+  size_t len = strlen(cstr) + 1;
+  if (symtab->arena_used + len > symtab->arena_size) {
+    size_t size = sizeof(char*) + len;
+    if (size < ES_SYMTAB_ARENA) size = ES_SYMTAB_ARENA;
+    char* chunk = malloc(size);
+    *(char**)chunk     = symtab->arena;
+    symtab->arena      = chunk;
+    symtab->arena_used = sizeof(char*);
+    symtab->arena_size = size;
   }
-  return id;
+  char* name = symtab->arena + symtab->arena_used;
+  memcpy(name, cstr, len);
+  symtab->arena_used += len;
+  return name;
 }
 
 static int symtab_add_string(es_symtab_t* symtab, const char* cstr)
 {
-  if (symtab->next_id >= ES_SYMTAB_SIZE) {
-    return -1;
+  uint32_t hash = symtab_hash(cstr);
+  es_symtab_slot_t* slot = symtab_slot(symtab, cstr, hash);
+  if (slot->id) {
+    return slot->id - 1;
+  }
+
+  if ((size_t)(symtab->next_id + 1) * 2 > symtab->nslots) {
+    symtab_grow(symtab);
+    slot = symtab_slot(symtab, cstr, hash);
+  }
+  if (symtab->next_id == symtab->names_size) {
+    symtab->names_size *= 2;
+    symtab->names = realloc(symtab->names, symtab->names_size * sizeof(char*));
   }
 
-  char* newstr = malloc(strlen(cstr) + 1);
-  strcpy(newstr, cstr);
-  symtab->table[symtab->next_id] = newstr;
+  symtab->names[symtab->next_id] = symtab_store(symtab, cstr);
+  slot->hash = hash;
+  slot->id   = symtab->next_id + 1;
   return symtab->next_id++;
 }
 
@@ -2107,17 +5701,40 @@ static int index_of(es_val_t lst, es_val_t e)
 
 static es_val_t scope_args(es_val_t scope)
 {
-  return es_car(scope);
+  return es_caar(scope);
 }
 
-static es_val_t make_scope(es_ctx_t* ctx, es_val_t args, es_val_t parent)
+static es_val_t scope_body(es_val_t scope)
+{
+  return es_cdar(scope);
+}
+
+/**
+ * A scope is ((args . body) . (parent . captured)). The body is kept to
+ * look for assignments, and captured is set once code compiled in the
+ * scope may refer to its frame after the procedure returns.
+ */
+static es_val_t make_scope(es_ctx_t* ctx, es_val_t args, es_val_t body, es_val_t parent)
 {
-  return es_cons(ctx, flatten_args(ctx, args), parent);
+  return es_cons(ctx, es_cons(ctx, flatten_args(ctx, args), body), es_cons(ctx, parent, es_false));
 }
 
 static es_val_t scope_parent(es_val_t scope)
 {
-  return es_cdr(scope);
+  return es_cadr(scope);
+}
+
+static int scope_captured(es_val_t scope)
+{
+  return es_is_true(es_cddr(scope));
+}
+
+/* A closure made in scope refers to its frame, and through it to those of the enclosing scopes */
+static void scope_capture(es_ctx_t* ctx, es_val_t scope)
+{
+  for(; !es_is_nil(scope); scope = scope_parent(scope)) {
+    es_set_cdr(ctx, es_cdr(scope), es_true);
+  }
 }
 
 static int arg_idx(es_val_t scope, es_val_t symbol, int* pidx, int* pdepth)
@@ -2153,6 +5770,91 @@ static int lambda_arity(es_val_t formals, int* rest)
   }
 }
 
+static int is_lambda_form(es_val_t exp)
+{
+  return es_is_pair(exp) && es_car(exp) == symbol_lambda;
+}
+
+/**
+ * Whether a call-with-values can be compiled as a receive: the consumer is
+ * a lambda expression and call-with-values is not a local variable.
+ */
+static int is_values_consumer(es_val_t args, es_val_t scope)
+{
+  int idx, depth;
+  return es_list_length(args) == 2
+    && is_lambda_form(es_cadr(args))
+    && !arg_idx(scope, symbol_call_with_values, &idx, &depth);
+}
+
+/**
+ * Adds to vars the variables of scope that exp refers to, except those in
+ * bound which are bound within exp itself.
+ */
+static es_val_t free_vars(es_ctx_t* ctx, es_val_t exp, es_val_t bound, es_val_t scope, es_val_t vars)
+{
+  int idx, depth;
+  if (es_is_symbol(exp)) {
+    if (index_of(bound, exp) == -1 && index_of(vars, exp) == -1 && arg_idx(scope, exp, &idx, &depth))
+      vars = es_cons(ctx, exp, vars);
+    return vars;
+  }
+  if (!es_is_pair(exp) || es_car(exp) == symbol_quote)
+    return vars;
+  if (is_lambda_form(exp) && es_is_pair(es_cdr(exp))) {
+    es_val_t inner = es_cadr(exp);
+    for(; es_is_pair(inner); inner = es_cdr(inner))
+      bound = es_cons(ctx, es_car(inner), bound);
+    if (es_is_symbol(inner))
+      bound = es_cons(ctx, inner, bound);
+    return free_vars(ctx, es_cddr(exp), bound, scope, vars);
+  }
+  for(; es_is_pair(exp); exp = es_cdr(exp))
+    vars = free_vars(ctx, es_car(exp), bound, scope, vars);
+  return vars;
+}
+
+/* Whether exp contains a set! of sym, quoted data aside */
+static int is_assigned(es_val_t exp, es_val_t sym)
+{
+  if (!es_is_pair(exp) || es_car(exp) == symbol_quote)
+    return 0;
+  if (es_car(exp) == symbol_set && es_is_pair(es_cdr(exp)) && es_cadr(exp) == sym)
+    return 1;
+  for(; es_is_pair(exp); exp = es_cdr(exp)) {
+    if (is_assigned(es_car(exp), sym))
+      return 1;
+  }
+  return 0;
+}
+
+/* Whether sym is assigned anywhere in the body of the scope binding it */
+static int scope_assigns(es_val_t scope, es_val_t sym)
+{
+  for(; !es_is_nil(scope); scope = scope_parent(scope)) {
+    if (index_of(scope_args(scope), sym) != -1)
+      return is_assigned(scope_body(scope), sym);
+  }
+  return 0;
+}
+
+/**
+ * Whether the procedure compiled in scope needs its frame on the heap:
+ * when a nested closure may capture it, or when an argument is assigned,
+ * since continuations save the VM stack by value and re-entering one
+ * would undo the assignment.
+ */
+static int frame_captured(es_val_t scope)
+{
+  if (scope_captured(scope))
+    return 1;
+  for(es_val_t vars = scope_args(scope); !es_is_nil(vars); vars = es_cdr(vars)) {
+    if (is_assigned(scope_body(scope), es_car(vars)))
+      return 1;
+  }
+  return 0;
+}
+
 static es_val_t compile(es_ctx_t* ctx, es_val_t bc, es_val_t exp, int tail_pos, int next, es_val_t scope)
 {
   if (es_is_pair(exp)) {
@@ -2183,8 +5885,17 @@ static es_val_t compile_form(es_ctx_t* ctx, es_val_t bc, es_val_t exp, int tail_
     } else if (es_is_eq(op, symbol_set)) {
       compile_set(ctx, bc, es_car(args), es_cadr(args), tail_pos, next, scope);
     } else if (es_is_eq(op, symbol_quote)) {
-      emit_const(bc, alloc_const(bc, es_car(args)));
+      emit_const(bc, alloc_const(ctx, bc, es_car(args)));
       if (tail_pos) emit(bc, (es_inst_t){ opcode(next) });
+    } else if (es_is_eq(op, symbol_receive)) {
+      compile_receive(ctx, bc, es_car(args), es_cadr(args), es_cddr(args), tail_pos, next, scope);
+    } else if (es_is_eq(op, symbol_call_with_values) && is_values_consumer(args, scope)) {
+      es_val_t producer = es_car(args);
+      es_val_t consumer = es_cadr(args);
+      es_val_t exp      = is_lambda_form(producer) && es_is_nil(es_cadr(producer))
+                        ? es_cons(ctx, symbol_begin, es_cddr(producer))
+                        : es_cons(ctx, producer, es_nil);
+      compile_receive(ctx, bc, es_cadr(consumer), exp, es_cddr(consumer), tail_pos, next, scope);
     } else {
       compile_call(ctx, bc, exp, tail_pos, next, scope);
     }
@@ -2196,7 +5907,7 @@ static es_val_t compile_form(es_ctx_t* ctx, es_val_t bc, es_val_t exp, int tail_
 
 static es_val_t compile_const(es_ctx_t* ctx, es_val_t bc, es_val_t exp, int tail_pos, int next, es_val_t scope)
 {
-  emit_const(bc, alloc_const(bc, exp));
+  emit_const(bc, alloc_const(ctx, bc, exp));
   if (tail_pos) emit(bc, (es_inst_t){ opcode(next) });
   return es_void;
 }
@@ -2250,92 +5961,466 @@ static es_val_t compile_lambda(es_ctx_t* ctx, es_val_t bc, es_val_t formals, es_
   int label1 = bytecode_label(bc);
   emit_jmp(bc, -1);
   int label2 = bytecode_label(bc);
-  scope = make_scope(ctx, formals, scope);
-  compile_seq(ctx, bc, body, 1, RETURN, scope);
+  es_val_t inner = make_scope(ctx, formals, body, scope);
+  compile_seq(ctx, bc, body, 1, RETURN, inner);
   int label3 = bytecode_label(bc);
   int rest;
   int arity = lambda_arity(formals, &rest);
   es_val_t proc = es_make_proc(ctx, arity, rest, label2, label3);
-  emit_closure(bc, alloc_const(bc, proc));
+  es_proc_val(proc)->captures = frame_captured(inner);
+  profile_add_proc(ctx, label2, label3);
+  emit_closure(bc, alloc_const(ctx, bc, proc));
+  scope_capture(ctx, scope);
   es_bytecode_val(bc)->inst[label1].operand1 = label3 - label1;
   if (tail_pos) emit(bc, (es_inst_t){ opcode(next) });
   return es_void;
 }
 
-static es_val_t compile_if(es_ctx_t* ctx, es_val_t bc, es_val_t exp, int tail_pos, int next, es_val_t scope)
+/**
+ * (receive formals exp body ...) binds formals to the values of exp. The
+ * body is compiled as a procedure that RECEIVE enters directly with the
+ * values left on the stack, so no closure or list is made. Variables of
+ * the enclosing scopes it uses are passed by value ahead of the values,
+ * unless one is assigned somewhere: then the body shares the caller's
+ * frame like a nested lambda, and that frame goes on the heap.
+ */
+static es_val_t compile_receive(es_ctx_t* ctx, es_val_t bc, es_val_t formals, es_val_t exp, es_val_t body, int tail_pos, int next, es_val_t scope)
+{
+  es_val_t lifted = free_vars(ctx, body, flatten_args(ctx, formals), scope, es_nil);
+  es_val_t params = formals;
+  es_val_t inner  = es_nil;
+  int      nvars  = 0;
+  for(es_val_t vars = lifted; !es_is_nil(vars); vars = es_cdr(vars), nvars++) {
+    if (scope_assigns(scope, es_car(vars))) {
+      nvars = -1;
+      break;
+    }
+    params = es_cons(ctx, es_car(vars), params);
+  }
+  if (nvars < 0) {
+    params = formals;
+    inner  = scope;
+  }
+  int label1 = bytecode_label(bc);
+  emit_jmp(bc, -1);
+  int label2 = bytecode_label(bc);
+  inner = make_scope(ctx, params, body, inner);
+  compile_seq(ctx, bc, body, 1, RETURN, inner);
+  int label3 = bytecode_label(bc);
+  int rest;
+  int arity = lambda_arity(params, &rest);
+  es_val_t proc = es_make_proc(ctx, arity, rest, label2, label3);
+  es_proc_val(proc)->captures = frame_captured(inner);
+  if (nvars < 0)
+    scope_capture(ctx, scope); // The body's frame points to the caller's
+  es_bytecode_val(bc)->inst[label1].operand1 = label3 - label1;
+  for(int i = 0; i < nvars; i++, params = es_cdr(params))
+    compile_ref(ctx, bc, es_car(params), 0, 0, scope);
+  compile(ctx, bc, exp, 0, 0, scope);
+  emit_receive(bc, tail_pos, alloc_const(ctx, bc, proc), nvars);
+  return es_void;
+}
+
+static es_val_t compile_if(es_ctx_t* ctx, es_val_t bc, es_val_t exp, int tail_pos, int next, es_val_t scope)
+{
+  es_val_t cond = es_cadr(exp);
+  es_val_t bthen = es_caddr(exp);
+  compile(ctx, bc, cond, 0, 0, scope);
+  int label1 = bytecode_label(bc);
+  emit_bf(bc, -1);
+  compile(ctx, bc, bthen, tail_pos, next, scope);
+  int label2 = bytecode_label(bc);
+  if (!tail_pos) emit_jmp(bc, -1);
+  int label3 = bytecode_label(bc);
+  if (!es_is_nil(es_cdddr(exp))) {
+    es_val_t belse = es_cadddr(exp);
+    compile(ctx, bc, belse, tail_pos, next, scope);
+  } else {
+    emit_const(bc, alloc_const(ctx, bc, es_undefined));
+    if (tail_pos) emit(bc, (es_inst_t){ opcode(next) });
+  }
+  int label4 = bytecode_label(bc);
+  es_bytecode_val(bc)->inst[label1].operand1 = label3 - label1;
+  if (!tail_pos) es_bytecode_val(bc)->inst[label2].operand1 = label4 - label2;
+  return es_void;
+}
+
+/* The lambda's own range is registered after those nested in its body */
+static es_val_t compile_define(es_ctx_t* ctx, es_val_t bc, es_val_t binding, es_val_t val, int tail_pos, int next, es_val_t scope)
+{
+  if (es_is_symbol(binding)) {
+    int nprocs = ctx->profile.nprocs;
+    compile(ctx, bc, es_car(val), 0, 0, scope);
+    if (is_lambda_form(es_car(val)) && ctx->profile.nprocs > nprocs) {
+      ctx->profile.procs[ctx->profile.nprocs - 1].name = binding;
+    }
+    emit_global_set(bc, env_reserve_loc(ctx, es_ctx_env(ctx), binding, es_undefined));
+    if (tail_pos) emit(bc, (es_inst_t){ opcode(next) });
+  } else if (es_is_pair(binding)) {
+    es_val_t sym     = es_car(binding);
+    es_val_t formals = es_cdr(binding);
+    es_val_t body    = val;
+    int nprocs = ctx->profile.nprocs;
+    compile_lambda(ctx, bc, formals, body, 0, 0, scope);
+    if (ctx->profile.nprocs > nprocs)
+      ctx->profile.procs[ctx->profile.nprocs - 1].name = sym;
+    emit_global_set(bc, env_reserve_loc(ctx, es_ctx_env(ctx), sym, es_undefined));
+    if (tail_pos) emit(bc, (es_inst_t){ opcode(next) });
+  } else {
+    return es_make_error(ctx, "invalid define syntax");
+  }
+  return es_void;
+}
+
+static es_val_t compile_seq(es_ctx_t* ctx, es_val_t bc, es_val_t seq, int tail_pos, int next, es_val_t scope)
+{
+  while(!es_is_nil(es_cdr(seq))) {
+    compile(ctx, bc, es_car(seq), 0, 0, scope);
+    emit_pop(bc);
+    seq = es_cdr(seq);
+  }
+  compile(ctx, bc, es_car(seq), tail_pos, next, scope);
+  return es_void;
+}
+
+static es_val_t compile_args(es_ctx_t* ctx, es_val_t bc, es_val_t args, es_val_t scope)
+{
+  if (!es_is_nil(args)) {
+    compile(ctx, bc, es_car(args), 0, 0, scope);
+    compile_args(ctx, bc, es_cdr(args), scope);
+  }
+  return es_void;
+}
+
+//=============
+// VM
+//=============
+#define pop(ctx)             (assert(ctx->sp > ctx->stack), *--ctx->sp)
+#define pop_n(ctx, n)        (assert(ctx->sp - (n) >= ctx->stack), ctx->sp -= n)
+#define push(ctx, v)         *ctx->sp++ = v
+#define restore(ctx)         ctx->fp--; \
+                             ctx->args = ctx->frames[ctx->fp].args; \
+                             ctx->ip   = ctx->frames[ctx->fp].knt;
+#define save(ctx)            ctx->frames[ctx->fp].args = ctx->args; \
+                             ctx->frames[ctx->fp].knt  = ctx->ip; \
+                             ctx->fp++;
+#define vm_check(ctx, n)     if (ctx->sp + (n) > ctx->stack_limit || ctx->fp >= ctx->frame_limit) \
+                               vm_deepen(ctx, ctx->sp + (n), ctx->fp);
+
+/**
+ * Frames of procedures that create no closures cannot be captured, so they
+ * stay on the VM stack: the arguments, then the parent environment. The
+ * frame is referred to by an immediate under the value tag holding the
+ * stack index of its first argument and its size.
+ */
+static const es_val_t stack_frame_tag = es_tagged_val(ES_ARGS_TYPE, ES_VALUE_TAG);
+
+static int is_stack_frame(es_val_t frame)
+{
+  return (frame & 0xff) == stack_frame_tag;
+}
+
+static int stack_frame_base(es_val_t frame)
+{
+  return (frame >> 8) & 0xffffff;
+}
+
+static int stack_frame_size(es_val_t frame)
+{
+  return frame >> 32;
+}
+
+/**
+ * Turns the argc arguments on top of the stack into a frame for a
+ * procedure taking arity arguments, and rest ones if rest is set.
+ */
+static es_val_t vm_push_frame(es_ctx_t* ctx, es_args_t* parent, int arity, int rest, int argc)
+{
+  es_val_t* argv = ctx->sp - argc;
+  es_val_t  lst  = es_nil;
+  gc_root2(ctx, parent, lst);
+  for(int j = argc - 1; rest && j >= arity; j--) {
+    lst = es_cons(ctx, argv[j], lst);
+  }
+  for(int i = argc; i < arity; i++)
+    argv[i] = es_undefined;
+  ctx->sp = argv + arity;
+  if (rest)
+    push(ctx, lst);
+  push(ctx, es_obj_to_val(parent));
+  gc_unroot(ctx, 2);
+  return stack_frame_tag | (es_val_t)(argv - ctx->stack) << 8 | (es_val_t)(arity + rest) << 32;
+}
+
+/**
+ * Pops the current frame if it is on the stack, along with anything the
+ * procedure left above it.
+ */
+static void vm_pop_frame(es_ctx_t* ctx)
+{
+  if (is_stack_frame(ctx->args))
+    ctx->sp = ctx->stack + stack_frame_base(ctx->args);
+}
+
+static es_val_t* frame_args(es_ctx_t* ctx, es_val_t frame)
+{
+  return is_stack_frame(frame) ? ctx->stack + stack_frame_base(frame) : es_args_val(frame)->args;
+}
+
+static es_args_t* frame_parent(es_ctx_t* ctx, es_val_t frame)
+{
+  return is_stack_frame(frame) ? es_args_val(frame_args(ctx, frame)[stack_frame_size(frame)]) : es_args_val(frame)->parent;
+}
+
+static int vm_is_capture(es_val_t proc)
+{
+  return es_is_fn(proc) && (es_fn_val(proc)->pfn == fn_call_cc || es_fn_val(proc)->pfn == fn_call_ec);
+}
+
+/**
+ * Calls the receiver on top of the stack with the continuation of this
+ * call. The frame the continuation returns through is pushed here unless
+ * this is a tail call, which reuses the caller's. A marker frame holding
+ * the continuation goes above it, the receiver returns through both.
+ */
+static void vm_capture(es_ctx_t* ctx, es_val_t fn, int tail)
+{
+  es_inst_t* inst;
+  es_val_t   k, receiver;
+  int        sp = ctx->sp - ctx->stack - 1;
+
+  if (!tail) {
+    save(ctx);
+  }
+  k        = cont_capture(ctx, sp, ctx->fp - 1, es_fn_val(fn)->pfn == fn_call_cc);
+  inst     = es_bytecode_val(ctx->bytecode)->inst;
+  receiver = ctx->stack[sp];
+  ctx->frames[ctx->fp].args = k;
+  ctx->frames[ctx->fp].knt  = inst + ES_CONT_RETURN;
+  ctx->fp++;
+  ctx->sp   = ctx->stack + sp;
+  push(ctx, k);
+  push(ctx, receiver);
+  ctx->args = es_nil;
+  ctx->ip   = inst + ES_CONT_CALL;
+}
+
+static int vm_is_values(es_val_t proc)
+{
+  return es_is_fn(proc) && es_fn_val(proc)->pfn == fn_values;
+}
+
+static int vm_is_call_with_values(es_val_t proc)
+{
+  return es_is_fn(proc) && es_fn_val(proc)->pfn == fn_call_with_values;
+}
+
+/**
+ * Whether the code returned to at ip takes any number of values, which
+ * are then left on the stack with their count in ctx->values. Everywhere
+ * else a call to values returns its first argument.
+ */
+static int vm_receives(es_inst_t* ip)
+{
+  while(ip->opcode == opcode(JMP))
+    ip += ip->operand1;
+  return ip->opcode == opcode(RECEIVE) || ip->opcode == opcode(TAIL_RECEIVE) || ip->opcode == opcode(APPLY_VALUES);
+}
+
+/**
+ * Calls the producer under the consumer on top of the stack, with a marker
+ * frame holding the consumer which the producer returns its values to.
+ */
+static void vm_call_with_values(es_ctx_t* ctx, int tail)
 {
-  es_val_t cond = es_cadr(exp);
-  es_val_t bthen = es_caddr(exp);
-  compile(ctx, bc, cond, 0, 0, scope);
-  int label1 = bytecode_label(bc);
-  emit_bf(bc, -1);
-  compile(ctx, bc, bthen, tail_pos, next, scope);
-  int label2 = bytecode_label(bc);
-  if (!tail_pos) emit_jmp(bc, -1);
-  int label3 = bytecode_label(bc);
-  if (!es_is_nil(es_cdddr(exp))) {
-    es_val_t belse = es_cadddr(exp);
-    compile(ctx, bc, belse, tail_pos, next, scope);
-  } else {
-    emit_const(bc, alloc_const(bc, es_undefined));
+  es_inst_t* inst     = es_bytecode_val(ctx->bytecode)->inst;
+  es_val_t   consumer = pop(ctx);
+  es_val_t   producer = pop(ctx);
+
+  vm_check(ctx, 0);
+  if (!tail) {
+    save(ctx);
   }
-  int label4 = bytecode_label(bc);
-  es_bytecode_val(bc)->inst[label1].operand1 = label3 - label1;
-  if (!tail_pos) es_bytecode_val(bc)->inst[label2].operand1 = label4 - label2;
-  return es_void;
+  ctx->frames[ctx->fp].args = consumer;
+  ctx->frames[ctx->fp].knt  = inst + ES_VALUES_APPLY;
+  ctx->fp++;
+  push(ctx, producer);
+  ctx->args = es_nil;
+  ctx->ip   = inst + ES_VALUES_CALL;
 }
 
-static es_val_t compile_define(es_ctx_t* ctx, es_val_t bc, es_val_t binding, es_val_t val, int tail_pos, int next, es_val_t scope)
+static int vm_is_iterator_next(es_val_t proc)
 {
-  if (es_is_symbol(binding)) {
-    compile(ctx, bc, es_car(val), 0, 0, scope);
-    emit_global_set(bc, env_reserve_loc(ctx, es_ctx_env(ctx), binding, es_undefined));
-    if (tail_pos) emit(bc, (es_inst_t){ opcode(next) });
-  } else if (es_is_pair(binding)) {
-    es_val_t sym     = es_car(binding);
-    es_val_t formals = es_cdr(binding);
-    es_val_t body    = val;
-    compile_lambda(ctx, bc, formals, body, 0, 0, scope);
-    emit_global_set(bc, env_reserve_loc(ctx, es_ctx_env(ctx), sym, es_undefined));
-    if (tail_pos) emit(bc, (es_inst_t){ opcode(next) });
-  } else {
-    return es_make_error(ctx, "invalid define syntax");
+  return es_is_fn(proc) && es_fn_val(proc)->pfn == fn_iterator_next;
+}
+
+/**
+ * Runs the generator on top of the stack up to its next yield, under a
+ * marker frame holding it. A suspended one gets its stacks copied back
+ * above the marker and returns from the call to yield that suspended it.
+ * The frame iterator-next returns through is pushed here unless this is
+ * a tail call.
+ */
+static void vm_generator_next(es_ctx_t* ctx, int tail)
+{
+  es_inst_t* inst = es_bytecode_val(ctx->bytecode)->inst;
+  es_val_t   val  = ctx->sp[-1];
+  es_iter_t* it   = es_iter_val(val);
+
+  if (it->pos == ES_GEN_DONE || it->pos == ES_GEN_RUNNING) {
+    ctx->sp[-1] = it->pos == ES_GEN_DONE ? es_eof_obj : es_make_error(ctx, "generator is already running");
+    if (tail) {
+      restore(ctx);
+    }
+    return;
   }
-  return es_void;
+  ctx->sp--;
+  if (ctx->sp + it->nstack > ctx->stack_limit || ctx->fp + it->nframes >= ctx->frame_limit)
+    vm_deepen(ctx, ctx->sp + it->nstack, ctx->fp + it->nframes);
+  if (!tail) {
+    save(ctx);
+  }
+  it->sp = ctx->sp - ctx->stack;
+  it->fp = ctx->fp;
+  ctx->frames[ctx->fp].args = val;
+  ctx->frames[ctx->fp].knt  = inst + ES_ITER_END;
+  ctx->fp++;
+  if (it->pos == ES_GEN_NEW) {
+    it->pos = ES_GEN_RUNNING;
+    push(ctx, val);
+    push(ctx, it->source);
+    ctx->args = es_nil;
+    ctx->ip   = inst + ES_CONT_CALL;
+    return;
+  }
+  es_val_t* saved = es_vector_val(it->saved)->array;
+  memcpy(ctx->sp, saved, it->nstack * sizeof(es_val_t));
+  ctx->sp += it->nstack;
+  for(int i = 0; i < it->nframes; i++) {
+    es_val_t args = saved[it->nstack + 2 * i];
+    ctx->frames[ctx->fp].args = is_stack_frame(args) ? args + ((es_val_t)it->sp << 8) : args;
+    ctx->frames[ctx->fp].knt  = inst + es_fixnum_val(saved[it->nstack + 2 * i + 1]);
+    ctx->fp++;
+  }
+  it->pos = ES_GEN_RUNNING;
+  push(ctx, es_void); // What the call to yield returns
+  restore(ctx);
 }
 
-static es_val_t compile_seq(es_ctx_t* ctx, es_val_t bc, es_val_t seq, int tail_pos, int next, es_val_t scope)
+/**
+ * Suspends the running generator val, yielding the value on top of the
+ * stack to the iterator-next that resumed it. Everything above its marker
+ * frame is saved, the saved vector is reused while it is large enough.
+ *
+ * @return 0 if val is not running below this call.
+ */
+static int vm_yield(es_ctx_t* ctx, es_val_t val, int tail)
 {
-  while(!es_is_nil(es_cdr(seq))) {
-    compile(ctx, bc, es_car(seq), 0, 0, scope);
-    emit_pop(bc);
-    seq = es_cdr(seq);
+  es_inst_t* inst = es_bytecode_val(ctx->bytecode)->inst;
+  es_iter_t* it   = es_iter_val(val);
+  int        m    = it->fp;
+
+  if (it->pos != ES_GEN_RUNNING || m >= ctx->fp || ctx->frames[m].args != val || ctx->frames[m].knt != inst + ES_ITER_END)
+    return 0;
+  es_val_t yielded = pop(ctx);
+  if (!tail) {
+    save(ctx);
   }
-  compile(ctx, bc, es_car(seq), tail_pos, next, scope);
-  return es_void;
+  int nstack  = ctx->sp - ctx->stack - it->sp;
+  int nframes = ctx->fp - m - 1;
+  int size    = nstack + 2 * nframes;
+  if (es_is_nil(it->saved) || es_vector_len(it->saved) < size) {
+    es_val_t saved;
+    gc_root(ctx, yielded);
+    saved = es_make_vector(ctx, 2 * size);
+    gc_unroot(ctx, 1);
+    val = ctx->frames[m].args; // The collection may have moved it
+    it  = es_iter_val(val);
+    gc_write_barrier(ctx, val, saved);
+    it->saved = saved;
+  }
+  for(int i = 0; i < nstack; i++)
+    es_vector_set(ctx, it->saved, i, ctx->stack[it->sp + i]);
+  for(int i = 0; i < nframes; i++) {
+    es_val_t args = ctx->frames[m + 1 + i].args;
+    es_vector_set(ctx, it->saved, nstack + 2 * i, is_stack_frame(args) ? args - ((es_val_t)it->sp << 8) : args);
+    es_vector_set(ctx, it->saved, nstack + 2 * i + 1, es_make_fixnum(ctx->frames[m + 1 + i].knt - inst));
+  }
+  it->nstack  = nstack;
+  it->nframes = nframes;
+  it->pos     = ES_GEN_SUSPENDED;
+  ctx->sp = ctx->stack + it->sp;
+  ctx->fp = m; // The marker frame goes too
+  push(ctx, yielded);
+  restore(ctx);
+  return 1;
 }
 
-static es_val_t compile_args(es_ctx_t* ctx, es_val_t bc, es_val_t args, es_val_t scope)
+/**
+ * Passes the arguments on top of the stack to continuation k. While its
+ * marker frame is live the stacks below it are intact and are just cut
+ * back, otherwise a full continuation copies them back. The arguments are
+ * all returned if the continuation receives values, else the first one.
+ *
+ * @return 0 if k is escape-only and its extent was left.
+ */
+static int vm_resume(es_ctx_t* ctx, es_val_t kval, int argc)
+{
+  es_cont_t* k    = es_cont_val(kval);
+  es_inst_t* inst = es_bytecode_val(ctx->bytecode)->inst;
+  int        live = ctx->fp > k->fp + 1
+                 && ctx->frames[k->fp + 1].args == kval
+                 && ctx->frames[k->fp + 1].knt == inst + ES_CONT_RETURN;
+
+  if (!live && !k->full)
+    return 0;
+  memmove(ctx->stack + k->sp, ctx->sp - argc, argc * sizeof(es_val_t));
+  if (!live)
+    cont_restore(ctx, k); // Only rewrites the stack below the arguments
+  ctx->fp = k->fp + 1;
+  ctx->sp = ctx->stack + k->sp;
+  if (argc != 1 && vm_receives(ctx->frames[k->fp].knt)) {
+    ctx->sp    += argc;
+    ctx->values = argc;
+  } else {
+    es_val_t val = argc > 0 ? *ctx->sp : es_void;
+    push(ctx, val);
+  }
+  restore(ctx);
+  return 1;
+}
+
+/**
+ * Makes the frame of proc from the argc arguments on top of the stack and
+ * jumps to its code.
+ */
+static void vm_enter(es_ctx_t* ctx, es_args_t* parent, es_proc_t* proc, int argc)
 {
-  if (!es_is_nil(args)) {
-    compile(ctx, bc, es_car(args), 0, 0, scope);
-    compile_args(ctx, bc, es_cdr(args), scope);
+  int addr = proc->addr; // Making the frame may move proc
+  if (proc->captures) {
+    es_val_t* argv = ctx->sp - argc;
+    ctx->args = es_make_args(ctx, parent, proc->arity, proc->rest, argc, argv);
+    pop_n(ctx, argc);
+  } else {
+    ctx->args = vm_push_frame(ctx, parent, proc->arity, proc->rest, argc);
   }
-  return es_void;
+  ctx->ip = es_bytecode_val(ctx->bytecode)->inst + addr;
 }
 
-//=============
-// VM
-//=============
-#define pop(ctx)             *--ctx->sp
-#define pop_n(ctx, n)        ctx->sp -= n
-#define push(ctx, v)         *ctx->sp++ = v
-#define restore(ctx)         ctx->fp--; \
-                             ctx->args = ctx->frames[ctx->fp].args; \
-                             ctx->ip   = ctx->frames[ctx->fp].knt;
-#define save(ctx)            ctx->frames[ctx->fp].args = ctx->args; \
-                             ctx->frames[ctx->fp].knt  = ctx->ip; \
-                             ctx->fp++;
+/**
+ * Drops the current frame if it is on the stack, sliding the argc
+ * arguments of a tail call over it.
+ */
+static void vm_drop_frame(es_ctx_t* ctx, int argc)
+{
+  if (is_stack_frame(ctx->args)) {
+    es_val_t* argv = ctx->sp - argc;
+    vm_pop_frame(ctx);
+    memmove(ctx->sp, argv, argc * sizeof(es_val_t));
+    ctx->sp += argc;
+    ctx->args = es_nil;
+  }
+}
 
 static void* es_vm_run(es_ctx_t* ctx, es_vm_mode_t mode, ...)
 {
@@ -2356,7 +6441,11 @@ static void* es_vm_run(es_ctx_t* ctx, es_vm_mode_t mode, ...)
     { &&CALL,       "call",       1 },
     { &&TAIL_CALL,  "tail-call",  1 },
     { &&RETURN,     "return",     0 },
-    { &&CLOSURE,    "closure",    1 }
+    { &&CLOSURE,    "closure",    1 },
+    { &&RECEIVE,    "receive",    2 },
+    { &&TAIL_RECEIVE, "tail-receive", 2 },
+    { &&APPLY_VALUES, "apply-values", 0 },
+    { &&ITER_END,   "iter-end",   0 }
   };
 
   if (mode == ES_VM_FETCH_OPCODE) {
@@ -2374,9 +6463,13 @@ static void* es_vm_run(es_ctx_t* ctx, es_vm_mode_t mode, ...)
   va_end(ap);
 
   es_inst_t* inst  = es_bytecode_val(ctx->bytecode)->inst;
+  es_val_t   callee;  // Procedure and argument count of the tail call in progress
+  int        argc;
   ctx->ip          = inst + es_proc_addr(proc);
   ctx->args        = es_nil;
-  es_val_t* consts = es_bytecode_val(ctx->bytecode)->consts;
+  /* The bytecode object may be moved by any collection, so the constant
+     pool is always reached through ctx->bytecode */
+  #define consts (es_bytecode_val(ctx->bytecode)->consts)
 
   #ifdef LABELS_AS_VALUES
     #define SWITCH(value) goto *(value);
@@ -2429,8 +6522,8 @@ static void* es_vm_run(es_ctx_t* ctx, es_vm_mode_t mode, ...)
       CASE(CLOSED_REF): {
         int depth = ctx->ip->operand1;
         int idx   = ctx->ip->operand2;
-        es_args_t* cenv = es_args_val(ctx->args);
-        while(depth-- > 0) {
+        es_args_t* cenv = frame_parent(ctx, ctx->args);
+        while(--depth > 0) {
           cenv = cenv->parent;
         }
         push(ctx, cenv->args[idx]);
@@ -2440,18 +6533,20 @@ static void* es_vm_run(es_ctx_t* ctx, es_vm_mode_t mode, ...)
       CASE(CLOSED_SET): {
         int depth = ctx->ip->operand1;
         int idx   = ctx->ip->operand2;
-        es_args_t* cenv = es_args_val(ctx->args);
-        while(depth-- > 0) {
+        es_args_t* cenv = frame_parent(ctx, ctx->args);
+        while(--depth > 0) {
           cenv = cenv->parent;
         }
-        cenv->args[idx] = pop(ctx);
+        es_val_t val = pop(ctx);
+        gc_write_barrier(ctx, es_obj_to_val(cenv), val);
+        cenv->args[idx] = val;
         push(ctx, es_void);
         ctx->ip++;
         BREAK;
       }
       CASE(ARG_REF): {
         int arg_idx  = ctx->ip->operand1;
-        es_val_t arg = es_args_val(ctx->args)->args[arg_idx];
+        es_val_t arg = frame_args(ctx, ctx->args)[arg_idx];
         push(ctx, arg);
         ctx->ip++;
         BREAK;
@@ -2459,69 +6554,168 @@ static void* es_vm_run(es_ctx_t* ctx, es_vm_mode_t mode, ...)
       CASE(ARG_SET): {
         int arg_idx  = ctx->ip->operand1;
         es_val_t val = pop(ctx);
-        es_args_val(ctx->args)->args[arg_idx] = val;
+        if (!is_stack_frame(ctx->args))
+          gc_write_barrier(ctx, ctx->args, val);
+        frame_args(ctx, ctx->args)[arg_idx] = val;
+        push(ctx, es_void);
         ctx->ip++;
         BREAK;
       }
       CASE(CLOSURE): {
         int const_idx = ctx->ip->operand1;
         es_val_t proc = consts[const_idx];
+        assert(!is_stack_frame(ctx->args)); // Procedures creating closures get heap frames
         es_val_t closure = es_make_closure(ctx, ctx->args, proc);
         push(ctx, closure);
         ctx->ip++;
         BREAK;
       }
-      CASE(RETURN):
+      CASE(RETURN): {
+        es_val_t res = pop(ctx);
+        vm_pop_frame(ctx);
+        push(ctx, res);
         restore(ctx);
         BREAK;
+      }
       CASE(CALL): {
         int argc = ctx->ip->operand1;
+        vm_check(ctx, 0);
         ctx->ip++;
         es_val_t proc = pop(ctx);
-        if (es_is_fn(proc)) {
-          es_val_t* argv = ctx->sp - argc;
-          es_val_t res   = es_fn_apply_argv(ctx, proc, argc, argv);
-          pop_n(ctx, argc);
-          push(ctx, res);
-        } else if (es_is_closure(proc)) {
+        if (es_is_closure(proc)) {   // Tag test only, checked before anything that reads a header
           es_closure_t* closure = es_closure_val(proc);
           es_proc_t* proc = es_obj_to(es_proc_t*, closure->proc);
+          int addr = proc->addr;
           save(ctx);
+          if (proc->captures) {
+            es_val_t* argv = ctx->sp - argc;
+            ctx->args  = es_make_args(ctx, closure->env, proc->arity, proc->rest, argc, argv);
+            pop_n(ctx, argc);
+          } else {
+            ctx->args  = vm_push_frame(ctx, closure->env, proc->arity, proc->rest, argc);
+          }
+          ctx->ip = inst + addr;
+        } else if (argc == 1 && vm_is_capture(proc)) {
+          vm_capture(ctx, proc, 0);
+        } else if (argc != 1 && vm_is_values(proc) && vm_receives(ctx->ip)) {
+          ctx->values = argc;
+        } else if (argc == 2 && vm_is_call_with_values(proc)) {
+          vm_call_with_values(ctx, 0);
+        } else if (argc == 1 && vm_is_iterator_next(proc) && es_is_generator(ctx->sp[-1])) {
+          vm_generator_next(ctx, 0);
+        } else if (es_is_fn(proc)) {
           es_val_t* argv = ctx->sp - argc;
-          ctx->args  = es_make_args(ctx, closure->env, proc->arity, proc->rest, argc, argv);
+          es_val_t res   = es_fn_apply_argv(ctx, proc, argc, argv);
           pop_n(ctx, argc);
-          ctx->ip = inst + proc->addr;
+          push(ctx, res);
         } else if (es_is_cont(proc)) {
-          // TODO
-          assert(0);
+          if (!vm_resume(ctx, proc, argc)) {
+            pop_n(ctx, argc);
+            push(ctx, es_make_error(ctx, "continuation resumed outside its extent"));
+          }
+        } else if (es_is_generator(proc)) {
+          if (argc != 1 || !vm_yield(ctx, proc, 0)) {
+            pop_n(ctx, argc);
+            push(ctx, es_make_error(ctx, "yield outside its generator"));
+          }
+        } else {
+          pop_n(ctx, argc);
+          push(ctx, es_make_error(ctx, "not a procedure"));
         }
         BREAK;
       }
-      CASE(TAIL_CALL): {
-        int argc = ctx->ip->operand1;
+      CASE(RECEIVE): {
+        es_proc_t* proc  = es_obj_to(es_proc_t*, consts[ctx->ip->operand1]);
+        int        nvars = ctx->ip->operand2;
+        vm_check(ctx, 0);
         ctx->ip++;
-        es_val_t proc = pop(ctx);
-        if (es_is_fn(proc)) {
+        save(ctx);
+        vm_enter(ctx, es_args_val(nvars < 0 ? ctx->args : es_nil), proc, (nvars < 0 ? 0 : nvars) + ctx->values);
+        ctx->values = 1;
+        BREAK;
+      }
+      CASE(TAIL_RECEIVE): {
+        es_proc_t* proc   = es_obj_to(es_proc_t*, consts[ctx->ip->operand1]);
+        int        nvars  = ctx->ip->operand2;
+        es_args_t* parent = es_args_val(nvars < 0 ? ctx->args : es_nil); // Shared frames are on the heap, so not dropped
+        argc = (nvars < 0 ? 0 : nvars) + ctx->values;
+        ctx->values = 1;
+        vm_drop_frame(ctx, argc);
+        vm_enter(ctx, parent, proc, argc);
+        BREAK;
+      }
+      CASE(ITER_END): {
+        // The body of a generator returned through its marker frame
+        es_iter_t* it = es_iter_val(ctx->args);
+        it->pos       = ES_GEN_DONE;
+        it->saved     = es_nil;
+        ctx->sp[-1]   = es_eof_obj;
+        restore(ctx);
+        BREAK;
+      }
+      CASE(APPLY_VALUES):
+        // Returned to through the marker frame of call-with-values, which holds the consumer
+        argc        = ctx->values;
+        callee      = ctx->args;
+        ctx->values = 1;
+        ctx->args   = es_nil;
+        goto tail_call;
+      CASE(TAIL_CALL):
+        argc = ctx->ip->operand1;
+        ctx->ip++;
+        callee = pop(ctx);
+        vm_drop_frame(ctx, argc); // The caller's frame is done with
+      tail_call: {
+        es_val_t proc = callee;
+        if (es_is_closure(proc)) {
+          es_closure_t* closure = es_closure_val(proc);
+          es_proc_t* proc = es_obj_to(es_proc_t*, closure->proc);
+          int addr = proc->addr;
+          if (proc->captures) {
+            es_val_t* argv  = ctx->sp - argc;
+            ctx->args   = es_make_args(ctx, closure->env, proc->arity, proc->rest, argc, argv);
+            pop_n(ctx, argc);
+          } else {
+            ctx->args   = vm_push_frame(ctx, closure->env, proc->arity, proc->rest, argc);
+          }
+          ctx->ip = inst + addr;
+        } else if (argc == 1 && vm_is_capture(proc)) {
+          vm_capture(ctx, proc, 1);
+        } else if (argc != 1 && vm_is_values(proc) && vm_receives(ctx->frames[ctx->fp - 1].knt)) {
+          ctx->values = argc;
+          restore(ctx);
+        } else if (argc == 2 && vm_is_call_with_values(proc)) {
+          vm_call_with_values(ctx, 1);
+        } else if (argc == 1 && vm_is_iterator_next(proc) && es_is_generator(ctx->sp[-1])) {
+          vm_generator_next(ctx, 1);
+        } else if (es_is_fn(proc)) {
           es_val_t* argv = ctx->sp - argc;
           es_val_t res   = es_fn_apply_argv(ctx, proc, argc, argv);
           pop_n(ctx, argc);
           push(ctx, res);
           restore(ctx);
-        } else if (es_is_closure(proc)) {
-          es_closure_t* closure = es_closure_val(proc);
-          es_proc_t* proc = es_obj_to(es_proc_t*, closure->proc);
-          es_val_t* argv  = ctx->sp - argc;
-          ctx->args   = es_make_args(ctx, closure->env, proc->arity, proc->rest, argc, argv);
-          pop_n(ctx, argc);
-          ctx->ip = inst + proc->addr;
         } else if (es_is_cont(proc)) {
-          // TODO
-          assert(0);
+          if (!vm_resume(ctx, proc, argc)) {
+            pop_n(ctx, argc);
+            push(ctx, es_make_error(ctx, "continuation resumed outside its extent"));
+            restore(ctx);
+          }
+        } else if (es_is_generator(proc)) {
+          if (argc != 1 || !vm_yield(ctx, proc, 1)) {
+            pop_n(ctx, argc);
+            push(ctx, es_make_error(ctx, "yield outside its generator"));
+            restore(ctx);
+          }
+        } else {
+          pop_n(ctx, argc);
+          push(ctx, es_make_error(ctx, "not a procedure"));
+          restore(ctx);
         }
         BREAK;
       }
     }
   }
+  #undef consts
   return (void*)es_void;
 }
 
@@ -2554,10 +6748,12 @@ es_val_t es_compile(es_ctx_t* ctx, es_val_t exp)
 {
   int start;
   es_val_t b = ctx->bytecode;
+  ctx->heap.no_gc++; // The compiler holds unrooted references into exp
   start = bytecode_label(b);
   compile(ctx, b, exp, 0, 0, es_nil);
   emit_halt(b);
   int end = bytecode_label(b);
+  ctx->heap.no_gc--;
 
   return es_make_proc(ctx, 0, 0, start, end);
 }
@@ -2566,11 +6762,13 @@ es_val_t es_load(es_ctx_t* ctx, const char* file_name)
 {
   es_val_t exp, port;
   port = es_make_port(ctx, fopen(file_name, "r"));
+  gc_root(ctx, port);
   es_ctx_set_oport(ctx, es_make_port(ctx, stdout));
   while(!es_is_eof_obj(exp = es_port_read(ctx, port))) {
     es_eval(ctx, exp);
   }
   es_port_close(port);
+  gc_unroot(ctx, 1);
   return es_void;
 }
 
@@ -2578,16 +6776,25 @@ es_val_t es_macro_expand(es_ctx_t* ctx, es_val_t exp, es_val_t env);
 es_val_t es_macro_expand_list(es_ctx_t* ctx, es_val_t lst, es_val_t env)
 {
   //es_printf(ctx, "macro-expand-list: %@\n", lst);
-  if (es_is_nil(lst)) {
-    return lst;
-  } else if (es_is_pair(es_cdr(lst))) {
-    return es_cons(ctx,
-      es_macro_expand(ctx, es_car(lst), env),
-      es_macro_expand_list(ctx, es_cdr(lst), env));
-  } else {
-    return es_cons(ctx, es_macro_expand(ctx, es_car(lst), env),
-      es_macro_expand(ctx, es_cdr(lst), env));
+  es_val_t res = es_nil, tail = es_nil, e = es_nil;
+  gc_root4(ctx, lst, env, res, tail);
+  gc_root(ctx, e);
+  while(es_is_pair(lst)) {
+    e = es_macro_expand(ctx, es_car(lst), env);
+    e = es_cons(ctx, e, es_nil);
+    if (es_is_nil(tail)) {
+      res = e;
+    } else {
+      es_set_cdr(ctx, tail, e);
+    }
+    tail = e;
+    lst  = es_cdr(lst);
   }
+  if (!es_is_nil(tail)) {
+    es_set_cdr(ctx, tail, lst);
+  }
+  gc_unroot(ctx, 5);
+  return res;
 }
 
 es_val_t es_macro_expand(es_ctx_t* ctx, es_val_t exp, es_val_t env)
@@ -2601,7 +6808,10 @@ es_val_t es_macro_expand(es_ctx_t* ctx, es_val_t exp, es_val_t env)
     es_val_t val = es_lookup_symbol(ctx, env, op);
     if (es_is_macro(val)) {
       es_val_t trans = es_macro_transformer(val);
-      return es_macro_expand(ctx, es_apply(ctx, trans, es_cdr(exp)), env);
+      gc_root(ctx, env);
+      exp = es_apply(ctx, trans, es_cdr(exp));
+      gc_unroot(ctx, 1);
+      return es_macro_expand(ctx, exp, env);
     } else {
       return es_macro_expand_list(ctx, exp, env);
     }
@@ -2610,12 +6820,73 @@ es_val_t es_macro_expand(es_ctx_t* ctx, es_val_t exp, es_val_t env)
   }
 }
 
+/**
+ * Abandons the computation in progress, for instance when the memory cap
+ * is hit, by unwinding to the outermost es_eval or es_apply which then
+ * returns an error. Without one there is nothing to return the error to
+ * and the process exits.
+ */
+static void vm_abort(es_ctx_t* ctx, char* msg)
+{
+  if (!ctx->abort) {
+    fprintf(stderr, "eva: %s\n", msg);
+    exit(1);
+  }
+  ctx->abort_msg = msg;
+  longjmp(*ctx->abort, 1);
+}
+
+/**
+ * Slow path of vm_check, for a call reaching stack slot sp and frame fp
+ * past the soft limits. Fails past the depth limit, and otherwise lifts
+ * the soft limits to it until ctx_trim_stacks puts them back.
+ */
+static void vm_deepen(es_ctx_t* ctx, es_val_t* sp, int fp)
+{
+  if (sp > ctx->stack + ctx->max_depth || fp >= ctx->max_depth - 2)
+    vm_abort(ctx, "stack overflow");
+  ctx->stack_limit = ctx->stack + ctx->max_depth;
+  ctx->frame_limit = ctx->max_depth - 2;
+}
+
+/**
+ * Puts the VM back in the state it was in before the aborted call: empty
+ * stack and frames, the C roots of the caller, then collects whatever the
+ * computation left behind so the nursery is free for the error.
+ */
+static es_val_t vm_recover(es_ctx_t* ctx, int roots, int no_gc)
+{
+  ctx->abort     = NULL;
+  ctx->sp        = ctx->stack;
+  ctx->fp        = 0;
+  ctx->values    = 1;
+  ctx->ip        = NULL;
+  ctx->args      = es_nil;
+  ctx->roots.top = roots;
+  ctx->heap.no_gc = no_gc;
+  ctx_trim_stacks(ctx);
+  es_gc(ctx);
+  if (!heap_fits(&ctx->heap, 0))
+    es_gc(ctx); // The first one picked semispaces within the cap, the second moves into them
+  return es_make_error(ctx, ctx->abort_msg);
+}
+
 es_val_t es_eval(es_ctx_t* ctx, es_val_t exp)
 {
   struct timeval t0, t1, dt;
+  jmp_buf handler;
+  volatile int roots = ctx->roots.top, no_gc = ctx->heap.no_gc; // Read again after longjmp
 
   es_val_t env, res;
 
+  if (!ctx->abort) {
+    if (setjmp(handler))
+      return vm_recover(ctx, roots, no_gc);
+    ctx->abort = &handler;
+  } else {
+    roots = -1; // Nested in another call, which is the one unwound to
+  }
+
   env = es_ctx_env(ctx);
 
   exp = es_macro_expand(ctx, exp, env);
@@ -2634,18 +6905,39 @@ es_val_t es_eval(es_ctx_t* ctx, es_val_t exp)
   timeval_subtract(&dt, &t1, &t0);
   //printf("time: %f\n", dt.tv_sec * 1000.0 + dt.tv_usec / 1000.0);
 
+  if (roots >= 0) {
+    ctx->abort = NULL;
+    ctx_trim_stacks(ctx);
+  }
   return res;
 }
 
-es_val_t es_apply(es_ctx_t* ctx, es_val_t proc, es_val_t args)
+static int apply_push_args(es_ctx_t* ctx, es_val_t args)
 {
-  es_val_t bc = ctx->bytecode;
   int argc = 0;
   while(!es_is_nil(args)) {
+    vm_check(ctx, 1);
     push(ctx, es_car(args));
     args = es_cdr(args);
     argc++;
   }
+  return argc;
+}
+
+es_val_t es_apply(es_ctx_t* ctx, es_val_t proc, es_val_t args)
+{
+  es_val_t bc = ctx->bytecode;
+  jmp_buf handler;
+  volatile int roots = ctx->roots.top, no_gc = ctx->heap.no_gc; // Read again after longjmp
+
+  if (!ctx->abort) {
+    if (setjmp(handler))
+      return vm_recover(ctx, roots, no_gc);
+    ctx->abort = &handler;
+  } else {
+    roots = -1;
+  }
+  int argc = apply_push_args(ctx, args);
 
   push(ctx, proc);
 
@@ -2657,6 +6949,10 @@ es_val_t es_apply(es_ctx_t* ctx, es_val_t proc, es_val_t args)
 
   es_val_t res = (es_val_t)es_vm_run(ctx, ES_VM_DISPATCH, thunk);
 
+  if (roots >= 0) {
+    ctx->abort = NULL;
+    ctx_trim_stacks(ctx);
+  }
   return res;
 }
 
@@ -2800,8 +7096,10 @@ static es_val_t fn_close(es_ctx_t* ctx, int argc, es_val_t argv[])
 static es_val_t fn_compile(es_ctx_t* ctx, int argc, es_val_t argv[])
 {
   es_val_t b = es_make_bytecode(ctx);
+  ctx->heap.no_gc++;
   compile(ctx, b, argv[0], 0, 0, es_nil);
   emit_halt(b);
+  ctx->heap.no_gc--;
   return b;
 }
 
@@ -2816,14 +7114,16 @@ static es_val_t fn_apply(es_ctx_t* ctx, int argc, es_val_t argv[])
 
   int nargs = 0;
   while (!es_is_nil(args)) {
-    emit_const(b, alloc_const(b, es_car(args)));
+    emit_const(b, alloc_const(ctx, b, es_car(args)));
     args = es_cdr(args);
     nargs++;
   }
 
-  emit_const(b, alloc_const(b, proc));
+  emit_const(b, alloc_const(ctx, b, proc));
   emit_tail_call(b, nargs);
+  vm_check(ctx, nargs + 1);
   save(ctx);
+  ctx->args = es_nil; // The trampoline has no frame of its own for the tail call to drop
   ctx->ip = es_bytecode_val(b)->inst + start;
 
   return es_void;
@@ -2871,6 +7171,87 @@ static es_val_t fn_mem_stats(es_ctx_t* ctx, int argc, es_val_t argv[])
   return es_void;
 }
 
+static es_val_t stat_fixnum(uint64_t value)
+{
+  return es_make_fixnum(value > INT_MAX ? INT_MAX : (int)value);
+}
+
+static es_val_t stats_acons(es_ctx_t* ctx, es_val_t alist, char* name, es_val_t val)
+{
+  es_val_t entry = es_nil;
+  gc_root3(ctx, alist, val, entry);
+  entry = es_cons(ctx, es_symbol_intern(ctx, name), val);
+  alist = es_cons(ctx, entry, alist);
+  gc_unroot(ctx, 3);
+  return alist;
+}
+
+/**
+ * (gc-stats) returns the collector telemetry as an association list.
+ * Ratios are reported in percent and counters saturate at the fixnum range.
+ */
+static es_val_t fn_gc_stats(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  es_gc_stats_t stats;
+  es_val_t hist, alist = es_nil;
+
+  es_gc_stats(ctx, &stats);
+
+  hist = es_make_vector(ctx, ES_GC_PAUSE_BUCKETS);
+  gc_root2(ctx, hist, alist);
+  for(int i = 0; i < ES_GC_PAUSE_BUCKETS; i++) {
+    es_vector_set(ctx, hist, i, stat_fixnum(stats.pause_histogram[i]));
+  }
+  alist = stats_acons(ctx, alist, "alloc-rate",        stat_fixnum(stats.alloc_rate));
+  alist = stats_acons(ctx, alist, "survival-pct",      stat_fixnum(stats.survival_ratio * 100.0));
+  alist = stats_acons(ctx, alist, "last-bytes-copied", stat_fixnum(stats.last_bytes_copied));
+  alist = stats_acons(ctx, alist, "bytes-copied",      stat_fixnum(stats.bytes_copied));
+  alist = stats_acons(ctx, alist, "bytes-allocated",   stat_fixnum(stats.bytes_allocated));
+  alist = stats_acons(ctx, alist, "pause-histogram",   hist);
+  alist = stats_acons(ctx, alist, "max-final-pause-us", stat_fixnum(stats.max_final_pause_us));
+  alist = stats_acons(ctx, alist, "max-step-pause-us", stat_fixnum(stats.max_step_pause_us));
+  alist = stats_acons(ctx, alist, "max-pause-us",      stat_fixnum(stats.max_pause_us));
+  alist = stats_acons(ctx, alist, "last-pause-us",     stat_fixnum(stats.last_pause_us));
+  alist = stats_acons(ctx, alist, "total-pause-us",    stat_fixnum(stats.total_pause_us));
+  alist = stats_acons(ctx, alist, "pauses",            stat_fixnum(stats.pauses));
+  alist = stats_acons(ctx, alist, "full-collections",  stat_fixnum(stats.full_collections));
+  alist = stats_acons(ctx, alist, "minor-collections", stat_fixnum(stats.minor_collections));
+  alist = stats_acons(ctx, alist, "collections",       stat_fixnum(stats.collections));
+  gc_unroot(ctx, 2);
+
+  return alist;
+}
+
+static es_val_t fn_alloc_profile_start(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  es_alloc_profile_start(ctx, es_fixnum_val(argv[0]));
+  return es_void;
+}
+
+static es_val_t fn_alloc_profile_stop(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  es_alloc_profile_stop(ctx);
+  return es_void;
+}
+
+static es_val_t fn_alloc_profile(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  es_alloc_profile_dump(ctx, es_ctx_oport(ctx));
+  return es_void;
+}
+
+static es_val_t fn_heap_census(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  es_heap_census(ctx, es_ctx_oport(ctx));
+  return es_void;
+}
+
+static es_val_t fn_heap_dump(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  char buf[ES_SMALL_STRING_MAX + 1];
+  return es_make_bool(es_heap_dump(ctx, es_string_chars(argv[0], buf)) == 0);
+}
+
 static es_val_t fn_current_input_port(es_ctx_t* ctx, int argc, es_val_t argv[])
 {
   return es_ctx_iport(ctx);
@@ -2886,11 +7267,54 @@ static es_val_t fn_get_proc(es_ctx_t* ctx, int argc, es_val_t argv[])
   return es_closure_val(argv[0])->proc;
 }
 
+/* call/cc and call/ec are carried out by the VM, these only see calls with a wrong argument count */
 static es_val_t fn_call_cc(es_ctx_t* ctx, int argc, es_val_t argv[])
 {
-  es_val_t proc = argv[0];
-  es_val_t k    = es_make_cont(ctx);
-  return k;
+  return es_make_error(ctx, "call/cc expects one procedure");
+}
+
+static es_val_t fn_call_ec(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  return es_make_error(ctx, "call/ec expects one procedure");
+}
+
+/* Only reached where a single value is expected, see vm_receives */
+static es_val_t fn_values(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  return argc > 0 ? argv[0] : es_void;
+}
+
+static es_val_t fn_call_with_values(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  return es_make_error(ctx, "call-with-values expects a producer and a consumer");
+}
+
+static es_val_t fn_make_iterator(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  return es_make_iterator(ctx, argv[0]);
+}
+
+/* Generators are resumed by the VM, see vm_generator_next */
+static es_val_t fn_iterator_next(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  if (argc != 1 || !es_is_iterator(argv[0]))
+    return es_make_error(ctx, "iterator-next expects an iterator");
+  return iter_step(ctx, argv[0]);
+}
+
+static es_val_t fn_is_iterator(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  return es_make_bool(es_is_iterator(argv[0]));
+}
+
+static es_val_t fn_is_eof_obj(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  return es_make_bool(es_is_eof_obj(argv[0]));
+}
+
+static es_val_t fn_is_error(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  return es_make_bool(es_is_error(argv[0]));
 }
 
 static es_val_t fn_load(es_ctx_t* ctx, int argc, es_val_t argv[])
@@ -2918,51 +7342,151 @@ static es_val_t fn_macro_expand(es_ctx_t* ctx, int argc, es_val_t argv[])
   return es_macro_expand(ctx, argv[0], ctx->env);
 }
 
+static es_val_t fn_make_weak_box(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  (void)argc;
+  return es_make_weak_box(ctx, argv[0]);
+}
+
+static es_val_t fn_weak_box_value(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  (void)ctx; (void)argc;
+  return es_weak_box_value(argv[0]);
+}
+
+static es_val_t fn_is_weak_box(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  (void)ctx; (void)argc;
+  return es_make_bool(es_is_weak_box(argv[0]));
+}
+
+static es_val_t fn_make_ephemeron(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  (void)argc;
+  return es_make_ephemeron(ctx, argv[0], argv[1]);
+}
+
+static es_val_t fn_ephemeron_key(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  (void)ctx; (void)argc;
+  return es_ephemeron_key(argv[0]);
+}
+
+static es_val_t fn_ephemeron_value(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  (void)ctx; (void)argc;
+  return es_ephemeron_value(argv[0]);
+}
+
+static es_val_t fn_make_weak_table(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  (void)argc; (void)argv;
+  return es_make_weak_table(ctx);
+}
+
+static es_val_t fn_weak_table_ref(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  (void)argc;
+  return es_weak_table_ref(ctx, argv[0], argv[1], argv[2]);
+}
+
+static es_val_t fn_weak_table_set(es_ctx_t* ctx, int argc, es_val_t argv[])
+{
+  (void)argc;
+  es_weak_table_set(ctx, argv[0], argv[1], argv[2]);
+  return es_void;
+}
+
+typedef struct es_builtin {
+  char*    name;
+  es_pfn_t fn;
+  int      arity;
+} es_builtin_t;
+
+static const es_builtin_t builtins[] = {
+  { "mem-stats",            fn_mem_stats,            0 },
+  { "gc-stats",             fn_gc_stats,             0 },
+  { "alloc-profile-start",  fn_alloc_profile_start,  1 },
+  { "alloc-profile-stop",   fn_alloc_profile_stop,   0 },
+  { "alloc-profile",        fn_alloc_profile,        0 },
+  { "heap-census",          fn_heap_census,          0 },
+  { "heap-dump",            fn_heap_dump,            1 },
+  { "bytecode",             fn_bytecode,             0 },
+  { "global-env",           fn_env,                  0 },
+  { "cons",                 fn_cons,                 2 },
+  { "car",                  fn_car,                  1 },
+  { "cdr",                  fn_cdr,                  1 },
+  { "+",                    fn_add,                  2 },
+  { "-",                    fn_sub,                  2 },
+  { "*",                    fn_mul,                  2 },
+  { "/",                    fn_div,                  2 },
+  { "call/cc",              fn_call_cc,              1 },
+  { "call/ec",              fn_call_ec,              1 },
+  { "call-with-current-continuation", fn_call_cc, 1 },
+  { "call-with-escape-continuation",  fn_call_ec, 1 },
+  { "values",               fn_values,               0 },
+  { "call-with-values",     fn_call_with_values,     2 },
+  { "make-iterator",        fn_make_iterator,        1 },
+  { "iterator-next",        fn_iterator_next,        1 },
+  { "iterator?",            fn_is_iterator,          1 },
+  { "eof-object?",          fn_is_eof_obj,           1 },
+  { "error?",               fn_is_error,             1 },
+  { "compile",              fn_compile,              1 },
+  { "boolean?",             fn_is_bool,              1 },
+  { "symbol?",              fn_is_symbol,            1 },
+  { "char?",                fn_is_char,              1 },
+  { "vector?",              fn_is_vec,               1 },
+  { "procedure?",           fn_is_procedure,         1 },
+  { "pair?",                fn_is_pair,              1 },
+  { "number?",              fn_is_number,            1 },
+  { "string?",              fn_is_string,            1 },
+  { "port?",                fn_is_port,              1 },
+  { "null?",                fn_is_null,              2 },
+  { "=",                    fn_is_num_eq,            2 },
+  { "eq?",                  fn_is_eq,                2 },
+  { "quit",                 fn_quit,                 2 },
+  { "gc",                   fn_gc,                   0 },
+  { "write",                fn_write,                2 },
+  { "read-char",            fn_read_char,            2 },
+  { "close",                fn_close,                1 },
+  { "eval",                 fn_eval,                 1 },
+  { "apply",                fn_apply,                2 },
+  { "vector-ref",           fn_vec_ref,              2 },
+  { "make-string",          fn_make_string,          2 },
+  { "string-ref",           fn_string_ref,           2 },
+  { "current-input-port",   fn_current_input_port,   0 },
+  { "current-output-port",  fn_current_output_port,  0 },
+  { "get-proc",             fn_get_proc,             1 },
+  { "macro",                fn_make_macro,           1 },
+  { "macro-transformer",    fn_macro_transformer,    1 },
+  { "gensym",               fn_gensym,               0 },
+  { "macro-expand",         fn_macro_expand,         1 },
+  { "make-weak-box",        fn_make_weak_box,        1 },
+  { "weak-box-value",       fn_weak_box_value,       1 },
+  { "weak-box?",            fn_is_weak_box,          1 },
+  { "make-ephemeron",       fn_make_ephemeron,       2 },
+  { "ephemeron-key",        fn_ephemeron_key,        1 },
+  { "ephemeron-value",      fn_ephemeron_value,      1 },
+  { "make-weak-table",      fn_make_weak_table,      0 },
+  { "weak-table-ref",       fn_weak_table_ref,       3 },
+  { "weak-table-set!",      fn_weak_table_set,       3 },
+};
+
+/* Registers the builtins, so that images can refer to them before any context defines them */
+static void natives_init(void)
+{
+  for(size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+    es_register_fn(builtins[i].name, builtins[i].fn);
+  }
+}
+
 static void ctx_init_env(es_ctx_t* ctx)
 {
   ctx->env = es_make_env(ctx, ES_GLOBAL_ENV_SIZE);
 
-  es_define_fn(ctx, "mem-stats",           fn_mem_stats,           0);
-  es_define_fn(ctx, "bytecode",            fn_bytecode,            0);
-  es_define_fn(ctx, "global-env",          fn_env,                 0);
-  es_define_fn(ctx, "cons",                fn_cons,                2);
-  es_define_fn(ctx, "car",                 fn_car,                 1);
-  es_define_fn(ctx, "cdr",                 fn_cdr,                 1);
-  es_define_fn(ctx, "+",                   fn_add,                 2);
-  es_define_fn(ctx, "-",                   fn_sub,                 2);
-  es_define_fn(ctx, "*",                   fn_mul,                 2);
-  es_define_fn(ctx, "/",                   fn_div,                 2);
-  es_define_fn(ctx, "call/cc",             fn_call_cc,             1);
-  es_define_fn(ctx, "compile",             fn_compile,             1);
-  es_define_fn(ctx, "boolean?",            fn_is_bool,             1);
-  es_define_fn(ctx, "symbol?",             fn_is_symbol,           1);
-  es_define_fn(ctx, "char?",               fn_is_char,             1);
-  es_define_fn(ctx, "vector?",             fn_is_vec,              1);
-  es_define_fn(ctx, "procedure?",          fn_is_procedure,        1);
-  es_define_fn(ctx, "pair?",               fn_is_pair,             1);
-  es_define_fn(ctx, "number?",             fn_is_number,           1);
-  es_define_fn(ctx, "string?",             fn_is_string,           1);
-  es_define_fn(ctx, "port?",               fn_is_port,             1);
-  es_define_fn(ctx, "null?",               fn_is_null,             2);
-  es_define_fn(ctx, "=",                   fn_is_num_eq,           2);
-  es_define_fn(ctx, "eq?",                 fn_is_eq,               2);
-  es_define_fn(ctx, "quit",                fn_quit,                2);
-  es_define_fn(ctx, "gc",                  fn_gc,                  0);
-  es_define_fn(ctx, "write",               fn_write,               2);
-  es_define_fn(ctx, "read-char",           fn_read_char,           2);
-  es_define_fn(ctx, "close",               fn_close,               1);
-  es_define_fn(ctx, "eval",                fn_eval,                1);
-  es_define_fn(ctx, "apply",               fn_apply,               2);
-  es_define_fn(ctx, "vector-ref",          fn_vec_ref,             2);
-  es_define_fn(ctx, "make-string",         fn_make_string,         2);
-  es_define_fn(ctx, "string-ref",          fn_string_ref,          2);
-  es_define_fn(ctx, "current-input-port",  fn_current_input_port,  0);
-  es_define_fn(ctx, "current-output-port", fn_current_output_port, 0);
-  es_define_fn(ctx, "get-proc",            fn_get_proc,            1);
-  es_define_fn(ctx, "macro",               fn_make_macro,          1);
-  es_define_fn(ctx, "macro-transformer",   fn_macro_transformer,   1);
-  es_define_fn(ctx, "gensym",              fn_gensym,              0);
-  es_define_fn(ctx, "macro-expand",        fn_macro_expand,        1);
+  for(size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+    es_define_fn(ctx, builtins[i].name, builtins[i].fn, builtins[i].arity);
+  }
 
   es_load(ctx, "eva.scm");
 }
@@ -2983,16 +7507,16 @@ int main()
   es_printf(ctx, "'--------------'\n\n");
 
   es_val_t val = es_undefined;
-
-  es_gc(ctx);
+  int      done;
 
   do {
     es_printf(ctx, "eva> ");
-    val = es_read(ctx);
-    val = es_eval(ctx, val);
+    val  = es_read(ctx);
+    done = es_is_eof_obj(val); // Not the result, iterators return the eof object too
+    val  = es_eval(ctx, val);
     es_printf(ctx, "%@\n", val);
-    es_gc(ctx);
-  } while (!es_is_eof_obj(val));
+    es_gc_maybe(ctx);
+  } while (!done);
 
   es_ctx_free(ctx);
 
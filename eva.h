@@ -67,9 +67,29 @@ enum es_type {
   ES_CONT_TYPE,
   ES_MACRO_TYPE,
   ES_BUFFER_TYPE,
-  ES_ERROR_TYPE
+  ES_ERROR_TYPE,
+  ES_WEAK_TYPE,
+  ES_EPHEMERON_TYPE,
+  ES_ITERATOR_TYPE
 };
 
+//=====================
+// Value tags
+//=====================
+#define ES_TAG_BITS 3
+#define ES_TAG_MASK ((1 << ES_TAG_BITS) - 1)
+
+typedef enum es_tag {
+  ES_OBJ_TAG     = 0x0, /**< b000 - Heap allocated object */
+  ES_FIXNUM_TAG  = 0x1, /**< b001 - Fixnums */
+  ES_SYMBOL_TAG  = 0x2, /**< b010 - Symbols tag */
+  ES_VALUE_TAG   = 0x3, /**< b011 - Immediate values: Nil, EOF, Unspecified, Unbound */
+  ES_BOOL_TAG    = 0x4, /**< b100 - Symbol tag */
+  ES_CHAR_TAG    = 0x5, /**< b101 - Character tag */
+  ES_PAIR_TAG    = 0x6, /**< b110 - Heap allocated pair */
+  ES_CLOSURE_TAG = 0x7, /**< b111 - Heap allocated closure */
+} es_tag_t;
+
 extern const es_val_t es_nil;
 extern const es_val_t es_true;
 extern const es_val_t es_false;
@@ -78,10 +98,47 @@ extern const es_val_t es_void;
 extern const es_val_t es_unbound;
 extern const es_val_t es_undefined;
 
+/* Heap sizing policy, sizes count both semispaces unless compacting */
+typedef struct es_heap_config {
+  size_t   initial_size;  /* Initial heap size in bytes */
+  size_t   max_size;      /* Upper bound on heap growth in bytes, 0 if unbounded */
+  double   growth_factor; /* Factor the heap grows or shrinks by on resize */
+  unsigned max_pause_us;  /* Collect incrementally, each step targeting this pause, 0 to stop the world. The final pause of a cycle is not bounded */
+  int      compact;       /* Mark and compact the old space in place instead of copying it */
+  int      gc_threads;    /* Threads sharing full copying collections, 0 or 1 to copy serially */
+  size_t   max_memory;    /* Cap on all the memory held by the heap in bytes, 0 if unbounded. Evaluations hitting it return an error */
+  int      max_depth;     /* Bound on both call frames and value stack slots, 0 for the default of 2^20. Each nested call takes a frame and a few slots. Evaluations past it return a stack overflow error */
+} es_heap_config_t;
+
+#define ES_GC_PAUSE_BUCKETS 20
+
+/* Collector telemetry, cumulative since the context was created */
+typedef struct es_gc_stats {
+  uint64_t collections;       /* Minor and full collections */
+  uint64_t minor_collections; /* Nursery evacuations */
+  uint64_t full_collections;  /* Full collections, including finished incremental cycles */
+  uint64_t pauses;            /* Pauses, including incremental slices */
+  uint64_t total_pause_us;    /* Sum of all pauses in microseconds */
+  uint64_t last_pause_us;     /* Most recent pause in microseconds */
+  uint64_t max_pause_us;      /* Longest pause in microseconds */
+  uint64_t max_step_pause_us; /* Longest allocation pause running an incremental step, its minor collection included */
+  uint64_t max_final_pause_us; /* Longest allocation pause finishing an incremental cycle, which max_pause_us does not bound */
+  uint64_t pause_histogram[ES_GC_PAUSE_BUCKETS]; /* Bucket 0 counts pauses under 1us, bucket i under 2^i us, the last one the rest */
+  uint64_t bytes_allocated;   /* Bytes requested by the mutator */
+  uint64_t bytes_copied;      /* Bytes moved by all collections */
+  uint64_t last_bytes_copied; /* Bytes moved by the most recent collection */
+  double   survival_ratio;    /* Fraction of condemned bytes that survived the most recent collection */
+  double   alloc_rate;        /* Bytes allocated per second between the two most recent collections */
+} es_gc_stats_t;
+
 //=====================
 // Context
 //=====================
 es_ctx_t* es_ctx_new(size_t heap_size);
+es_ctx_t* es_ctx_new_config(const es_heap_config_t* config);
+es_ctx_t* es_ctx_clone(es_ctx_t* ctx);
+es_ctx_t* es_ctx_load_image(const char* path, const es_heap_config_t* config);
+int       es_ctx_save_image(es_ctx_t* ctx, const char* path);
 void      es_ctx_free(es_ctx_t* ctx);
 es_val_t  es_ctx_iport(es_ctx_t* ctx);
 es_val_t  es_ctx_oport(es_ctx_t* ctx);
@@ -107,11 +164,15 @@ es_val_t  es_make_port(es_ctx_t* ctx, FILE* stream);
 es_val_t  es_make_bytecode(es_ctx_t* ctx);
 es_val_t  es_make_error(es_ctx_t* ctx, char* msg);
 es_val_t  es_make_symbol(int id);
-es_val_t  es_make_cont(es_ctx_t* ctx);
+es_val_t  es_make_cont(es_ctx_t* ctx); /* Deprecated, returns an error: continuations are only captured by call/cc and call/ec */
 es_val_t  es_make_macro(es_ctx_t* ctx, es_val_t trans);
 es_val_t  es_make_env(es_ctx_t* ctx, int size);
 es_val_t  es_make_fn(es_ctx_t* ctx, int arity, es_pfn_t pcfn);
 es_val_t  es_make_buffer(es_ctx_t* ctx, size_t size);
+es_val_t  es_make_weak_box(es_ctx_t* ctx, es_val_t val);
+es_val_t  es_make_ephemeron(es_ctx_t* ctx, es_val_t key, es_val_t val);
+es_val_t  es_make_weak_table(es_ctx_t* ctx);
+es_val_t  es_make_iterator(es_ctx_t* ctx, es_val_t source);
 es_val_t  es_symbol_intern(es_ctx_t* ctx, const char* cstr);
 es_val_t  es_symbol_to_string(es_ctx_t* ctx, es_val_t val);
 es_val_t  es_gensym(es_ctx_t* ctx);
@@ -120,18 +181,19 @@ es_val_t  es_gensym(es_ctx_t* ctx);
 // Predicates
 //=====================
 int       es_is_eq(es_val_t val1, es_val_t val2);
-int       es_is_pair(es_val_t val);
-int       es_is_fixnum(es_val_t val);
+/* Pairs, closures, fixnums and symbols are recognised from the tag alone */
+static inline int es_is_pair(es_val_t val)    { return ES_PAIR_TAG    == (val & ES_TAG_MASK); }
+static inline int es_is_closure(es_val_t val) { return ES_CLOSURE_TAG == (val & ES_TAG_MASK); }
+static inline int es_is_fixnum(es_val_t val)  { return ES_FIXNUM_TAG  == (val & ES_TAG_MASK); }
+static inline int es_is_symbol(es_val_t val)  { return ES_SYMBOL_TAG  == (val & ES_TAG_MASK); }
 int       es_is_char(es_val_t val);
 int       es_is_nil(es_val_t val);
 int       es_is_boolean(es_val_t val);
 int       es_is_string(es_val_t val);
 int       es_is_true(es_val_t val);
 int       es_is_vector(es_val_t val);
-int       es_is_closure(es_val_t val);
 int       es_is_port(es_val_t val);
 int       es_is_error(es_val_t val);
-int       es_is_symbol(es_val_t val);
 int       es_is_eof_obj(es_val_t val);
 int       es_is_fn(es_val_t val);
 int       es_is_proc(es_val_t val);
@@ -140,6 +202,9 @@ int       es_is_bytecode(es_val_t val);
 int       es_is_unspecified(es_val_t val);
 int       es_is_unbound(es_val_t val);
 int       es_is_macro(es_val_t val);
+int       es_is_weak_box(es_val_t val);
+int       es_is_ephemeron(es_val_t val);
+int       es_is_iterator(es_val_t val);
 
 //=====================
 // Selectors
@@ -148,11 +213,15 @@ es_type_t es_type_of(es_val_t val);
 size_t    es_size_of(es_val_t val);
 es_val_t  es_pair_car(es_val_t pair);
 es_val_t  es_pair_cdr(es_val_t pair);
-void      es_pair_set_head(es_val_t pair, es_val_t val);
-void      es_pair_set_tail(es_val_t pair, es_val_t val);
+/* Stores take the context since the generational collector was added: old
+   objects written with young references are remembered for the next minor
+   collection. Callers of the former ctx-less forms must pass their context,
+   writing the fields directly is not safe. */
+void      es_pair_set_head(es_ctx_t* ctx, es_val_t pair, es_val_t val);
+void      es_pair_set_tail(es_ctx_t* ctx, es_val_t pair, es_val_t val);
 es_val_t  es_list_argv(es_ctx_t* ctx, int argc, es_val_t* argv);
 int       es_list_length(es_val_t list);
-void      es_vector_set(es_val_t vec, int idx, es_val_t val);
+void      es_vector_set(es_ctx_t* ctx, es_val_t vec, int idx, es_val_t val);
 es_val_t  es_vector_ref(es_val_t vec, int idx);
 int       es_vector_len(es_val_t vec);
 int       es_string_ref(es_val_t str, int k);
@@ -160,6 +229,12 @@ int       es_fixnum_val(es_val_t val);
 int       es_bool_val(es_val_t val);
 int       es_char_val(es_val_t val);
 int       es_symbol_val(es_val_t val);
+es_val_t  es_weak_box_value(es_val_t box);
+es_val_t  es_ephemeron_key(es_val_t eph);
+es_val_t  es_ephemeron_value(es_val_t eph);
+es_val_t  es_weak_table_ref(es_ctx_t* ctx, es_val_t table, es_val_t key, es_val_t fallback);
+void      es_weak_table_set(es_ctx_t* ctx, es_val_t table, es_val_t key, es_val_t val);
+int       es_weak_table_count(es_ctx_t* ctx, es_val_t table);
 
 //=====================
 // Numerics
@@ -196,6 +271,7 @@ es_val_t  es_port_printf(es_ctx_t* ctx, es_val_t port, const char* fmt, ...);
 //=====================
 es_val_t  es_define(es_ctx_t* ctx, char* name, es_val_t value);
 es_val_t  es_define_fn(es_ctx_t* ctx, char* name, es_pfn_t fn, int arity);
+void      es_register_fn(const char* name, es_pfn_t fn);
 es_val_t  es_define_symbol(es_ctx_t* ctx, es_val_t env, es_val_t symbol, es_val_t value);
 es_val_t  es_lookup_symbol(es_ctx_t* ctx, es_val_t env, es_val_t sym);
 
@@ -210,6 +286,17 @@ es_val_t  es_load(es_ctx_t* ctx, const char* file_name);
 // GC
 //=====================
 void      es_gc(es_ctx_t* ctx);
+void      es_gc_minor(es_ctx_t* ctx);
+void      es_gc_stats(es_ctx_t* ctx, es_gc_stats_t* stats);
+int       es_gc_maybe(es_ctx_t* ctx);
+int       es_gc_hint(es_ctx_t* ctx, unsigned idle_us);
+void      es_region_begin(es_ctx_t* ctx);
+void      es_region_end(es_ctx_t* ctx);
+void      es_alloc_profile_start(es_ctx_t* ctx, size_t sample_bytes);
+void      es_alloc_profile_stop(es_ctx_t* ctx);
+void      es_alloc_profile_dump(es_ctx_t* ctx, es_val_t port);
+void      es_heap_census(es_ctx_t* ctx, es_val_t port);
+int       es_heap_dump(es_ctx_t* ctx, const char* path);
 void      es_gc_root_p(es_ctx_t* ctx, es_val_t* pv);
 void      es_gc_unroot(es_ctx_t* ctx, int n);
 #define   es_gc_root(c, v) es_gc_root_p(c, (es_val_t*)&(v))
@@ -226,8 +313,8 @@ void      es_gc_unroot(es_ctx_t* ctx, int n);
 #define es_cdadr(e)           es_cdr(es_cadr(e))
 #define es_cdddr(e)           es_cdr(es_cddr(e))
 #define es_cadddr(e)          es_car(es_cdddr(e))
-#define es_set_car(e, v)      es_pair_set_head(e, v)
-#define es_set_cdr(e, v)      es_pair_set_tail(e, v)
+#define es_set_car(c, e, v)   es_pair_set_head(c, e, v)
+#define es_set_cdr(c, e, v)   es_pair_set_tail(c, e, v)
 
 #ifdef __cplusplus
   }
@@ -101,6 +101,20 @@
         (begin (fun (car lst))
                (for-each fun (cdr lst))))))
 
+;;;======================================================================
+;;; iterator-for-each
+;;; Usage (iterator-for-each <proc> <iterator>) applies <proc> to each value
+;;; pulled from <iterator> until it returns the eof object, or returns the
+;;; error <iterator> failed with
+;;;======================================================================
+(define iterator-for-each (lambda (fun it)
+    (receive (x) (iterator-next it)
+        (if (error? x)
+            x
+            (if (not (eof-object? x))
+                (begin (fun x)
+                       (iterator-for-each fun it)))))))
+
 ;;;======================================================================
 ;;; unzip-list
 ;;; Usage: (unzip-list '((k1 v1) (k2 v2) ...)) => ((k1 k2 ...) (v1 v2 ...))
@@ -46,6 +46,1150 @@ onfail:
   es_ctx_free(ctx);
 }
 
+void test_gc_minor() {
+  es_ctx_t* ctx = es_ctx_new(64 * MB);
+
+  es_val_t old = es_make_pair(ctx, es_nil, es_nil);
+  es_gc_root(ctx, old);
+  es_gc(ctx);
+
+  es_set_car(ctx, old, es_make_pair(ctx, es_make_fixnum(42), es_nil));
+  es_gc_minor(ctx);
+
+  es_assert("old object should be tenured", !heap_in_nursery(&ctx->heap, old));
+  es_assert("young object should be promoted", !heap_in_nursery(&ctx->heap, es_car(old)));
+  es_assert("remembered reference should survive a minor gc", es_fixnum_val(es_caar(old)) == 42);
+
+  for(int i = 0; i < 1000000; i++) {
+    es_make_pair(ctx, es_make_fixnum(i), es_nil);
+  }
+
+  es_assert("rooted object should survive nursery churn", es_fixnum_val(es_caar(old)) == 42);
+
+onfail:
+  es_gc_unroot(ctx, 1);
+  es_ctx_free(ctx);
+}
+
+void test_region() {
+  es_heap_config_t compact = { 4 * MB, 64 * MB, 2.0, 0, 1 };
+  es_ctx_t* ctx = es_ctx_new(64 * MB), *cctx = es_ctx_new_config(&compact);
+  es_gc_stats_t before, after;
+  es_val_t kept = es_nil, lst = es_nil;
+  es_gc_root(ctx, kept);
+  es_gc_root(cctx, lst);
+
+  es_gc(ctx);
+  es_gc_stats(ctx, &before);
+  es_region_begin(ctx);
+  for(int i = 0; i < 1000000; i++) {
+    es_make_pair(ctx, es_make_fixnum(i), es_nil);
+  }
+  kept = es_make_pair(ctx, es_make_fixnum(1), es_nil);
+  es_assert("region objects should not be in the nursery", heap_in_young(&ctx->heap, kept) && !heap_in_nursery(&ctx->heap, kept));
+  es_define(ctx, "escaped", es_make_pair(ctx, es_make_fixnum(2), es_nil));
+  es_region_begin(ctx);
+  es_make_vector(ctx, 16);
+  es_region_end(ctx);
+  es_gc_stats(ctx, &after);
+  es_assert("region should not be collected while it is open", after.collections == before.collections);
+  es_region_end(ctx);
+  es_gc_stats(ctx, &after);
+
+  es_assert("ending a region should run one minor collection", after.minor_collections == before.minor_collections + 1);
+  es_assert("region garbage should not be copied", after.last_bytes_copied < 1024);
+  es_assert("rooted region object should be promoted", !heap_in_young(&ctx->heap, kept) && es_fixnum_val(es_car(kept)) == 1);
+  es_val_t escaped = es_lookup_symbol(ctx, es_ctx_env(ctx), es_symbol_intern(ctx, "escaped"));
+  es_assert("escaped region object should be promoted", !heap_in_young(&ctx->heap, escaped) && es_fixnum_val(es_car(escaped)) == 2);
+  es_assert("region should be empty after it ends", region_used(&ctx->heap) == 0);
+  es_assert("stores outside a region should not consult its chunks", ctx->heap.region && ctx->heap.region_depth == 0 &&
+            !heap_in_young(&ctx->heap, es_obj_to_val(ctx->heap.region->start)));
+
+  es_region_begin(cctx);
+  for(int i = 0; i < 100000; i++) {
+    lst = es_make_pair(cctx, es_make_fixnum(i), lst);
+    es_make_pair(cctx, es_nil, es_nil);
+  }
+  es_gc(cctx);
+  es_assert("compaction inside a region should keep region objects", es_list_length(lst) == 100000 && es_fixnum_val(es_car(lst)) == 99999);
+  lst = es_make_pair(cctx, es_make_fixnum(-1), lst);
+  es_region_end(cctx);
+  es_assert("region list should survive its end", es_list_length(lst) == 100001 && !heap_in_young(&cctx->heap, lst));
+
+onfail:
+  es_gc_unroot(ctx, 1);
+  es_gc_unroot(cctx, 1);
+  es_ctx_free(ctx);
+  es_ctx_free(cctx);
+}
+
+void test_heap_resize() {
+  es_heap_config_t config = { 2 * MB, 64 * MB, 2.0 };
+  es_ctx_t* ctx = es_ctx_new_config(&config);
+  size_t initial = ctx->heap.size;
+
+  es_val_t lst = es_nil;
+  es_gc_root(ctx, lst);
+  for(int i = 0; i < 200000; i++) {
+    lst = es_make_pair(ctx, es_make_fixnum(i), lst);
+  }
+
+  es_assert("heap should grow past its initial size", ctx->heap.size > initial);
+  es_assert("heap should stay within its maximum size", ctx->heap.size <= 32 * MB);
+  es_assert("live data should survive heap growth", es_list_length(lst) == 200000);
+
+  lst = es_nil;
+  for(int i = 0; i < 16; i++) {
+    es_gc(ctx);
+  }
+
+  es_assert("heap should shrink when occupancy stays low", ctx->heap.size < 4 * initial);
+
+onfail:
+  es_gc_unroot(ctx, 1);
+  es_ctx_free(ctx);
+}
+
+void test_obj_header() {
+  es_ctx_t* ctx = es_ctx_new(64 * MB);
+  es_gc_stats_t stats;
+
+  es_val_t lst = es_nil;
+  es_gc_root(ctx, lst);
+
+  es_assert("pairs should take a header word and two fields", es_size_of(es_make_pair(ctx, es_nil, es_nil)) == 3 * sizeof(es_val_t));
+
+  es_obj_t obj;
+  obj.header = obj_header(ES_CLOSURE_TYPE, 0);
+  obj_hdr_set_flags(&obj, ES_OBJ_REMEMBERED | ES_OBJ_MARKED);
+  obj_hdr_set_reloc(&obj, &lst);
+  obj_hdr_clear_flags(&obj, ES_OBJ_REMEMBERED);
+  es_assert("header should keep the type next to the forwarding address", obj_hdr_type(&obj) == ES_CLOSURE_TYPE);
+  es_assert("header should keep flags next to the forwarding address", obj_hdr_flags(&obj) == ES_OBJ_MARKED);
+  es_assert("header should keep the forwarding address", obj_hdr_reloc(&obj) == (es_obj_t*)&lst);
+  obj_hdr_reset(&obj);
+  es_assert("reset header should only keep the type", obj.header == obj_header(ES_CLOSURE_TYPE, 0));
+
+  for(int i = 0; i < 100000; i++) {
+    lst = es_make_pair(ctx, es_make_fixnum(i), lst);
+  }
+  es_gc(ctx);
+  es_gc_stats(ctx, &stats);
+  es_assert("full collection should copy three words per live pair",
+            stats.last_bytes_copied < 100000 * 3 * sizeof(es_val_t) + MB && es_list_length(lst) == 100000);
+
+onfail:
+  es_gc_unroot(ctx, 1);
+  es_ctx_free(ctx);
+}
+
+void test_gc_incremental() {
+  es_heap_config_t config = { 32 * MB, 32 * MB, 2.0, 200 };
+  es_ctx_t* ctx = es_ctx_new_config(&config);
+  es_gc_stats_t stats;
+  int cycles = 0, ok = 1;
+
+  es_val_t vec = es_make_vector(ctx, 1000);
+  es_val_t lst = es_nil;
+  es_val_t tmp = es_nil;
+  es_gc_root(ctx, vec);
+  es_gc_root(ctx, lst);
+  es_gc_root(ctx, tmp);
+
+  for(int i = 0; i < 200000; i++) {
+    lst = es_make_pair(ctx, es_make_fixnum(i), lst);
+  }
+
+  for(int n = 0; n < 2000000; n++) {
+    int i = n % 1000, j = (n * 7) % 1000;
+    tmp = es_make_pair(ctx, es_make_fixnum(n), es_nil);
+    tmp = es_make_pair(ctx, es_make_fixnum(i), tmp);
+    es_vector_set(ctx, vec, i, tmp);
+    if (n >= 1000 && n % 3 == 0) {
+      tmp = es_make_pair(ctx, es_make_fixnum(j + 1000 * (n % 1000)), es_nil);
+      es_set_cdr(ctx, es_vector_ref(vec, j), tmp);
+    }
+    cycles += ctx->heap.inc_active;
+  }
+  while(ctx->heap.inc_active && es_gc_hint(ctx, 1000000))
+    ;
+  es_gc_stats(ctx, &stats);
+  es_gc(ctx);
+
+  for(int i = 0; i < 1000; i++) {
+    es_val_t cell = es_vector_ref(vec, i);
+    ok = ok && es_fixnum_val(es_car(cell)) == i && es_fixnum_val(es_cadr(cell)) % 1000 == i;
+  }
+
+  es_assert("incremental cycles should run", cycles > 0);
+  es_assert("mutations during a cycle should survive", ok);
+  es_assert("old data should survive incremental cycles", es_list_length(lst) == 200000);
+  es_assert("incremental steps should report their pauses", stats.max_step_pause_us > 0 && stats.max_step_pause_us <= stats.total_pause_us);
+  es_assert("idle time should finish the cycle", stats.full_collections > 0);
+  es_assert("final pauses of cycles should be reported apart", stats.max_final_pause_us > 0);
+
+onfail:
+  es_gc_unroot(ctx, 3);
+  es_ctx_free(ctx);
+}
+
+void test_gc_compact() {
+  es_heap_config_t config = { 8 * MB, 0, 2.0, 0, 1 };
+  es_ctx_t* ctx = es_ctx_new_config(&config);
+  int ok = 1;
+
+  es_val_t vec = es_make_vector(ctx, 1000);
+  es_val_t lst = es_nil;
+  es_gc_root(ctx, vec);
+  es_gc_root(ctx, lst);
+
+  es_assert("compacting heap should not allocate a to space", ctx->heap.to_buffer == NULL);
+  es_assert("compacting heap should use its whole size", ctx->heap.size >= 8 * MB);
+
+  for(int n = 0; n < 1000000; n++) {
+    es_vector_set(ctx, vec, n % 1000, es_make_pair(ctx, es_make_fixnum(n), es_nil));
+    if (n % 10 == 0) {
+      lst = es_make_pair(ctx, es_make_fixnum(n), lst);
+    }
+  }
+  es_gc(ctx);
+
+  for(int i = 0; i < 1000; i++) {
+    ok = ok && es_fixnum_val(es_car(es_vector_ref(vec, i))) == 999000 + i;
+  }
+
+  es_assert("compaction should preserve live objects", ok);
+  es_assert("compaction should preserve list structure", es_list_length(lst) == 100000 && es_fixnum_val(es_car(lst)) == 999990);
+  es_assert("compacted heap should hold little more than live data",
+            ctx->heap.next - ctx->heap.from_space < (100000 + 1000) * 2 * sizeof(es_pair_t) + MB);
+
+  lst = es_nil;
+  for(int i = 0; i < 16; i++) {
+    es_gc(ctx);
+  }
+
+  es_assert("vector should survive repeated compaction", es_fixnum_val(es_car(es_vector_ref(vec, 7))) == 999007);
+
+onfail:
+  es_gc_unroot(ctx, 2);
+  es_ctx_free(ctx);
+}
+
+void test_gc_parallel() {
+  es_heap_config_t config = { 64 * MB, 0, 2.0, 0, 0, 4 };
+  es_ctx_t* ctx = es_ctx_new_config(&config);
+  int ok = 1;
+
+  es_val_t vec  = es_make_vector(ctx, 10000);
+  es_val_t lst  = es_nil, weak = es_nil;
+  es_gc_root(ctx, vec);
+  es_gc_root(ctx, lst);
+  es_gc_root(ctx, weak);
+
+  for(int n = 0; n < 200000; n++) {
+    lst = es_make_pair(ctx, es_make_fixnum(n), lst);
+    if (n % 20 == 0) {
+      es_vector_set(ctx, vec, n / 20, lst);
+    }
+  }
+  weak = es_make_weak_box(ctx, es_make_pair(ctx, es_nil, es_nil));
+
+  for(int i = 0; i < 4; i++) {
+    es_gc(ctx);
+  }
+
+  for(int i = 0; i < 10000; i++) {
+    ok = ok && es_fixnum_val(es_car(es_vector_ref(vec, i))) == i * 20;
+  }
+  es_assert("parallel copying should preserve shared structure", ok);
+  es_assert("parallel copying should preserve list structure", es_list_length(lst) == 200000 && es_fixnum_val(es_car(lst)) == 199999);
+  es_assert("parallel copying should clear dead weak references", es_weak_box_value(weak) == es_false);
+
+  char* scan = ctx->heap.from_space;
+  while(scan < ctx->heap.next) {
+    scan = alignp(scan + es_size_of(es_obj_to_val(scan)), ES_DEFAULT_ALIGNMENT);
+  }
+  es_assert("parallel copying should leave the heap walkable", scan == ctx->heap.next);
+
+onfail:
+  es_gc_unroot(ctx, 3);
+  es_ctx_free(ctx);
+}
+
+void test_gc_stats() {
+  es_ctx_t* ctx = es_ctx_new(64 * MB);
+  es_gc_stats_t stats;
+  uint64_t bucketed = 0;
+
+  es_val_t keep = es_nil;
+  es_gc_root(ctx, keep);
+  for(int i = 0; i < 2000000; i++) {
+    es_val_t p = es_make_pair(ctx, es_make_fixnum(i), es_nil);
+    if (i % 100 == 0) {
+      keep = es_make_pair(ctx, p, keep);
+    }
+  }
+  es_gc(ctx);
+  es_gc_stats(ctx, &stats);
+
+  for(int i = 0; i < ES_GC_PAUSE_BUCKETS; i++) {
+    bucketed += stats.pause_histogram[i];
+  }
+
+  es_assert("minor collections should be counted", stats.minor_collections > 0);
+  es_assert("full collections should be counted", stats.full_collections == 1);
+  es_assert("collections should add up", stats.collections == stats.minor_collections + stats.full_collections);
+  es_assert("every pause should land in the histogram", bucketed == stats.pauses);
+  es_assert("pause times should be consistent", stats.last_pause_us <= stats.max_pause_us && stats.max_pause_us <= stats.total_pause_us);
+  es_assert("allocated bytes should be counted", stats.bytes_allocated >= 2000000 * sizeof(es_pair_t));
+  es_assert("copied bytes should be counted", stats.bytes_copied >= stats.last_bytes_copied && stats.last_bytes_copied > 0);
+  es_assert("survival ratio should be a fraction", stats.survival_ratio > 0.0 && stats.survival_ratio <= 1.0);
+  es_assert("allocation rate should be measured", stats.alloc_rate > 0.0);
+
+  es_val_t fn = es_lookup_symbol(ctx, es_ctx_env(ctx), es_symbol_intern(ctx, "gc-stats"));
+  es_val_t alist = es_apply(ctx, fn, es_nil);
+
+  es_assert("gc-stats should return an association list", es_is_pair(alist) && es_is_pair(es_car(alist)));
+  es_assert("gc-stats should report the collection count",
+            es_caar(alist) == es_symbol_intern(ctx, "collections") && es_fixnum_val(es_cdar(alist)) == (int)stats.collections);
+
+onfail:
+  es_gc_unroot(ctx, 1);
+  es_ctx_free(ctx);
+}
+
+void test_gc_policy() {
+  es_ctx_t* ctx = es_ctx_new(64 * MB);
+  es_gc_stats_t before, after;
+  es_val_t lst = es_nil;
+  es_gc_root(ctx, lst);
+
+  es_gc(ctx);
+  es_assert("collecting right after a full collection should not be worthwhile", !es_gc_maybe(ctx));
+
+  for(int i = 0; i < 400000; i++) {
+    lst = es_make_pair(ctx, es_make_fixnum(i), lst);
+  }
+  lst = es_nil;
+  es_gc_stats(ctx, &before);
+  es_assert("a grown old space should be worth collecting", es_gc_maybe(ctx));
+  es_gc_stats(ctx, &after);
+  es_assert("worthwhile collection should be a full one", after.full_collections == before.full_collections + 1);
+  es_assert("nothing should be worth collecting twice in a row", !es_gc_maybe(ctx));
+
+  while((size_t)(ctx->heap.nursery_next - ctx->heap.nursery) * 2 < ctx->heap.nursery_size) {
+    es_make_pair(ctx, es_nil, es_nil);
+  }
+  es_gc_stats(ctx, &before);
+  es_assert("a half full nursery should be worth collecting", es_gc_maybe(ctx));
+  es_gc_stats(ctx, &after);
+  es_assert("nursery should only get a minor collection", after.minor_collections == before.minor_collections + 1 && after.full_collections == before.full_collections);
+
+  while((size_t)(ctx->heap.nursery_next - ctx->heap.nursery) * 3 < ctx->heap.nursery_size) {
+    es_make_pair(ctx, es_nil, es_nil);
+  }
+  ctx->heap.stats.alloc_rate = 0;
+  es_assert("a third full nursery should not be collected at a low allocation rate", !es_gc_maybe(ctx));
+  ctx->heap.stats.alloc_rate = ctx->heap.nursery_size * 100.0;
+  es_gc_stats(ctx, &before);
+  es_assert("a nursery filling fast should be collected", es_gc_maybe(ctx));
+  es_gc_stats(ctx, &after);
+  es_assert("a fast allocation rate should trigger a minor collection", after.minor_collections == before.minor_collections + 1);
+
+  es_make_pair(ctx, es_nil, es_nil);
+  es_assert("no idle time should mean no collection", !es_gc_hint(ctx, 0));
+  for(int i = 0; i < 400000; i++) {
+    lst = es_make_pair(ctx, es_make_fixnum(i), lst);
+  }
+  es_gc_stats(ctx, &before);
+  es_assert("idle time should be spent collecting a grown heap", es_gc_hint(ctx, 1000000));
+  es_gc_stats(ctx, &after);
+  es_assert("idle collection should keep live data", after.full_collections == before.full_collections + 1 && es_list_length(lst) == 400000);
+
+onfail:
+  es_gc_unroot(ctx, 1);
+  es_ctx_free(ctx);
+}
+
+void test_heap_census() {
+  es_ctx_t* ctx = es_ctx_new(64 * MB);
+  const char* path = "test.heap";
+  es_census_t before = { { 0 }, { 0 } }, after = { { 0 }, { 0 } };
+  es_val_t lst = es_nil, port = es_nil;
+  FILE* out = tmpfile(), *in = NULL;
+  char line[256], expect[256];
+  int found = 0;
+  es_gc_root(ctx, lst);
+  es_gc_root(ctx, port);
+
+  es_gc(ctx);
+  heap_walk(&ctx->heap, census_visit, &before);
+  for(int i = 0; i < 1000; i++) {
+    lst = es_make_pair(ctx, es_make_vector(ctx, 3), lst);
+  }
+  for(int i = 0; i < 1000; i++) {
+    es_make_vector(ctx, 3);
+  }
+  es_gc(ctx);
+  heap_walk(&ctx->heap, census_visit, &after);
+  es_assert("census should count live objects by type", after.count[ES_VECTOR_TYPE] - before.count[ES_VECTOR_TYPE] == 1000);
+  es_assert("census should count live bytes by type", after.bytes[ES_PAIR_TYPE] - before.bytes[ES_PAIR_TYPE] == 1000 * es_size_of(lst));
+
+  port = es_make_port(ctx, out);
+  es_heap_census(ctx, port);
+  rewind(out);
+  es_assert("census should print a header", fgets(line, sizeof(line), out) && !strcmp(line, "live objects by type\n"));
+
+  es_assert("heap dump should be written", es_heap_dump(ctx, path) == 0);
+  es_assert("heap dump should be readable", (in = fopen(path, "r")) != NULL);
+  es_assert("heap dump should start with its header", fgets(line, sizeof(line), in) && !strcmp(line, "eva-heap-dump 1\n"));
+  snprintf(expect, sizeof(expect), "obj %#lx pair %zu %#lx %#lx\n", (unsigned long)es_val_to_obj(lst), es_size_of(lst),
+           (unsigned long)es_val_to_obj(es_car(lst)), (unsigned long)es_val_to_obj(es_cdr(lst)));
+  while(fgets(line, sizeof(line), in)) {
+    if (!strncmp(line, "root env ", 9))
+      found |= 1;
+    if (!strcmp(line, expect))
+      found |= 2;
+  }
+  es_assert("heap dump should list roots", found & 1);
+  es_assert("heap dump should list objects with their references", found & 2);
+
+onfail:
+  if (in)
+    fclose(in);
+  remove(path);
+  es_gc_unroot(ctx, 2);
+  es_ctx_free(ctx);
+  fclose(out);
+}
+
+void test_alloc_profile() {
+  es_ctx_t* ctx = es_ctx_new(64 * MB);
+  FILE* in  = tmpfile();
+  FILE* out = tmpfile();
+  char buf[4096];
+  size_t len;
+  int churn = -1, early = -1;
+
+  fputs("(define (early n) (if (eq? n 0) 0 (begin (cons n n) (early (- n 1)))))\n"
+        "(define (unprofiled) (lambda () 1))\n", in);
+  fputs("(define (churn n) (if (eq? n 0) 0 (begin (cons n n) ((lambda () n)) (churn (- n 1)))))\n"
+        "(churn 200000)\n"
+        "(early 100000)\n", in);
+  rewind(in);
+
+  es_val_t port = es_make_port(ctx, in);
+  es_val_t exp  = es_nil;
+  es_gc_root(ctx, port);
+  es_gc_root(ctx, exp);
+
+  es_eval(ctx, es_port_read(ctx, port));
+  es_eval(ctx, es_port_read(ctx, port));
+  es_assert("lambdas compiled without profiling should not be recorded", ctx->profile.nprocs == 1);
+
+  es_alloc_profile_start(ctx, 4096);
+  while(!es_is_eof_obj(exp = es_port_read(ctx, port))) {
+    es_eval(ctx, exp);
+  }
+  es_alloc_profile_stop(ctx);
+
+  for(int i = 1; i < ctx->profile.nprocs; i++) {
+    if (ctx->profile.procs[i].name == es_symbol_intern(ctx, "churn"))
+      churn = i;
+    if (ctx->profile.procs[i].name == es_symbol_intern(ctx, "early"))
+      early = i;
+  }
+
+  es_assert("defined procedures should be named", churn > 0);
+  es_assert("allocations should be attributed to the running procedure", ctx->profile.procs[churn].samples[ES_PAIR_TYPE] > 0);
+  es_assert("procedures compiled before profiling should be attributed", early > 0 && ctx->profile.procs[early].samples[ES_PAIR_TYPE] > 0);
+  es_assert("argument frames should be attributed to call sites", ctx->profile.nsites > 0);
+
+  es_alloc_profile_dump(ctx, es_make_port(ctx, out));
+  rewind(out);
+  len = fread(buf, 1, sizeof(buf) - 1, out);
+  buf[len] = '\0';
+
+  es_assert("dump should list the procedure", strstr(buf, "churn") != NULL && strstr(buf, "pair:") != NULL);
+
+onfail:
+  es_gc_unroot(ctx, 2);
+  fclose(out);
+  es_ctx_free(ctx);
+}
+
+void test_large_objects() {
+  es_heap_config_t configs[] = {
+    { 16 * MB, 0, 2.0, 0, 0 },
+    { 16 * MB, 0, 2.0, 0, 1 }
+  };
+
+  for(int c = 0; c < 2; c++) {
+    es_ctx_t* ctx = es_ctx_new_config(&configs[c]);
+    int ok = 1;
+
+    es_val_t vec = es_make_vector(ctx, 100000);
+    es_gc_root(ctx, vec);
+    es_vec_t* addr = es_vector_val(vec);
+
+    es_assert("big vectors should go to the large object space", ctx->heap.large != NULL && (obj_hdr_flags(es_obj_val(vec)) & ES_OBJ_LARGE));
+
+    for(int i = 0; i < 100000; i++) {
+      es_vector_set(ctx, vec, i, es_make_pair(ctx, es_make_fixnum(i), es_nil));
+    }
+    es_gc_minor(ctx);
+    es_gc(ctx);
+    es_gc(ctx);
+
+    for(int i = 0; i < 100000; i++) {
+      ok = ok && es_fixnum_val(es_car(es_vector_ref(vec, i))) == i;
+    }
+
+    es_assert("large objects should not move", es_vector_val(vec) == addr);
+    es_assert("large objects should keep their referents alive", ok);
+    es_assert("large objects should stay out of the old space",
+              ((char*)addr < ctx->heap.from_space || (char*)addr >= ctx->heap.from_space + ctx->heap.size));
+
+    for(int i = 0; i < 50; i++) {
+      es_make_vector(ctx, 100000);
+    }
+    es_gc_unroot(ctx, 1);
+    es_gc(ctx);
+
+    es_assert("unreachable large objects should be freed", ctx->heap.large == NULL && ctx->heap.large_bytes == 0);
+
+    es_ctx_free(ctx);
+    continue;
+onfail:
+    es_gc_unroot(ctx, 1);
+    es_ctx_free(ctx);
+    return;
+  }
+}
+
+void test_finalization() {
+  es_heap_config_t configs[] = {
+    { 16 * MB, 0, 2.0, 0, 0 },
+    { 16 * MB, 0, 2.0, 0, 1 }
+  };
+
+  for(int c = 0; c < 2; c++) {
+    es_ctx_t* ctx = es_ctx_new_config(&configs[c]);
+    FILE* in = tmpfile();
+    fputs("(a b c)", in);
+    rewind(in);
+
+    es_val_t port = es_make_port(ctx, in);
+    es_gc_root(ctx, port);
+    int queued = ctx->heap.finalizable.count;
+
+    es_assert("port objects should not carry their buffers on the heap", es_size_of(port) < 64);
+
+    for(int i = 0; i < 1000; i++) {
+      es_make_port(ctx, stdout);
+    }
+    es_assert("ports should be queued for finalization", ctx->heap.finalizable.count == queued + 1000);
+
+    es_gc_minor(ctx);
+    es_gc(ctx);
+
+    es_assert("dead ports should be finalized", ctx->heap.finalizable.count <= queued);
+    es_assert("live ports should keep working after collection", es_list_length(es_port_read(ctx, port)) == 3);
+
+    es_gc_unroot(ctx, 1);
+    es_ctx_free(ctx);
+    fclose(in);
+    continue;
+onfail:
+    es_gc_unroot(ctx, 1);
+    es_ctx_free(ctx);
+    fclose(in);
+    return;
+  }
+}
+
+void test_weak_refs() {
+  es_heap_config_t configs[] = {
+    { 16 * MB, 0, 2.0, 0, 0 },
+    { 16 * MB, 0, 2.0, 0, 1 }
+  };
+
+  for(int c = 0; c < 2; c++) {
+    es_ctx_t* ctx = es_ctx_new_config(&configs[c]);
+    es_val_t kept = es_nil, young = es_nil, box = es_nil;
+    es_val_t eph  = es_nil, table = es_nil, key = es_nil;
+    es_gc_root(ctx, kept);
+    es_gc_root(ctx, young);
+    es_gc_root(ctx, box);
+    es_gc_root(ctx, eph);
+    es_gc_root(ctx, table);
+    es_gc_root(ctx, key);
+
+    kept  = es_make_string(ctx, "kept value");
+    box   = es_make_weak_box(ctx, kept);
+    young = es_make_string(ctx, "young value");
+    young = es_make_weak_box(ctx, young);
+
+    es_gc_minor(ctx);
+    es_assert("weak box should be cleared by a minor collection", es_weak_box_value(young) == es_false);
+
+    es_gc(ctx);
+    es_assert("weak box should keep a live value", es_weak_box_value(box) == kept);
+
+    key = es_make_string(ctx, "ephemeron key");
+    eph = es_make_ephemeron(ctx, key, es_make_pair(ctx, key, es_nil));
+    key = es_nil;
+    es_gc(ctx);
+    es_assert("ephemeron value should not keep its own key alive", es_ephemeron_key(eph) == es_false);
+    es_assert("broken ephemeron should drop its value", es_ephemeron_value(eph) == es_false);
+
+    table = es_make_weak_table(ctx);
+    key   = es_make_string(ctx, "table key");
+    for(int i = 0; i < 100; i++) {
+      es_weak_table_set(ctx, table, es_make_fixnum(i), es_make_fixnum(i));
+      es_weak_table_set(ctx, table, es_make_string(ctx, "temporary"), es_make_fixnum(i));
+    }
+    es_weak_table_set(ctx, table, key, es_make_fixnum(42));
+    es_gc(ctx);
+    es_assert("weak table should find moved keys", es_fixnum_val(es_weak_table_ref(ctx, table, key, es_false)) == 42);
+    es_assert("weak table should keep immediate keys", es_fixnum_val(es_weak_table_ref(ctx, table, es_make_fixnum(7), es_false)) == 7);
+    es_assert("weak table should drop dead keys", es_weak_table_count(ctx, table) == 101);
+
+    es_gc_minor(ctx);
+    es_assert("minor collections should not rehash tenured keys", !weak_table_is_stale(ctx, table));
+    eph = es_make_string(ctx, "young key");
+    es_weak_table_set(ctx, table, eph, es_make_fixnum(9));
+    es_gc_minor(ctx);
+    es_assert("minor collections should invalidate tables of young keys", weak_table_is_stale(ctx, table));
+    es_assert("minor collections should rehash young keys", es_fixnum_val(es_weak_table_ref(ctx, table, eph, es_false)) == 9);
+    eph = es_nil;
+
+    key = es_nil;
+    es_gc(ctx);
+    es_assert("weak table should drop keys once unreachable", es_weak_table_count(ctx, table) == 100);
+
+    es_gc_unroot(ctx, 6);
+    es_ctx_free(ctx);
+    continue;
+onfail:
+    es_gc_unroot(ctx, 6);
+    es_ctx_free(ctx);
+    return;
+  }
+}
+
+static es_val_t native_triple(es_ctx_t* ctx, int argc, es_val_t argv[]) {
+  return es_make_fixnum(3 * es_fixnum_val(argv[0]));
+}
+
+static es_val_t native_unregistered(es_ctx_t* ctx, int argc, es_val_t argv[]) {
+  return argv[0];
+}
+
+void test_image() {
+  es_ctx_t* ctx = es_ctx_new(64 * MB), *img = NULL, *copy = NULL;
+  const char* path = "test.img";
+  char* msg = malloc(32);
+  FILE* in = tmpfile();
+  fputs("(define (twice x) (+ x x)) (twice 1)", in);
+  rewind(in);
+
+  es_val_t port = es_make_port(ctx, in), big = es_nil;
+  es_gc_root(ctx, port);
+  es_gc_root(ctx, big);
+  es_ctx_set_oport(ctx, es_make_port(ctx, stdout));
+  es_eval(ctx, es_port_read(ctx, port));
+  es_eval(ctx, es_port_read(ctx, port));
+
+  big = es_make_vector(ctx, ES_LARGE_OBJECT_SIZE / sizeof(es_val_t));
+  es_vector_set(ctx, big, 7, es_make_pair(ctx, es_make_fixnum(42), es_nil));
+  es_define(ctx, "big", big);
+  es_define_fn(ctx, "triple", native_triple, 1);
+  strcpy(msg, "heap allocated message");
+  es_define(ctx, "err", es_make_error(ctx, msg));
+
+  int symbols = ctx->symtab.next_id;
+  es_assert("image should be saved", es_ctx_save_image(ctx, path) == 0);
+  es_assert("saving should not intern error strings as symbols", ctx->symtab.next_id == symbols);
+  copy = es_ctx_clone(ctx);
+  es_assert("clone should not intern error strings as symbols", copy->symtab.next_id == symbols);
+  strcpy(msg, "overwritten");
+
+  img = es_ctx_load_image(path, NULL);
+  es_assert("image should load", img != NULL);
+  es_ctx_set_oport(img, es_make_port(img, stdout));
+
+  es_val_t twice = es_lookup_symbol(img, es_ctx_env(img), es_symbol_intern(img, "twice"));
+  es_val_t plus  = es_lookup_symbol(img, es_ctx_env(img), es_symbol_intern(img, "+"));
+  es_val_t vec   = es_lookup_symbol(img, es_ctx_env(img), es_symbol_intern(img, "big"));
+  es_assert("image should keep symbol ids", es_symbol_intern(img, "twice") == es_symbol_intern(ctx, "twice"));
+  es_assert("image should keep compiled procedures", es_fixnum_val(es_apply(img, twice, es_make_list(img, es_make_fixnum(21), es_void))) == 42);
+  es_assert("image should keep builtins", es_fixnum_val(es_apply(img, plus, es_make_list(img, es_make_fixnum(40), es_make_fixnum(2), es_void))) == 42);
+  es_assert("image should keep large objects", es_fixnum_val(es_car(es_vector_ref(vec, 7))) == 42);
+  es_val_t triple = es_lookup_symbol(img, es_ctx_env(img), es_symbol_intern(img, "triple"));
+  es_val_t err    = es_lookup_symbol(img, es_ctx_env(img), es_symbol_intern(img, "err"));
+  es_assert("image should find natives by name", es_fixnum_val(es_apply(img, triple, es_make_list(img, es_make_fixnum(14), es_void))) == 42);
+  es_assert("image should carry error strings", !strcmp(es_error_val(err)->errstr, "heap allocated message"));
+  es_assert("image should not intern error strings as symbols", img->symtab.next_id == symbols);
+  err = es_lookup_symbol(copy, es_ctx_env(copy), es_symbol_intern(copy, "err"));
+  es_assert("clone should own its error strings", !strcmp(es_error_val(err)->errstr, "heap allocated message"));
+
+  es_gc(img);
+  es_gc(img);
+  twice = es_lookup_symbol(img, es_ctx_env(img), es_symbol_intern(img, "twice"));
+  es_assert("loaded heap should survive collection", es_fixnum_val(es_apply(img, twice, es_make_list(img, es_make_fixnum(4), es_void))) == 8);
+
+  es_assert("missing image should not load", es_ctx_load_image("missing.img", NULL) == NULL);
+
+  es_define(ctx, "anonymous", es_make_fn(ctx, 1, native_unregistered));
+  es_assert("natives without a registered name should not be saved", es_ctx_save_image(ctx, path) == -1);
+
+onfail:
+  remove(path);
+  es_gc_unroot(ctx, 2);
+  es_ctx_free(ctx);
+  if (img)
+    es_ctx_free(img);
+  if (copy)
+    es_ctx_free(copy);
+  free(msg);
+  fclose(in);
+}
+
+static es_val_t eval_string(es_ctx_t* ctx, const char* str) {
+  FILE* in = tmpfile();
+  fputs(str, in);
+  rewind(in);
+  es_val_t res = es_eval(ctx, es_port_read(ctx, es_make_port(ctx, in)));
+  fclose(in);
+  return res;
+}
+
+void test_ctx_clone() {
+  es_ctx_t* ctx = es_ctx_new(64 * MB), *copy = NULL;
+  es_val_t table = es_make_weak_table(ctx), key = es_nil;
+  es_gc_root(ctx, key);
+  es_ctx_set_oport(ctx, es_make_port(ctx, stdout));
+  eval_string(ctx, "(define (twice x) (+ x x))");
+  key = es_make_pair(ctx, es_make_fixnum(1), es_nil);
+  es_weak_table_set(ctx, table, key, es_make_fixnum(7));
+  es_define(ctx, "table", table);
+  es_define(ctx, "key", key);
+
+  copy = es_ctx_clone(ctx);
+  es_assert("context should clone", copy != NULL);
+  es_define(ctx, "twice", es_make_fixnum(0));
+  es_ctx_free(ctx);
+  ctx = NULL;
+
+  es_val_t twice = es_lookup_symbol(copy, es_ctx_env(copy), es_symbol_intern(copy, "twice"));
+  es_assert("clone should keep compiled procedures", es_fixnum_val(es_apply(copy, twice, es_make_list(copy, es_make_fixnum(21), es_void))) == 42);
+  es_assert("clone should keep its own globals", es_fixnum_val(eval_string(copy, "(twice 2)")) == 4);
+
+  table = es_lookup_symbol(copy, es_ctx_env(copy), es_symbol_intern(copy, "table"));
+  key   = es_lookup_symbol(copy, es_ctx_env(copy), es_symbol_intern(copy, "key"));
+  es_assert("clone should rehash weak tables", es_fixnum_val(es_weak_table_ref(copy, table, key, es_false)) == 7);
+
+  for(int i = 0; i < 50; i++) {
+    es_ctx_t* next = es_ctx_clone(copy);
+    es_assert("clone of a clone should work", es_fixnum_val(eval_string(next, "(twice 5)")) == 10);
+    es_ctx_free(next);
+  }
+
+onfail:
+  if (ctx) {
+    es_gc_unroot(ctx, 1);
+    es_ctx_free(ctx);
+  }
+  if (copy)
+    es_ctx_free(copy);
+}
+
+void test_memory_cap() {
+  es_heap_config_t config = { 4 * MB, 0, 2.0, 0, 0, 0, 24 * MB };
+  es_ctx_t* ctx = es_ctx_new_config(&config);
+  es_val_t res;
+
+  res = eval_string(ctx, "(define (grow l) (grow (cons l l))) (grow '())");
+  res = eval_string(ctx, "(grow '())");
+  es_assert("hitting the memory cap should return an error", es_is_error(res) && !strcmp(es_error_val(res)->errstr, "out of memory"));
+  es_assert("hitting the memory cap should reset the VM", ctx->sp == ctx->stack && ctx->fp == 0 && ctx->roots.top == 0);
+  es_assert("heap should stay within the memory cap", heap_footprint(&ctx->heap) <= 24 * MB);
+  es_assert("context should be usable after running out of memory", es_fixnum_val(eval_string(ctx, "(+ 1 2)")) == 3);
+
+  es_region_begin(ctx);
+  res = eval_string(ctx, "(grow '())");
+  es_region_end(ctx);
+  es_assert("running out of memory in a region should return an error", es_is_error(res));
+  es_assert("heap should stay within the memory cap with regions", heap_footprint(&ctx->heap) <= 24 * MB);
+
+  es_val_t grow = es_lookup_symbol(ctx, es_ctx_env(ctx), es_symbol_intern(ctx, "grow"));
+  es_assert("es_apply should return an error too", es_is_error(es_apply(ctx, grow, es_make_list(ctx, es_nil, es_void))));
+  es_assert("context should be usable again", es_fixnum_val(eval_string(ctx, "(+ 1 2)")) == 3);
+
+onfail:
+  es_ctx_free(ctx);
+}
+
+void test_pointer_tags() {
+  es_heap_config_t configs[] = {
+    { 4 * MB, 0, 2.0, 0, 0, 0, 0 },
+    { 4 * MB, 0, 2.0, 0, 1, 0, 0 },
+    { 4 * MB, 0, 2.0, 0, 0, 4, 0 },
+  };
+  es_ctx_t* ctx = NULL;
+
+  for(int c = 0; c < 3; c++) {
+    ctx = es_ctx_new_config(&configs[c]);
+    es_val_t lst = es_nil, fn = eval_string(ctx, "(lambda (x) (cons x x))");
+    es_gc_root(ctx, lst);
+    es_gc_root(ctx, fn);
+
+    es_assert("pair should carry the pair tag", (es_make_pair(ctx, es_nil, es_nil) & ES_TAG_MASK) == ES_PAIR_TAG);
+    es_assert("closure should carry the closure tag", (fn & ES_TAG_MASK) == ES_CLOSURE_TAG);
+    es_assert("tagged objects should keep their types", es_type_of(fn) == ES_CLOSURE_TYPE && es_is_closure(fn) && !es_is_pair(fn) && !es_is_fn(fn));
+    es_assert("predicates should reject other values", !es_is_pair(es_nil) && !es_is_pair(es_make_fixnum(6)) && !es_is_closure(es_make_char('a'))
+              && !es_is_pair(es_make_string(ctx, "ab")) && es_is_fixnum(es_make_fixnum(-7)) && !es_is_symbol(fn));
+
+    for(int i = 0; i < 100000; i++) {
+      es_val_t args = es_make_list(ctx, es_make_fixnum(i), es_void);
+      es_val_t pair = es_apply(ctx, fn, args);
+      lst = es_cons(ctx, pair, lst);
+    }
+    es_gc_minor(ctx);
+    es_gc(ctx);
+    es_gc(ctx);
+
+    int ok = es_is_closure(fn) && es_list_length(lst) == 100000, i = 99999;
+    for(es_val_t l = lst; ok && !es_is_nil(l); l = es_cdr(l), i--)
+      ok = es_is_pair(l) && es_is_pair(es_car(l)) && es_fixnum_val(es_caar(l)) == i && es_fixnum_val(es_cdar(l)) == i;
+    es_assert("tags should survive collection", ok);
+    es_val_t args = es_make_list(ctx, es_make_fixnum(3), es_void);
+    es_assert("closure should still apply after collection", es_fixnum_val(es_car(es_apply(ctx, fn, args))) == 3);
+
+    es_gc_unroot(ctx, 2);
+    es_ctx_free(ctx);
+    ctx = NULL;
+  }
+
+  ctx = es_ctx_new(64 * MB);
+  eval_string(ctx, "(define pairs (list (cons 1 2) (lambda () 3)))");
+  es_ctx_t* copy = es_ctx_clone(ctx);
+  es_val_t pairs = es_lookup_symbol(copy, es_ctx_env(copy), es_symbol_intern(copy, "pairs"));
+  es_assert("clone should keep tagged references", es_is_pair(pairs) && es_is_pair(es_car(pairs)) && es_is_closure(es_cadr(pairs)));
+  es_ctx_free(copy);
+
+onfail:
+  if (ctx)
+    es_ctx_free(ctx);
+}
+
+void test_small_strings() {
+  es_ctx_t* ctx = es_ctx_new(64 * MB);
+  FILE* out = tmpfile();
+  char buf[64] = { 0 };
+  es_val_t str = es_nil, big = es_nil;
+  es_gc_root(ctx, big);
+
+  char* before = ctx->heap.next;
+  str = es_make_string(ctx, "abcdef");
+  es_assert("short string should not allocate", ctx->heap.next == before && !is_obj(str));
+  es_assert("short string should be a string", es_is_string(str) && es_type_of(str) == ES_STRING_TYPE);
+  es_assert("short string should keep its characters", es_string_ref(str, 0) == 'a' && es_string_ref(str, 5) == 'f');
+  es_assert("equal short strings should be eq", es_is_eq(str, es_make_string(ctx, "abcdef")));
+  es_assert("empty string should be immediate", !is_obj(es_make_string(ctx, "")) && es_is_string(es_make_string(ctx, "")));
+  es_assert("short string should be sized like an immediate", es_size_of(es_make_string(ctx, "ab")) == sizeof(es_val_t));
+
+  big = es_make_string(ctx, "abcdefg");
+  es_assert("longer string should be allocated", is_obj(big) && es_is_string(big) && es_string_ref(big, 6) == 'g');
+  es_assert("make-string should pack short strings", es_string_ref(es_string_make(ctx, 3, 'z'), 2) == 'z' && !is_obj(es_string_make(ctx, 3, 'z')));
+
+  str = eval_string(ctx, "\"key\"");
+  es_assert("reader should produce short strings", es_is_string(str) && !is_obj(str) && es_string_ref(str, 2) == 'y');
+  es_assert("string-ref should read short strings", es_char_val(eval_string(ctx, "(string-ref \"tag\" 1)")) == 'a');
+
+  es_val_t port = es_make_port(ctx, out);
+  es_print(ctx, str, port);
+  es_print(ctx, big, port);
+  rewind(out);
+  fgets(buf, sizeof(buf), out);
+  es_assert("printer should write short strings", !strcmp(buf, "\"key\"\"abcdefg\""));
+
+  es_gc(ctx);
+  es_assert("strings should survive collection", es_string_ref(str, 0) == 'k' && es_string_ref(big, 0) == 'a');
+
+onfail:
+  es_gc_unroot(ctx, 1);
+  es_ctx_free(ctx);
+}
+
+void test_stack_frames() {
+  es_ctx_t* ctx = es_ctx_new(64 * MB);
+  es_gc_stats_t before, after;
+
+  eval_string(ctx, "(define (loop n acc) (if (eq? n 0) acc (loop (- n 1) (+ acc 1))))");
+  eval_string(ctx, "(define (adder n) (lambda (x) (+ x n)))");
+  eval_string(ctx, "(define (rest a . r) (cons a r))");
+  eval_string(ctx, "(define (deep n p) (if (eq? n 0) (begin (gc) 0) (+ (car p) (deep (- n 1) (cons n n)))))");
+
+  es_gc_stats(ctx, &before);
+  es_assert("leaf procedure should loop", es_fixnum_val(eval_string(ctx, "(loop 100000 0)")) == 100000);
+  es_gc_stats(ctx, &after);
+  es_assert("leaf procedure frames should not be allocated", after.bytes_allocated - before.bytes_allocated < 100000 * sizeof(es_args_t) / 10);
+
+  es_assert("captured frames should still be kept", es_fixnum_val(eval_string(ctx, "((adder 2) 3)")) == 5);
+  eval_string(ctx, "(define (outer x) ((lambda (y) (lambda () (+ x y))) 1))");
+  es_assert("closures should capture every enclosing frame", es_fixnum_val(eval_string(ctx, "((outer 41))")) == 42);
+  eval_string(ctx, "(define (shared x) (receive (a) (values 1) (set! x (+ x a)) (lambda () x)))");
+  es_assert("receive bodies sharing a frame should capture it", es_fixnum_val(eval_string(ctx, "((shared 41))")) == 42);
+  es_assert("rest arguments should be collected", es_list_length(eval_string(ctx, "(rest 1 2 3)")) == 3);
+  es_assert("stack frames should survive collection", es_fixnum_val(eval_string(ctx, "(deep 300 (cons 0 0))")) == 45149);
+  es_assert("stack should be empty after a call", ctx->sp == ctx->stack && ctx->fp == 0);
+
+onfail:
+  es_ctx_free(ctx);
+}
+
+void test_deep_recursion() {
+  es_ctx_t* ctx = es_ctx_new(64 * MB);
+  es_val_t res;
+
+  eval_string(ctx, "(define (iota n acc) (if (eq? n 0) acc (iota (- n 1) (cons n acc))))");
+  eval_string(ctx, "(define big (iota 100000 '()))");
+  es_assert("map should handle long lists", es_list_length(eval_string(ctx, "(map (lambda (x) (+ x 1)) big)")) == 100000);
+  es_assert("append should handle long lists", es_list_length(eval_string(ctx, "(append big big)")) == 200000);
+  es_assert("foldr should handle long lists", es_fixnum_val(eval_string(ctx, "(foldr (lambda (a b) (+ b 1)) 0 big)")) == 100000);
+
+  res = eval_string(ctx, "(define (down n) (+ 1 (down n))) (down 0)");
+  res = eval_string(ctx, "(down 0)");
+  es_assert("unbounded recursion should return an error", es_is_error(res) && !strcmp(es_error_val(res)->errstr, "stack overflow"));
+  es_assert("stack overflow should reset the VM", ctx->sp == ctx->stack && ctx->fp == 0);
+  es_assert("context should be usable after a stack overflow", es_fixnum_val(eval_string(ctx, "(+ 1 2)")) == 3);
+
+  eval_string(ctx, "(define (f x) (set! x 1) (lambda () 2))");
+  res = eval_string(ctx, "(f 0)");
+  es_assert("assigning an argument should leave the stack balanced", es_is_closure(res) && ctx->sp == ctx->stack);
+  eval_string(ctx, "(define (g x) (set! x (+ x 1)) x)");
+  res = eval_string(ctx, "(g 1)");
+  es_assert("assigned arguments should be read back", es_fixnum_val(res) == 2 && ctx->sp == ctx->stack);
+  res = eval_string(ctx, "(undefined-procedure)");
+  es_assert("calling a non procedure should return an error", es_is_error(res) && ctx->sp == ctx->stack);
+  eval_string(ctx, "(define (h) (5 1 2))");
+  res = eval_string(ctx, "(h)");
+  es_assert("tail calling a non procedure should return an error", es_is_error(res) && ctx->sp == ctx->stack && ctx->fp == 0);
+  es_assert("deep stacks should be trimmed on return", ctx->stack_limit == ctx->stack + ES_STACK_RETAIN && ctx->frame_limit == ES_STACK_RETAIN - 2);
+
+  es_ctx_free(ctx);
+  es_heap_config_t config = { 64 * MB, 0, 2.0, 0, 0, 0, 0, 1000 };
+  ctx = es_ctx_new_config(&config);
+  eval_string(ctx, "(define (count n) (if (eq? n 0) 0 (+ 1 (count (- n 1)))))");
+  es_assert("recursion within the depth limit should succeed", es_fixnum_val(eval_string(ctx, "(count 200)")) == 200);
+  res = eval_string(ctx, "(count 2000)");
+  es_assert("recursion past the depth limit should overflow", es_is_error(res) && !strcmp(es_error_val(res)->errstr, "stack overflow"));
+
+onfail:
+  es_ctx_free(ctx);
+}
+
+void test_multiple_values() {
+  es_ctx_t* ctx = es_ctx_new(64 * MB);
+  es_gc_stats_t before, after;
+  es_val_t res;
+
+  eval_string(ctx, "(define (divmod a b) (values (/ a b) (- a (* b (/ a b)))))");
+  eval_string(ctx, "(define (loop n acc) (if (eq? n 0) acc (receive (q r) (divmod n 3) (loop (- n 1) (+ acc r)))))");
+  eval_string(ctx, "(define (loop2 n acc) (if (eq? n 0) acc (call-with-values (lambda () (divmod n 3)) (lambda (q r) (loop2 (- n 1) (+ acc r))))))");
+  eval_string(ctx, "(define (bump x) (receive (a b) (values x 1) (set! x (+ a b)) x))");
+  eval_string(ctx, "(define (pick x) (receive (a b) (if (eq? x 0) (values 1 2) (values 3 4)) (cons a b)))");
+  eval_string(ctx, "(define cwv call-with-values)");
+
+  res = eval_string(ctx, "(receive (q r) (divmod 17 5) (cons q r))");
+  es_assert("receive should bind both values", es_fixnum_val(es_car(res)) == 3 && es_fixnum_val(es_cdr(res)) == 2);
+  res = eval_string(ctx, "(call-with-values (lambda () (values 1 2)) cons)");
+  es_assert("call-with-values should pass the values to a procedure", es_fixnum_val(es_car(res)) == 1 && es_fixnum_val(es_cdr(res)) == 2);
+  res = eval_string(ctx, "(cwv (lambda () (values 3 4)) cons)");
+  es_assert("call-with-values should work as a procedure value", es_fixnum_val(es_car(res)) == 3 && es_fixnum_val(es_cdr(res)) == 4);
+  es_assert("a single result should be one value", es_fixnum_val(eval_string(ctx, "(cwv (lambda () 7) (lambda (a) a))")) == 7);
+  es_assert("zero values should be received", es_is_symbol(eval_string(ctx, "(cwv (lambda () (values)) (lambda () 'none))")));
+  es_assert("rest formals should collect the values", es_list_length(eval_string(ctx, "(receive (a . r) (values 1 2 3) r)")) == 2);
+  es_assert("values should flow through if", es_fixnum_val(es_cdr(eval_string(ctx, "(pick 1)"))) == 4);
+  es_assert("assigned variables should be shared with the body", es_fixnum_val(eval_string(ctx, "(bump 10)")) == 11);
+  es_assert("a single value context should take the first value", es_fixnum_val(eval_string(ctx, "(+ 1 (values 5 6))")) == 6);
+  es_assert("continuations should return multiple values", es_fixnum_val(eval_string(ctx, "(receive (a b) (call/cc (lambda (k) (k 1 2))) b)")) == 2);
+
+  es_gc_stats(ctx, &before);
+  es_assert("receive should loop", es_fixnum_val(eval_string(ctx, "(loop 100000 0)")) == 100000);
+  es_assert("call-with-values should loop", es_fixnum_val(eval_string(ctx, "(loop2 100000 0)")) == 100000);
+  es_gc_stats(ctx, &after);
+  es_assert("two values should not allocate", after.bytes_allocated - before.bytes_allocated < 100000 * sizeof(es_args_t) / 10);
+  es_assert("stack should be empty after receiving", ctx->sp == ctx->stack && ctx->fp == 0);
+
+onfail:
+  es_ctx_free(ctx);
+}
+
+void test_iterators() {
+  es_ctx_t* ctx = es_ctx_new(64 * MB);
+  es_gc_stats_t before, after;
+  es_val_t res;
+
+  eval_string(ctx, "(define (count-up i n yield) (if (eq? i n) 'done (begin (yield i) (count-up (+ i 1) n yield))))");
+  eval_string(ctx, "(define (walk t yield) (if (pair? t) (begin (walk (car t) yield) (walk (cdr t) yield)) (if (null? t) #f (yield t))))");
+  eval_string(ctx, "(define (deep n it) (if (eq? n 0) (iterator-next it) (+ 0 (deep (- n 1) it))))");
+  eval_string(ctx, "(define total 0)");
+  eval_string(ctx, "(define (add x) (set! total (+ total x)))");
+  eval_string(ctx, "(define (iota n acc) (if (eq? n 0) acc (iota (- n 1) (cons n acc))))");
+  eval_string(ctx, "(define big (iota 100000 '()))");
+
+  eval_string(ctx, "(define l (make-iterator '(1 2)))");
+  es_assert("list iterator should step", es_fixnum_val(eval_string(ctx, "(iterator-next l)")) == 1 && es_fixnum_val(eval_string(ctx, "(iterator-next l)")) == 2);
+  es_assert("list iterator should end with eof", es_is_eof_obj(eval_string(ctx, "(iterator-next l)")));
+  eval_string(ctx, "(define s (make-iterator \"iterate\"))");
+  es_assert("string iterator should return chars", es_char_val(eval_string(ctx, "(iterator-next s)")) == 'i');
+  es_assert("non sequences should not be iterated", es_is_error(eval_string(ctx, "(make-iterator 5)")));
+
+  eval_string(ctx, "(define g (make-iterator (lambda (yield) (yield 1) (yield 2) 'done)))");
+  es_assert("generator should yield in order", es_fixnum_val(eval_string(ctx, "(iterator-next g)")) == 1);
+  eval_string(ctx, "(gc)");
+  es_assert("suspended generator should survive collection", es_fixnum_val(eval_string(ctx, "(deep 50 g)")) == 2);
+  es_assert("generator should end with eof", es_is_eof_obj(eval_string(ctx, "(iterator-next g)")));
+  es_assert("finished generator should stay done", es_is_eof_obj(eval_string(ctx, "(iterator-next g)")));
+  es_assert("yield outside the generator should fail", es_is_error(eval_string(ctx, "(g 3)")));
+
+  eval_string(ctx, "(define w (make-iterator (lambda (yield) (walk '((1 2) (3 (4 5)) 6) yield))))");
+  eval_string(ctx, "(iterator-for-each add w)");
+  es_assert("generator should suspend deep recursion", es_fixnum_val(eval_string(ctx, "total")) == 21);
+  res = eval_string(ctx, "(iterator-for-each add 5)");
+  es_assert("iterator-for-each should stop at an error", es_is_error(res) && strcmp(es_error_val(res)->errstr, "stack overflow"));
+  es_assert("stack should be empty after an iteration error", ctx->sp == ctx->stack && ctx->fp == 0);
+
+  eval_string(ctx, "(set! total 0)");
+  eval_string(ctx, "(define c (make-iterator (lambda (yield) (count-up 0 100000 yield))))");
+  es_gc_stats(ctx, &before);
+  eval_string(ctx, "(iterator-for-each (lambda (x) (set! total (+ total 1))) c)");
+  eval_string(ctx, "(iterator-for-each (lambda (x) (set! total (+ total 1))) (make-iterator big))");
+  es_gc_stats(ctx, &after);
+  res = eval_string(ctx, "total");
+  es_assert("iterator-for-each should visit every element", es_fixnum_val(res) == 200000);
+  es_assert("iterating should take constant memory", after.bytes_allocated - before.bytes_allocated < 100000 * sizeof(es_val_t) / 10);
+  es_assert("stack should be empty after iterating", ctx->sp == ctx->stack && ctx->fp == 0);
+
+onfail:
+  es_ctx_free(ctx);
+}
+
+void test_symbol_table() {
+  es_ctx_t* ctx = es_ctx_new(64 * MB), *clone = NULL;
+  char name[32], *longname = NULL;
+  int ok = 1;
+
+  for(int i = 0; i < 50000 && ok; i++) {
+    sprintf(name, "sym-%d", i);
+    ok = es_is_symbol(es_symbol_intern(ctx, name));
+  }
+  es_assert("interning should not be capped", ok);
+  for(int i = 0; i < 50000 && ok; i++) {
+    sprintf(name, "sym-%d", i);
+    es_val_t sym = es_symbol_intern(ctx, name);
+    ok = es_symbol_val(sym) == es_symbol_val(es_symbol_intern(ctx, name)) &&
+         strcmp(symtab_find_by_id(&ctx->symtab, es_symbol_val(sym)), name) == 0;
+  }
+  es_assert("interned symbols should round trip", ok);
+  es_assert("symbols should stay distinct", es_symbol_val(es_symbol_intern(ctx, "sym-1")) != es_symbol_val(es_symbol_intern(ctx, "sym-10")));
+
+  longname = malloc(ES_SYMTAB_ARENA * 2);
+  memset(longname, 'x', ES_SYMTAB_ARENA * 2 - 1);
+  longname[ES_SYMTAB_ARENA * 2 - 1] = '\0';
+  es_val_t sym = es_symbol_intern(ctx, longname);
+  es_assert("names larger than an arena chunk should intern", strcmp(symtab_find_by_id(&ctx->symtab, es_symbol_val(sym)), longname) == 0);
+
+  es_assert("evaluation should still resolve symbols", es_fixnum_val(eval_string(ctx, "(begin (define sym-49999 7) sym-49999)")) == 7);
+  clone = es_ctx_clone(ctx);
+  es_assert("clone should keep symbol ids", clone && es_symbol_val(es_symbol_intern(clone, "sym-12345")) == es_symbol_val(es_symbol_intern(ctx, "sym-12345")));
+
+onfail:
+  free(longname);
+  if (clone) es_ctx_free(clone);
+  es_ctx_free(ctx);
+}
+
+void test_iterator_cycles() {
+  es_heap_config_t config = { 32 * MB, 32 * MB, 2.0, 200 };
+  es_ctx_t* ctx = es_ctx_new_config(&config);
+  int cycles = 0, steps = 0, ok = 1;
+
+  es_val_t vec = es_make_vector(ctx, 1000);
+  es_val_t it  = es_nil;
+  es_val_t lst = es_nil;
+  es_gc_root(ctx, vec);
+  es_gc_root(ctx, it);
+  es_gc_root(ctx, lst);
+  for(int i = 0; i < 1000; i++) {
+    es_vector_set(ctx, vec, i, es_make_fixnum(i));
+  }
+  it = es_make_iterator(ctx, vec);
+  es_gc(ctx);
+
+  for(int n = 0; n < 2000000 && ok; n++) {
+    lst = es_make_pair(ctx, es_make_fixnum(n), n % 100000 ? lst : es_nil);
+    if (n % 1000 == 0 && ctx->heap.inc_active) {
+      es_val_t x = iter_step(ctx, it);
+      ok = es_is_eof_obj(x) ? steps == 1000 : es_fixnum_val(x) == steps++;
+      cycles++;
+    }
+  }
+
+  es_assert("iterator should be stepped during incremental cycles", cycles > 0 && steps > 0);
+  es_assert("iterator position should survive incremental cycles", ok);
+
+onfail:
+  es_gc_unroot(ctx, 3);
+  es_ctx_free(ctx);
+}
+
+void test_continuations() {
+  es_ctx_t* ctx = es_ctx_new(64 * MB);
+  es_gc_stats_t before, after;
+  es_val_t res;
+
+  es_assert("continuation should return its argument", es_fixnum_val(eval_string(ctx, "(+ 1 (call/cc (lambda (k) (+ 10 (k 5)))))")) == 6);
+  es_assert("receiver returning should return from call/cc", es_fixnum_val(eval_string(ctx, "(call/cc (lambda (k) 42))")) == 42);
+
+  eval_string(ctx, "(define (find p l) (call/ec (lambda (return) (foldl (lambda (acc x) (if (p x) (return x) acc)) #f l))))");
+  eval_string(ctx, "(define (loop i) (call/cc (lambda (k) (if (eq? i 0) (k i) (loop (- i 1))))))");
+  es_assert("escape should leave a loop early", es_fixnum_val(eval_string(ctx, "(find (lambda (x) (eq? x 3)) '(1 2 3 4))")) == 3);
+  es_assert("continuations should work in tail position", es_fixnum_val(eval_string(ctx, "(loop 10000)")) == 0);
+  es_assert("captures should not grow the stacks", ctx->sp == ctx->stack && ctx->fp == 0);
+
+  es_gc_stats(ctx, &before);
+  eval_string(ctx, "(define (yes x) #t)");
+  eval_string(ctx, "(define (deep n) (if (eq? n 0) (find yes '(1)) (+ 0 (deep (- n 1)))))");
+  eval_string(ctx, "(deep 5000)");
+  es_gc_stats(ctx, &after);
+  es_assert("escape continuations should not copy the stack", after.bytes_allocated - before.bytes_allocated < 5000 * sizeof(es_val_t));
+
+  eval_string(ctx, "(define k2 #f)");
+  eval_string(ctx, "(define acc '())");
+  eval_string(ctx, "(define (f) (cons 'v (call/cc (lambda (k) (set! k2 k) 0))))");
+  eval_string(ctx, "(define (g) (set! acc (cons (f) acc)) (gc) (if (eq? (cdr (car acc)) 3) acc (k2 (+ (cdr (car acc)) 1))))");
+  es_assert("full continuation should be resumable after returning", es_list_length(eval_string(ctx, "(g)")) == 4);
+
+  eval_string(ctx, "(define n 0)");
+  eval_string(ctx, "(define (grab k) (set! k2 k))");
+  eval_string(ctx, "(define (bump x) (call/cc grab) (set! x (+ x 1)) (set! n (+ n 1)) (if (eq? n 3) x (k2 0)))");
+  es_assert("re-entering should keep assignments to arguments", es_fixnum_val(eval_string(ctx, "(bump 0)")) == 3);
+
+  eval_string(ctx, "(define e #f)");
+  eval_string(ctx, "(call/ec (lambda (k) (set! e k)))");
+  res = eval_string(ctx, "(e 1)");
+  es_assert("escape continuation should fail outside its extent", es_is_error(res));
+  es_assert("VM should be intact after a failed resume", es_fixnum_val(eval_string(ctx, "(+ 1 2)")) == 3);
+  es_assert("es_make_cont should return an error", es_is_error(es_make_cont(ctx)));
+
+onfail:
+  es_ctx_free(ctx);
+}
+
 void test_apply() {
   es_ctx_t* ctx = es_ctx_new(64 * MB);
 
@@ -68,6 +1212,32 @@ int main() {
   es_run(test_0);
   es_run(test_1);
   es_run(test_gc);
+  es_run(test_gc_minor);
+  es_run(test_region);
+  es_run(test_heap_resize);
+  es_run(test_obj_header);
+  es_run(test_gc_incremental);
+  es_run(test_gc_compact);
+  es_run(test_gc_parallel);
+  es_run(test_gc_stats);
+  es_run(test_gc_policy);
+  es_run(test_alloc_profile);
+  es_run(test_heap_census);
+  es_run(test_large_objects);
+  es_run(test_finalization);
+  es_run(test_weak_refs);
+  es_run(test_image);
+  es_run(test_ctx_clone);
+  es_run(test_memory_cap);
+  es_run(test_pointer_tags);
+  es_run(test_small_strings);
+  es_run(test_stack_frames);
+  es_run(test_deep_recursion);
+  es_run(test_continuations);
+  es_run(test_multiple_values);
+  es_run(test_iterators);
+  es_run(test_iterator_cycles);
+  es_run(test_symbol_table);
   es_run(test_apply);
 
   printf("Tests complete. (%d tests passed, %d tests failed)\n", passed, failed);